@@ -0,0 +1,207 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Stand-ins for logind and systemd on a private bus, just enough for pucrod to find a
+// single seat with an active session and to start transient units for its actions.
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+
+static const char kLogindService[] = "org.freedesktop.login1";
+static const char kLogindObject[] = "/org/freedesktop/login1";
+static const char kLogindManagerInterface[] = "org.freedesktop.login1.Manager";
+static const char kLogindSeatInterface[] = "org.freedesktop.login1.Seat";
+static const char kLogindSessionInterface[] = "org.freedesktop.login1.Session";
+
+static const char kSeatId[] = "seat0";
+static const char kSeatObject[] = "/org/freedesktop/login1/seat/seat0";
+static const char kSessionId[] = "1";
+static const char kSessionObject[] = "/org/freedesktop/login1/session/_31";
+
+static const char kSystemdService[] = "org.freedesktop.systemd1";
+static const char kSystemdObject[] = "/org/freedesktop/systemd1";
+static const char kSystemdManagerInterface[] = "org.freedesktop.systemd1.Manager";
+
+typedef struct MockState MockState;
+
+struct MockState {
+  const char *user;
+
+  uint32_t job_counter;
+  uint64_t first_start_usec;
+  uint64_t last_start_usec;
+};
+
+static uint64_t GetMonotonicUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int MethodListSeats(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  return sd_bus_reply_method_return(message, "a(so)", 1, kSeatId, kSeatObject);
+}
+
+static int GetActiveSession(sd_bus *bus, const char *path, const char *interface,
+                            const char *property, sd_bus_message *reply, void *userdata,
+                            sd_bus_error *error) {
+  return sd_bus_message_append(reply, "(so)", kSessionId, kSessionObject);
+}
+
+static int GetSessionName(sd_bus *bus, const char *path, const char *interface,
+                          const char *property, sd_bus_message *reply, void *userdata,
+                          sd_bus_error *error) {
+  MockState *state = userdata;
+  return sd_bus_message_append(reply, "s", state->user);
+}
+
+static int MethodStartTransientUnit(sd_bus_message *message, void *userdata,
+                                    sd_bus_error *error) {
+  MockState *state = userdata;
+  const char *unit_name = NULL, *mode = NULL;
+  int rc = 0;
+
+  uint64_t now = GetMonotonicUsec();
+  if (state->job_counter == 0) {
+    state->first_start_usec = now;
+  }
+  state->last_start_usec = now;
+
+  if ((rc = sd_bus_message_read(message, "ss", &unit_name, &mode)) < 0) {
+    return rc;
+  }
+
+  uint32_t job_id = ++state->job_counter;
+  char job_object[64];
+  snprintf(job_object, sizeof(job_object), "%s/job/%" PRIu32, kSystemdObject, job_id);
+
+  if ((rc = sd_bus_reply_method_return(message, "o", job_object)) < 0) {
+    return rc;
+  }
+
+  // Nothing is actually run, so the job is done as soon as it exists.
+  return sd_bus_emit_signal(sd_bus_message_get_bus(message), kSystemdObject,
+                            kSystemdManagerInterface, "JobRemoved", "uoss", job_id,
+                            job_object, unit_name, "done");
+}
+
+static int MethodSubscribe(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  return sd_bus_reply_method_return(message, NULL);
+}
+
+static const sd_bus_vtable kLogindManagerVtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("ListSeats", NULL, "a(so)", MethodListSeats, 0),
+    SD_BUS_SIGNAL("SeatNew", "so", 0),
+    SD_BUS_SIGNAL("SeatRemoved", "so", 0),
+    SD_BUS_VTABLE_END,
+};
+
+static const sd_bus_vtable kLogindSeatVtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("ActiveSession", "(so)", GetActiveSession, 0,
+                    SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_VTABLE_END,
+};
+
+static const sd_bus_vtable kLogindSessionVtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("Name", "s", GetSessionName, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_VTABLE_END,
+};
+
+static const sd_bus_vtable kSystemdManagerVtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("StartTransientUnit", "ssa(sv)a(sa(sv))", "o", MethodStartTransientUnit,
+                  0),
+    SD_BUS_METHOD("Subscribe", NULL, NULL, MethodSubscribe, 0),
+    SD_BUS_SIGNAL("JobRemoved", "uoss", 0),
+    SD_BUS_VTABLE_END,
+};
+
+static int ExitOnSignal(sd_event_source *source, const struct signalfd_siginfo *info,
+                        void *userdata) {
+  return sd_event_exit(sd_event_source_get_event(source), 0);
+}
+
+static void PrintSummary(const MockState *state) {
+  printf("StartTransientUnit calls: %" PRIu32 "\n", state->job_counter);
+
+  uint64_t elapsed_usec = state->last_start_usec - state->first_start_usec;
+  if (state->job_counter > 1 && elapsed_usec > 0) {
+    printf("Sustained rate: %.0f dispatches/s\n",
+           (state->job_counter - 1) * 1000000.0 / elapsed_usec);
+  }
+
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s USER\n", argv[0]);
+    return 2;
+  }
+
+  MockState state = {.user = argv[1]};
+  sd_event *event = NULL;
+  sd_bus *bus = NULL;
+  int rc = 0;
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+
+  // DBUS_SYSTEM_BUS_ADDRESS points this at the benchmark's private bus.
+  if ((rc = sd_event_default(&event)) < 0 || (rc = sd_bus_open_system(&bus)) < 0 ||
+      (rc = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL)) < 0) {
+    fprintf(stderr, "Failed to connect to the bus: %d\n", rc);
+    return 1;
+  }
+
+  if ((rc = sd_event_add_signal(event, NULL, SIGINT, ExitOnSignal, NULL)) < 0 ||
+      (rc = sd_event_add_signal(event, NULL, SIGTERM, ExitOnSignal, NULL)) < 0) {
+    fprintf(stderr, "Failed to add signal handlers: %d\n", rc);
+    return 1;
+  }
+
+  if ((rc = sd_bus_add_object_vtable(bus, NULL, kLogindObject, kLogindManagerInterface,
+                                     kLogindManagerVtable, &state)) < 0 ||
+      (rc = sd_bus_add_object_vtable(bus, NULL, kSeatObject, kLogindSeatInterface,
+                                     kLogindSeatVtable, &state)) < 0 ||
+      (rc = sd_bus_add_object_vtable(bus, NULL, kSessionObject, kLogindSessionInterface,
+                                     kLogindSessionVtable, &state)) < 0 ||
+      (rc = sd_bus_add_object_vtable(bus, NULL, kSystemdObject, kSystemdManagerInterface,
+                                     kSystemdManagerVtable, &state)) < 0) {
+    fprintf(stderr, "Failed to export objects: %d\n", rc);
+    return 1;
+  }
+
+  if ((rc = sd_bus_request_name(bus, kLogindService, 0)) < 0 ||
+      (rc = sd_bus_request_name(bus, kSystemdService, 0)) < 0) {
+    fprintf(stderr, "Failed to acquire service names: %d\n", rc);
+    return 1;
+  }
+
+  // Lets the runner know it can start pucrod.
+  printf("ready\n");
+  fflush(stdout);
+
+  if ((rc = sd_event_loop(event)) < 0) {
+    fprintf(stderr, "Failed to run event loop: %d\n", rc);
+    return 1;
+  }
+
+  PrintSummary(&state);
+
+  sd_bus_flush_close_unref(bus);
+  sd_event_unref(event);
+  return 0;
+}
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+# Runs pucrod end to end against stand-in logind and systemd services on a private bus,
+# replaying synthetic button presses as fast as possible, and reports the latency from
+# each press to its dispatch along with the sustained dispatch rate.
+
+import argparse
+import getpass
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+BTN_SIDE = 0x113
+SEAT = 'seat0'
+DEVICE = 'bench0'
+
+
+def write_config(path, user):
+    with open(path, 'w') as fp:
+        fp.write('rule {\n'
+                 '  buttons = { side }\n'
+                 f'  users = {{ {user} }}\n'
+                 '  action = "true"\n'
+                 '}\n')
+
+
+def write_events(path, clicks, interval_usec):
+    with open(path, 'w') as fp:
+        fp.write('# pucro-events 1\n')
+        for i in range(clicks):
+            time_usec = i * interval_usec
+            fp.write(f'{time_usec} {SEAT} {DEVICE} {BTN_SIDE} 1\n')
+            fp.write(f'{time_usec + interval_usec // 2} {SEAT} {DEVICE} {BTN_SIDE} 0\n')
+
+
+def start_bus(args):
+    bus = subprocess.Popen([args.dbus_daemon, '--nofork', '--print-address',
+                            f'--config-file={args.bus_config}'],
+                           stdout=subprocess.PIPE, text=True)
+    address = bus.stdout.readline().strip()
+    if not address:
+        bus.kill()
+        sys.exit('Failed to start dbus-daemon')
+
+    return bus, address
+
+
+def start_mock(args, env, user):
+    mock = subprocess.Popen([args.mock, user], stdout=subprocess.PIPE, env=env, text=True)
+    if mock.stdout.readline().strip() != 'ready':
+        mock.kill()
+        sys.exit('Failed to start mock services')
+
+    return mock
+
+
+def start_agent(args, env):
+    agent = subprocess.Popen([args.agent], env=env)
+    # The agent creates its socket right before it's ready.
+    for _ in range(100):
+        if os.path.exists(env['PUCRO_AGENT_SOCKET']):
+            return agent
+        time.sleep(0.05)
+
+    agent.kill()
+    sys.exit('Failed to start pucro-agent')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--pucrod', required=True)
+    parser.add_argument('--helper', required=True)
+    parser.add_argument('--mock', required=True)
+    parser.add_argument('--dbus-daemon', required=True)
+    parser.add_argument('--bus-config', required=True)
+    parser.add_argument('--agent', help='run pucro-agent from this path to spawn actions')
+    parser.add_argument('--mode', default='bus', choices=['spawn', 'bus'])
+    parser.add_argument('--clicks', type=int, default=2000)
+    parser.add_argument('--interval-usec', type=int, default=1000)
+    parser.add_argument('--low-latency', action='store_true',
+                        help='run pucrod with --low-latency to compare worst-case latency')
+    args = parser.parse_args()
+
+    user = getpass.getuser()
+
+    with tempfile.TemporaryDirectory(prefix='pucro-bench-') as tmp:
+        config_path = os.path.join(tmp, 'pucro.conf')
+        events_path = os.path.join(tmp, 'events')
+        write_config(config_path, user)
+        write_events(events_path, args.clicks, args.interval_usec)
+
+        bus, address = start_bus(args)
+        try:
+            env = dict(os.environ, DBUS_SYSTEM_BUS_ADDRESS=address,
+                       PUCRO_USER_BUS_ADDRESS=address, PUCRO_DISPATCH_HELPER=args.helper)
+            env.pop('NOTIFY_SOCKET', None)
+            if args.agent:
+                env['PUCRO_AGENT_SOCKET'] = os.path.join(tmp, 'agent.sock')
+
+            mock = start_mock(args, env, user)
+            agent = start_agent(args, env) if args.agent else None
+            try:
+                command = [args.pucrod, f'--config={config_path}',
+                           f'--dispatch-mode={args.mode}',
+                           f'--replay={events_path}', '--replay-speed=max']
+                if args.low_latency:
+                    command.append('--low-latency')
+                pucrod = subprocess.run(command, stderr=subprocess.PIPE, env=env, text=True)
+            finally:
+                if agent:
+                    agent.terminate()
+                    agent.wait()
+                mock.terminate()
+                summary, _ = mock.communicate()
+        finally:
+            bus.terminate()
+            bus.wait()
+
+    log = pucrod.stderr.splitlines()
+    if pucrod.returncode != 0:
+        print('\n'.join(log), file=sys.stderr)
+        sys.exit(f'pucrod exited with status {pucrod.returncode}')
+
+    print(f'{args.clicks} clicks dispatched in {args.mode} mode'
+          + (' with the agent' if args.agent else '')
+          + (' in low-latency mode' if args.low_latency else ''))
+    for i, line in enumerate(log):
+        if 'Replay finished' in line:
+            print('\n'.join(log[i + 1:]))
+            break
+    print(summary, end='')
+
+
+if __name__ == '__main__':
+    main()
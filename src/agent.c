@@ -0,0 +1,107 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "agent.h"
+
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char kAgentSocketName[] = "pucro-agent.sock";
+#ifdef PUCRO_BENCH_HOOKS
+// If set, every user's agent is reached at this path instead, so benchmarks can run one
+// without a real user session.
+static const char kAgentSocketEnv[] = "PUCRO_AGENT_SOCKET";
+#endif
+
+typedef struct AgentRequestHeader AgentRequestHeader;
+
+struct AgentRequestHeader {
+  uint32_t version;
+  uint32_t id;
+  uint32_t flags;
+  uint32_t argc;
+};
+
+char *Agent_GetSocketPath(uid_t uid) {
+#ifdef PUCRO_BENCH_HOOKS
+  const char *override = getenv(kAgentSocketEnv);
+  if (override != NULL) {
+    return StrDup(override);
+  }
+#endif
+
+  char *path = NULL;
+  if (asprintf(&path, "/run/user/%u/%s", (unsigned int)uid, kAgentSocketName) == -1) {
+    abort();
+  }
+
+  return path;
+}
+
+size_t AgentRequest_Encode(const AgentRequest *request, char *buffer, size_t size) {
+  AgentRequestHeader header = {
+      .version = kAgentProtocolVersion,
+      .id = request->id,
+      .flags = request->flags,
+      .argc = request->argc,
+  };
+
+  if (size < sizeof(header)) {
+    return 0;
+  }
+
+  memcpy(buffer, &header, sizeof(header));
+  size_t used = sizeof(header);
+
+  for (uint32_t i = 0; i < request->argc; i++) {
+    size_t len = strlen(request->argv[i]) + 1;
+    if (len > size - used) {
+      return 0;
+    }
+
+    memcpy(buffer + used, request->argv[i], len);
+    used += len;
+  }
+
+  return used;
+}
+
+bool AgentRequest_Decode(AgentRequest *request, char *buffer, size_t size) {
+  AgentRequestHeader header;
+  if (size < sizeof(header)) {
+    return false;
+  }
+
+  memcpy(&header, buffer, sizeof(header));
+  // Every argument takes at least its terminator, which bounds argc before allocating.
+  if (header.version != kAgentProtocolVersion || header.argc == 0 ||
+      header.argc > size - sizeof(header)) {
+    return false;
+  }
+
+  CLEANUP_AUTOFREE char **argv = Alloc(sizeof(char *) * (header.argc + 1));
+  char *p = buffer + sizeof(header), *end = buffer + size;
+  for (uint32_t i = 0; i < header.argc; i++) {
+    char *terminator = memchr(p, '\0', end - p);
+    if (terminator == NULL) {
+      return false;
+    }
+
+    argv[i] = p;
+    p = terminator + 1;
+  }
+
+  if (p != end) {
+    return false;
+  }
+
+  request->id = header.id;
+  request->flags = header.flags;
+  request->argc = header.argc;
+  request->argv = STEAL_POINTER(&argv);
+  return true;
+}
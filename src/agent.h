@@ -0,0 +1,57 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// The protocol pucrod speaks with pucro-agent, a user service that spawns actions
+// directly instead of having the user's systemd instance start a transient unit for each.
+// Messages are sent over a SOCK_SEQPACKET socket at kAgentSocketName in the user's
+// runtime directory, one request or reply per packet.
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct AgentRequest AgentRequest;
+typedef struct AgentReply AgentReply;
+
+extern const char kAgentSocketName[];
+
+enum {
+  kAgentProtocolVersion = 1,
+  kAgentMaxMessageSize = 64 * 1024,
+};
+
+typedef enum {
+  // argv holds a single shell command for the agent to run with the user's login shell.
+  kAgentRequestLoginShell = 1 << 0,
+} AgentRequestFlags;
+
+struct AgentRequest {
+  // Echoed back in the reply.
+  uint32_t id;
+  uint32_t flags;
+  // The argv, which must start with an absolute path unless kAgentRequestLoginShell is
+  // set. When encoded, the header is followed by argc NUL-terminated strings.
+  uint32_t argc;
+  char **argv;
+};
+
+struct AgentReply {
+  uint32_t id;
+  // 0 if the action was spawned, otherwise an errno value.
+  int32_t error;
+  int32_t pid;
+};
+
+// Returns the path of uid's agent socket in their runtime directory, /run/user/UID.
+char *Agent_GetSocketPath(uid_t uid);
+
+// Encodes request into buffer, returning its size, or 0 if it doesn't fit.
+size_t AgentRequest_Encode(const AgentRequest *request, char *buffer, size_t size);
+
+// Decodes a request in place, leaving argv pointing into buffer. argv must be freed
+// afterwards, but not the strings. Returns false if the request is malformed.
+bool AgentRequest_Decode(AgentRequest *request, char *buffer, size_t size);
@@ -0,0 +1,53 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "arena.h"
+
+#include "utils.h"
+
+#include <stdalign.h>
+#include <string.h>
+
+static const size_t kArenaChunkSize = 16384;
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t size;
+  size_t used;
+
+  alignas(max_align_t) unsigned char data[];
+};
+
+void *Arena_Alloc(Arena *arena, size_t bytes) {
+  bytes = (bytes + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+  ArenaChunk *chunk = arena->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < bytes) {
+    // Oversized allocations get a chunk of their own.
+    size_t size = bytes > kArenaChunkSize ? bytes : kArenaChunkSize;
+    chunk = Alloc(sizeof(ArenaChunk) + size);
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  void *p = chunk->data + chunk->used;
+  chunk->used += bytes;
+  return p;
+}
+
+char *Arena_StrDup(Arena *arena, const char *str) {
+  size_t length = strlen(str);
+  char *copy = Arena_Alloc(arena, length + 1);
+  memcpy(copy, str, length);
+  return copy;
+}
+
+void Arena_Clear(Arena *arena) {
+  for (ArenaChunk *chunk = STEAL_POINTER(&arena->chunks); chunk != NULL;) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
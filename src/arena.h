@@ -0,0 +1,23 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "utils.h"
+
+#include <stddef.h>
+
+typedef struct Arena Arena;
+typedef struct ArenaChunk ArenaChunk;
+
+// A bump allocator for data that is all freed at once.
+struct Arena {
+  ArenaChunk *chunks;
+};
+
+// Returns zeroed memory that lives until Arena_Clear.
+void *Arena_Alloc(Arena *arena, size_t bytes);
+char *Arena_StrDup(Arena *arena, const char *str);
+
+void Arena_Clear(Arena *arena);
@@ -0,0 +1,874 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// A compiled form of the rules, laid out as flat arrays that are mmapped and used in
+// place, so that starting up doesn't require parsing the config file:
+//
+//   ConfigCacheHeader
+//   ConfigCacheRule[rule_count]
+//   ConfigCacheButton[button_count]
+//   uint32_t names[name_count], each the offset of a user or group name in the strings
+//   char strings[strings_size], all NUL-terminated and deduplicated
+//
+// Everything is in host byte order, since the cache never leaves the machine.
+//
+// The main config file and each drop-in get a cache of their own. On top of that, the
+// compiled rules of every file are kept in memory between loads, so that a reload only
+// looks at the files that changed and merges them with the ones it already has.
+
+#include "config-cache.h"
+
+#include "src/utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uthash.h>
+
+#define CACHE_DIR LOCALSTATEDIR "/cache/pucro"
+
+typedef struct ConfigCacheHeader ConfigCacheHeader;
+typedef struct ConfigCacheRule ConfigCacheRule;
+typedef struct ConfigCacheButton ConfigCacheButton;
+typedef struct ConfigCacheSections ConfigCacheSections;
+typedef struct ConfigCacheString ConfigCacheString;
+typedef struct ConfigCacheWriter ConfigCacheWriter;
+typedef struct ConfigCacheFile ConfigCacheFile;
+
+static const char kCacheMagic[8] = "PUCRORC";
+static const char kCachePrefix[] = "rules-";
+static const uint32_t kCacheVersion = 4;
+
+static const uint64_t kFnvOffsetBasis = 0xcbf29ce484222325;
+static const uint64_t kFnvPrime = 0x100000001b3;
+
+static const size_t kHashBufferSize = 64 * 1024;
+
+struct ConfigCacheHeader {
+  char magic[8];
+  uint32_t version;
+  // Catch layout changes that the version wasn't bumped for.
+  uint32_t header_size;
+  uint32_t rule_size;
+
+  uint32_t rule_count;
+  uint32_t button_count;
+  uint32_t name_count;
+  uint32_t strings_size;
+
+  // The config file the cache was compiled from, which it is only valid for as long as
+  // none of these change.
+  uint32_t source_path;
+  uint64_t source_dev;
+  uint64_t source_ino;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  int64_t source_ctime_sec;
+  int64_t source_ctime_nsec;
+
+  // FNV-1a of everything following the header.
+  uint64_t checksum;
+};
+
+struct ConfigCacheRule {
+  uint32_t index;
+  uint32_t gesture;
+  uint32_t action;
+
+  // Ranges of the button and name arrays.
+  uint32_t buttons;
+  uint32_t button_count;
+  uint32_t users;
+  uint32_t user_count;
+  uint32_t groups;
+  uint32_t group_count;
+  // Empty for rules that run action through a shell.
+  uint32_t exec;
+  uint32_t exec_count;
+
+  uint32_t rate_limit_burst;
+  uint64_t rate_limit_interval_usec;
+  uint64_t debounce_usec;
+  uint64_t timeout_usec;
+};
+
+struct ConfigCacheButton {
+  uint32_t name;
+  uint32_t code;
+};
+
+struct ConfigCacheSections {
+  const ConfigCacheHeader *header;
+  const ConfigCacheRule *rules;
+  const ConfigCacheButton *buttons;
+  const uint32_t *names;
+  const char *strings;
+};
+
+struct ConfigCacheString {
+  const char *str;
+  uint32_t offset;
+
+  UT_hash_handle hh;
+};
+
+struct ConfigCacheWriter {
+  ConfigCacheString *interned;
+
+  char *strings;
+  size_t strings_size;
+  size_t strings_capacity;
+};
+
+// The compiled rules of a single file, as of its last load.
+struct ConfigCacheFile {
+  char *path;
+  struct stat st;
+  // FNV-1a of the file's contents, so that rewriting it unchanged doesn't reparse it.
+  uint64_t content_hash;
+  Config *config;
+
+  // Whether the file was part of the current load.
+  bool seen;
+
+  UT_hash_handle hh;
+};
+
+struct ConfigCache {
+  ConfigCacheFile *files;
+  // FNV-1a of the path of the main config file, which the names of all caches of this
+  // config start with, so that instances loading other configs leave them alone.
+  uint64_t config_hash;
+};
+
+static uint64_t Fnv1aUpdate(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * kFnvPrime;
+  }
+
+  return hash;
+}
+
+static uint64_t Fnv1a(const void *data, size_t size) {
+  return Fnv1aUpdate(kFnvOffsetBasis, data, size);
+}
+
+static const char *GetCacheDir() {
+  // Set by systemd from the service's CacheDirectory=.
+  const char *dir = getenv("CACHE_DIRECTORY");
+  return dir != NULL ? dir : CACHE_DIR;
+}
+
+// Returns the prefix of the names of all caches belonging to the config of cache.
+static char *GetCacheNamePrefix(ConfigCache *cache) {
+  char *prefix = NULL;
+  if (asprintf(&prefix, "%s%016" PRIx64 "-", kCachePrefix, cache->config_hash) == -1) {
+    abort();
+  }
+
+  return prefix;
+}
+
+static char *GetCacheName(ConfigCache *cache, const char *source_path) {
+  CLEANUP_AUTOFREE char *prefix = GetCacheNamePrefix(cache);
+
+  char *name = NULL;
+  if (asprintf(&name, "%s%016" PRIx64 ".bin", prefix,
+               Fnv1a(source_path, strlen(source_path))) == -1) {
+    abort();
+  }
+
+  return name;
+}
+
+static char *GetCachePath(ConfigCache *cache, const char *source_path) {
+  CLEANUP_AUTOFREE char *name = GetCacheName(cache, source_path);
+
+  char *path = NULL;
+  if (asprintf(&path, "%s/%s", GetCacheDir(), name) == -1) {
+    abort();
+  }
+
+  return path;
+}
+
+static bool IsSameSource(const ConfigCacheHeader *header, const struct stat *st) {
+  return header->source_dev == st->st_dev && header->source_ino == st->st_ino &&
+         header->source_size == (uint64_t)st->st_size &&
+         header->source_mtime_sec == st->st_mtim.tv_sec &&
+         header->source_mtime_nsec == st->st_mtim.tv_nsec &&
+         header->source_ctime_sec == st->st_ctim.tv_sec &&
+         header->source_ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+static bool IsValidRange(uint32_t start, uint32_t count, uint32_t total) {
+  return start <= total && count <= total - start;
+}
+
+static void GetSections(const void *mapping, ConfigCacheSections *sections) {
+  sections->header = mapping;
+  sections->rules = (const void *)(sections->header + 1);
+  sections->buttons = (const void *)(sections->rules + sections->header->rule_count);
+  sections->names = (const void *)(sections->buttons + sections->header->button_count);
+  sections->strings = (const void *)(sections->names + sections->header->name_count);
+}
+
+// Checks that every offset and range in the cache is in bounds, so that a corrupted file
+// can't make us read outside of it.
+static bool AreSectionsValid(const ConfigCacheSections *sections) {
+  const ConfigCacheHeader *header = sections->header;
+  if (header->strings_size == 0 || sections->strings[header->strings_size - 1] != '\0' ||
+      header->source_path >= header->strings_size) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header->rule_count; i++) {
+    const ConfigCacheRule *rule = &sections->rules[i];
+    if (rule->gesture >= kConfigGestureCount || rule->action >= header->strings_size ||
+        !IsValidRange(rule->buttons, rule->button_count, header->button_count) ||
+        !IsValidRange(rule->users, rule->user_count, header->name_count) ||
+        !IsValidRange(rule->groups, rule->group_count, header->name_count) ||
+        !IsValidRange(rule->exec, rule->exec_count, header->name_count)) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < header->button_count; i++) {
+    if (sections->buttons[i].name >= header->strings_size) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < header->name_count; i++) {
+    if (sections->names[i] >= header->strings_size) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static char **MapNames(Arena *arena, const ConfigCacheSections *sections,
+                       uint32_t start, uint32_t count) {
+  char **names = Arena_Alloc(arena, sizeof(char *) * (count + 1));
+  for (uint32_t i = 0; i < count; i++) {
+    // The mapping is read-only, but nothing writes to a loaded snapshot anyway.
+    names[i] = (char *)sections->strings + sections->names[start + i];
+  }
+
+  return names;
+}
+
+static void MapButtons(Arena *arena, const ConfigCacheSections *sections,
+                       const ConfigCacheRule *cached, ConfigRule *rule) {
+  rule->buttons = Arena_Alloc(arena, sizeof(char *) * (cached->button_count + 1));
+  rule->button_codes =
+      Arena_Alloc(arena, sizeof(unsigned int) * (cached->button_count + 1));
+  rule->button_count = cached->button_count;
+
+  for (uint32_t i = 0; i < cached->button_count; i++) {
+    const ConfigCacheButton *button = &sections->buttons[cached->buttons + i];
+    rule->buttons[i] = (char *)sections->strings + button->name;
+    rule->button_codes[i] = button->code;
+  }
+}
+
+static Config *BuildFromCache(const ConfigCacheSections *sections) {
+  Config *config = Config_New();
+  ConfigRule **tail = &config->rules;
+
+  for (uint32_t i = 0; i < sections->header->rule_count; i++) {
+    const ConfigCacheRule *cached = &sections->rules[i];
+
+    ConfigRule *rule = Arena_Alloc(&config->arena, sizeof(ConfigRule));
+    MapButtons(&config->arena, sections, cached, rule);
+    rule->users =
+        MapNames(&config->arena, sections, cached->users, cached->user_count);
+    rule->groups =
+        MapNames(&config->arena, sections, cached->groups, cached->group_count);
+    rule->action = (char *)sections->strings + cached->action;
+    if (cached->exec_count > 0) {
+      rule->exec = MapNames(&config->arena, sections, cached->exec, cached->exec_count);
+    }
+    rule->gesture = cached->gesture;
+    rule->index = cached->index;
+    rule->limiter.burst = cached->rate_limit_burst;
+    rule->limiter.interval_usec = cached->rate_limit_interval_usec;
+    rule->limiter.debounce_usec = cached->debounce_usec;
+    rule->timeout_usec = cached->timeout_usec;
+
+    // The cache is already in order of precedence.
+    *tail = rule;
+    tail = &rule->next;
+    config->rule_count++;
+  }
+
+  Config_BuildIndex(config);
+  return config;
+}
+
+static bool IsKnownFormat(const ConfigCacheHeader *header, size_t size) {
+  if (memcmp(header->magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      header->version != kCacheVersion ||
+      header->header_size != sizeof(ConfigCacheHeader) ||
+      header->rule_size != sizeof(ConfigCacheRule)) {
+    return false;
+  }
+
+  return size == sizeof(ConfigCacheHeader) +
+                     sizeof(ConfigCacheRule) * (size_t)header->rule_count +
+                     sizeof(ConfigCacheButton) * (size_t)header->button_count +
+                     sizeof(uint32_t) * (size_t)header->name_count +
+                     header->strings_size;
+}
+
+static Config *LoadFromMapping(const char *cache_path, const char *source_path,
+                               const struct stat *source_st, const void *mapping,
+                               size_t size) {
+  const ConfigCacheHeader *header = mapping;
+  if (!IsKnownFormat(header, size)) {
+    LogInfo("Ignoring rule cache %s in an unknown format", cache_path);
+    return NULL;
+  }
+
+  if (!IsSameSource(header, source_st)) {
+    LogDebug("Rule cache %s is out of date", cache_path);
+    return NULL;
+  }
+
+  if (Fnv1a(header + 1, size - sizeof(ConfigCacheHeader)) != header->checksum) {
+    LogInfo("Ignoring rule cache %s with a bad checksum", cache_path);
+    return NULL;
+  }
+
+  ConfigCacheSections sections;
+  GetSections(mapping, &sections);
+  if (!AreSectionsValid(&sections)) {
+    LogInfo("Ignoring corrupted rule cache %s", cache_path);
+    return NULL;
+  }
+
+  if (strcmp(sections.strings + header->source_path, source_path) != 0) {
+    // Two config files whose paths hash the same, which is unlikely but possible.
+    LogDebug("Rule cache %s belongs to another config file", cache_path);
+    return NULL;
+  }
+
+  return BuildFromCache(&sections);
+}
+
+static Config *LoadFromCache(const char *cache_path, const char *source_path,
+                             const struct stat *source_st) {
+  int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      LogErrno(errno, "Failed to open rule cache %s", cache_path);
+    }
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    LogErrno(errno, "Failed to stat rule cache %s", cache_path);
+    close(fd);
+    return NULL;
+  }
+
+  if ((size_t)st.st_size < sizeof(ConfigCacheHeader)) {
+    LogInfo("Ignoring truncated rule cache %s", cache_path);
+    close(fd);
+    return NULL;
+  }
+
+  void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    LogErrno(errno, "Failed to map rule cache %s", cache_path);
+    return NULL;
+  }
+
+  Config *config =
+      LoadFromMapping(cache_path, source_path, source_st, mapping, st.st_size);
+  if (config == NULL) {
+    munmap(mapping, st.st_size);
+    return NULL;
+  }
+
+  // The snapshot's strings point into the mapping, so it lives as long as the snapshot.
+  config->mapping = mapping;
+  config->mapping_size = st.st_size;
+  return config;
+}
+
+static void ConfigCacheWriter_Clear(ConfigCacheWriter *writer) {
+  ConfigCacheString *interned = NULL, *tmp = NULL;
+  HASH_ITER(hh, writer->interned, interned, tmp) {
+    HASH_DEL(writer->interned, interned);
+    free(interned);
+  }
+
+  free(STEAL_POINTER(&writer->strings));
+}
+
+static uint32_t InternString(ConfigCacheWriter *writer, const char *str) {
+  ConfigCacheString *interned = NULL;
+  HASH_FIND_STR(writer->interned, str, interned);
+  if (interned != NULL) {
+    return interned->offset;
+  }
+
+  size_t size = strlen(str) + 1;
+  if (writer->strings_size + size > writer->strings_capacity) {
+    writer->strings_capacity = (writer->strings_size + size) * 2;
+    writer->strings = realloc(writer->strings, writer->strings_capacity);
+    if (writer->strings == NULL) {
+      abort();
+    }
+  }
+
+  interned = Alloc(sizeof(ConfigCacheString));
+  interned->str = str;
+  interned->offset = writer->strings_size;
+  HASH_ADD_KEYPTR(hh, writer->interned, interned->str, size - 1, interned);
+
+  memcpy(writer->strings + writer->strings_size, str, size);
+  writer->strings_size += size;
+  return interned->offset;
+}
+
+static bool WriteAtomically(const char *path, const void *data, size_t size) {
+  CLEANUP_AUTOFREE char *dir = StrDup(path);
+  *strrchr(dir, '/') = '\0';
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    LogErrno(errno, "Failed to create cache directory %s", dir);
+    return false;
+  }
+
+  CLEANUP_AUTOFREE char *temp_path = NULL;
+  if (asprintf(&temp_path, "%s.XXXXXX", path) == -1) {
+    abort();
+  }
+
+  int fd = mkostemp(temp_path, O_CLOEXEC);
+  if (fd == -1) {
+    LogErrno(errno, "Failed to create %s", temp_path);
+    return false;
+  }
+
+  for (size_t written = 0; written < size;) {
+    ssize_t rc = write(fd, (const char *)data + written, size - written);
+    if (rc == -1 && errno != EINTR) {
+      LogErrno(errno, "Failed to write %s", temp_path);
+      close(fd);
+      unlink(temp_path);
+      return false;
+    }
+
+    written += rc > 0 ? rc : 0;
+  }
+
+  close(fd);
+
+  // Readers only ever see the old cache or the complete new one.
+  if (rename(temp_path, path) == -1) {
+    LogErrno(errno, "Failed to move %s into place", temp_path);
+    unlink(temp_path);
+    return false;
+  }
+
+  return true;
+}
+
+static uint32_t CountStrv(char **strv) {
+  uint32_t count = 0;
+  while (strv[count] != NULL) {
+    count++;
+  }
+
+  return count;
+}
+
+static bool StoreInCache(const char *cache_path, const char *source_path,
+                         const struct stat *source_st, Config *config) {
+  CLEANUP(ConfigCacheWriter_Clear) ConfigCacheWriter writer = {NULL};
+
+  ConfigCacheHeader header = {
+      .version = kCacheVersion,
+      .header_size = sizeof(ConfigCacheHeader),
+      .rule_size = sizeof(ConfigCacheRule),
+      .rule_count = config->rule_count,
+      .source_path = InternString(&writer, source_path),
+      .source_dev = source_st->st_dev,
+      .source_ino = source_st->st_ino,
+      .source_size = source_st->st_size,
+      .source_mtime_sec = source_st->st_mtim.tv_sec,
+      .source_mtime_nsec = source_st->st_mtim.tv_nsec,
+      .source_ctime_sec = source_st->st_ctim.tv_sec,
+      .source_ctime_nsec = source_st->st_ctim.tv_nsec,
+  };
+  memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    header.button_count += rule->button_count;
+    header.name_count += CountStrv(rule->users) + CountStrv(rule->groups);
+    if (rule->exec != NULL) {
+      header.name_count += CountStrv(rule->exec);
+    }
+  }
+
+  CLEANUP_AUTOFREE ConfigCacheRule *rules =
+      Alloc(sizeof(ConfigCacheRule) * (header.rule_count + 1));
+  CLEANUP_AUTOFREE ConfigCacheButton *buttons =
+      Alloc(sizeof(ConfigCacheButton) * (header.button_count + 1));
+  CLEANUP_AUTOFREE uint32_t *names = Alloc(sizeof(uint32_t) * (header.name_count + 1));
+
+  uint32_t rule_index = 0, button_index = 0, name_index = 0;
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    ConfigCacheRule *cached = &rules[rule_index++];
+    cached->index = rule->index;
+    cached->gesture = rule->gesture;
+    cached->action = InternString(&writer, rule->action);
+    cached->rate_limit_burst = rule->limiter.burst;
+    cached->rate_limit_interval_usec = rule->limiter.interval_usec;
+    cached->debounce_usec = rule->limiter.debounce_usec;
+    cached->timeout_usec = rule->timeout_usec;
+
+    cached->buttons = button_index;
+    cached->button_count = rule->button_count;
+    for (size_t i = 0; i < rule->button_count; i++) {
+      buttons[button_index].name = InternString(&writer, rule->buttons[i]);
+      buttons[button_index].code = rule->button_codes[i];
+      button_index++;
+    }
+
+    cached->users = name_index;
+    for (char **user = rule->users; *user != NULL; user++) {
+      names[name_index++] = InternString(&writer, *user);
+    }
+    cached->user_count = name_index - cached->users;
+
+    cached->groups = name_index;
+    for (char **group = rule->groups; *group != NULL; group++) {
+      names[name_index++] = InternString(&writer, *group);
+    }
+    cached->group_count = name_index - cached->groups;
+
+    cached->exec = name_index;
+    for (char **arg = rule->exec; arg != NULL && *arg != NULL; arg++) {
+      names[name_index++] = InternString(&writer, *arg);
+    }
+    cached->exec_count = name_index - cached->exec;
+  }
+
+  header.strings_size = writer.strings_size;
+
+  size_t rules_size = sizeof(ConfigCacheRule) * header.rule_count;
+  size_t buttons_size = sizeof(ConfigCacheButton) * header.button_count;
+  size_t names_size = sizeof(uint32_t) * header.name_count;
+  size_t size =
+      sizeof(header) + rules_size + buttons_size + names_size + header.strings_size;
+
+  CLEANUP_AUTOFREE char *data = Alloc(size);
+  char *p = data + sizeof(header);
+  p = mempcpy(p, rules, rules_size);
+  p = mempcpy(p, buttons, buttons_size);
+  p = mempcpy(p, names, names_size);
+  memcpy(p, writer.strings, header.strings_size);
+
+  header.checksum = Fnv1a(data + sizeof(header), size - sizeof(header));
+  memcpy(data, &header, sizeof(header));
+
+  return WriteAtomically(cache_path, data, size);
+}
+
+// Loads a single file from its cache in the cache directory, parsing it and refreshing
+// the cache if it changed since then.
+static Config *LoadCompiled(ConfigCache *cache, const char *path,
+                            const struct stat *st) {
+  CLEANUP_AUTOFREE char *cache_path = GetCachePath(cache, path);
+
+  Config *config = LoadFromCache(cache_path, path, st);
+  if (config != NULL) {
+    LogDebug("Loaded %zu rules from cache %s", config->rule_count, cache_path);
+    return config;
+  }
+
+  config = Config_Load(path);
+  if (config != NULL && !StoreInCache(cache_path, path, st, config)) {
+    LogInfo("Failed to update rule cache %s, continuing without it", cache_path);
+  }
+
+  return config;
+}
+
+static bool IsSameStat(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+         a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+         a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+static bool HashFile(const char *path, uint64_t *hash) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    LogErrno(errno, "Failed to open config file %s", path);
+    return false;
+  }
+
+  CLEANUP_AUTOFREE char *buffer = Alloc(kHashBufferSize);
+  *hash = kFnvOffsetBasis;
+  for (;;) {
+    ssize_t rc = read(fd, buffer, kHashBufferSize);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    } else if (rc == -1) {
+      LogErrno(errno, "Failed to read config file %s", path);
+      close(fd);
+      return false;
+    } else if (rc == 0) {
+      break;
+    }
+
+    *hash = Fnv1aUpdate(*hash, buffer, rc);
+  }
+
+  close(fd);
+  return true;
+}
+
+static void ConfigCacheFile_Free(ConfigCacheFile *file) {
+  if (file->config != NULL) {
+    Config_Unref(STEAL_POINTER(&file->config));
+  }
+
+  free(file->path);
+  free(file);
+}
+
+// Returns the rules of the file at path, only loading them again if its contents changed
+// since the last load, and sets reused if they didn't.
+static Config *LoadFile(ConfigCache *cache, const char *path, bool *reused) {
+  // Taken before reading, so that changes made while parsing invalidate the cache.
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    LogErrno(errno, "Failed to stat config file %s", path);
+    return NULL;
+  }
+
+  ConfigCacheFile *file = NULL;
+  HASH_FIND_STR(cache->files, path, file);
+  if (file == NULL) {
+    file = Alloc(sizeof(ConfigCacheFile));
+    file->path = StrDup(path);
+    HASH_ADD_KEYPTR(hh, cache->files, file->path, strlen(file->path), file);
+  }
+
+  file->seen = true;
+  if (file->config != NULL && IsSameStat(&file->st, &st)) {
+    *reused = true;
+    return file->config;
+  }
+
+  uint64_t content_hash = 0;
+  if (!HashFile(path, &content_hash)) {
+    return NULL;
+  }
+
+  if (file->config == NULL || file->content_hash != content_hash) {
+    Config *config = LoadCompiled(cache, path, &st);
+    if (config == NULL) {
+      return NULL;
+    }
+
+    if (file->config != NULL) {
+      Config_Unref(file->config);
+    }
+
+    file->config = config;
+    file->content_hash = content_hash;
+  } else {
+    *reused = true;
+  }
+
+  file->st = st;
+  return file->config;
+}
+
+static int FilterDropIn(const struct dirent *entry) {
+  return Config_IsDropInName(entry->d_name);
+}
+
+// Orders drop-ins bytewise rather than by locale, so that precedence never changes.
+static int CompareDropIns(const struct dirent **a, const struct dirent **b) {
+  return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+// Returns the paths of the drop-ins in dir in lexical order, setting count to their
+// number. A missing directory just has none.
+static char **ListDropIns(const char *dir, size_t *count) {
+  *count = 0;
+
+  struct dirent **entries = NULL;
+  int entry_count = scandir(dir, &entries, FilterDropIn, CompareDropIns);
+  if (entry_count == -1) {
+    if (errno != ENOENT) {
+      LogErrno(errno, "Failed to list config drop-ins in %s", dir);
+      return NULL;
+    }
+
+    return Alloc(sizeof(char *));
+  }
+
+  char **paths = Alloc(sizeof(char *) * (entry_count + 1));
+  for (int i = 0; i < entry_count; i++) {
+    if (asprintf(&paths[i], "%s/%s", dir, entries[i]->d_name) == -1) {
+      abort();
+    }
+
+    free(entries[i]);
+  }
+
+  free(entries);
+  *count = entry_count;
+  return paths;
+}
+
+static void FreeDropIns(char **paths) {
+  for (char **path = paths; *path != NULL; path++) {
+    free(*path);
+  }
+
+  free(paths);
+}
+
+// Forgets the files that weren't part of the last load, such as removed drop-ins.
+static void PruneFiles(ConfigCache *cache) {
+  ConfigCacheFile *file = NULL, *tmp = NULL;
+  HASH_ITER(hh, cache->files, file, tmp) {
+    if (!file->seen) {
+      HASH_DEL(cache->files, file);
+      ConfigCacheFile_Free(file);
+    } else {
+      file->seen = false;
+    }
+  }
+}
+
+static bool IsCacheOfLoadedFile(ConfigCache *cache, const char *name) {
+  ConfigCacheFile *file = NULL, *tmp = NULL;
+  HASH_ITER(hh, cache->files, file, tmp) {
+    CLEANUP_AUTOFREE char *file_name = GetCacheName(cache, file->path);
+    if (strcmp(name, file_name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Caches from before they were named per config, as rules-<source hash>.bin, which no
+// instance uses anymore.
+static bool IsUnusedCacheName(const char *name) {
+  return strncmp(name, kCachePrefix, strlen(kCachePrefix)) == 0 &&
+         strchr(name + strlen(kCachePrefix), '-') == NULL;
+}
+
+// Deletes the caches of this config's files that weren't part of the last load, such as
+// removed or renamed drop-ins, along with temporary files left behind by a crash while
+// writing one. Otherwise the cache directory would keep growing. The caches of other
+// configs, e.g. those of a benchmark run with --config, are left alone.
+static void PruneCacheDir(ConfigCache *cache) {
+  CLEANUP_AUTOFREE char *prefix = GetCacheNamePrefix(cache);
+
+  const char *dir = GetCacheDir();
+  DIR *dir_stream = opendir(dir);
+  if (dir_stream == NULL) {
+    if (errno != ENOENT) {
+      LogErrno(errno, "Failed to open cache directory %s", dir);
+    }
+    return;
+  }
+
+  struct dirent *entry = NULL;
+  while ((entry = readdir(dir_stream)) != NULL) {
+    bool is_own = strncmp(entry->d_name, prefix, strlen(prefix)) == 0;
+    if ((!is_own && !IsUnusedCacheName(entry->d_name)) ||
+        (is_own && IsCacheOfLoadedFile(cache, entry->d_name))) {
+      continue;
+    }
+
+    LogDebug("Deleting stale rule cache %s/%s", dir, entry->d_name);
+    if (unlinkat(dirfd(dir_stream), entry->d_name, 0) == -1 && errno != ENOENT) {
+      LogErrno(errno, "Failed to delete stale rule cache %s/%s", dir, entry->d_name);
+    }
+  }
+
+  closedir(dir_stream);
+}
+
+ConfigCache *ConfigCache_New() { return Alloc(sizeof(ConfigCache)); }
+
+void ConfigCache_Free(ConfigCache *cache) {
+  ConfigCacheFile *file = NULL, *tmp = NULL;
+  HASH_ITER(hh, cache->files, file, tmp) {
+    HASH_DEL(cache->files, file);
+    ConfigCacheFile_Free(file);
+  }
+
+  free(cache);
+}
+
+Config *ConfigCache_Load(ConfigCache *cache, const char *path) {
+  cache->config_hash = Fnv1a(path, strlen(path));
+  CLEANUP_AUTOFREE char *dropin_dir = Config_GetDropInDir(path);
+
+  size_t dropin_count = 0;
+  char **dropins = ListDropIns(dropin_dir, &dropin_count);
+  if (dropins == NULL) {
+    return NULL;
+  }
+
+  size_t file_count = dropin_count + 1;
+  CLEANUP_AUTOFREE Config **parts = Alloc(sizeof(Config *) * file_count);
+  size_t reused_count = 0;
+
+  bool success = true;
+  for (size_t i = 0; i < file_count && success; i++) {
+    const char *file_path = i == 0 ? path : dropins[i - 1];
+
+    bool reused = false;
+    parts[i] = LoadFile(cache, file_path, &reused);
+    if (parts[i] == NULL) {
+      LogError("Failed to load config file %s", file_path);
+      success = false;
+    }
+
+    reused_count += reused;
+  }
+
+  FreeDropIns(dropins);
+
+  // Nothing is forgotten after a failure, so that the next attempt can still reuse the
+  // files that were skipped.
+  if (!success) {
+    ConfigCacheFile *file = NULL, *tmp = NULL;
+    HASH_ITER(hh, cache->files, file, tmp) {
+      file->seen = false;
+    }
+    return NULL;
+  }
+
+  PruneFiles(cache);
+  PruneCacheDir(cache);
+
+  LogInfo("Loaded %zu config files, %zu of them unchanged", file_count, reused_count);
+  return Config_Merge(parts, file_count);
+}
@@ -0,0 +1,24 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "config.h"
+#include "utils.h"
+
+typedef struct ConfigCache ConfigCache;
+
+// Keeps the compiled rules of every config file loaded through it, both in memory and in
+// the cache directory. Only one load may run at a time, though on any thread.
+ConfigCache *ConfigCache_New();
+void ConfigCache_Free(ConfigCache *cache);
+
+// Loads the rules in path, followed by those of the drop-ins in Config_GetDropInDir(path)
+// in lexical order, each of which takes precedence over the files before it. Only files
+// whose contents changed since the last load, or which aren't in the cache directory,
+// are parsed. Like Config_Load, this returns a new snapshot with a single reference, or
+// NULL on failure.
+Config *ConfigCache_Load(ConfigCache *cache, const char *path);
+
+CLEANUP_AUTOPTR_DEFINE(ConfigCache, ConfigCache_Free)
@@ -7,34 +7,101 @@
 #include "src/utils.h"
 
 #include <confuse.h>
-#include <strings.h>
+#include <ctype.h>
+#include <libevdev/libevdev.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uthash.h>
 
 CLEANUP_AUTOPTR_DEFINE(cfg_t, cfg_free)
 
-#define CONFIG_FILE SYSCONFDIR "/pucro.conf"
+static const char kButtonNamePrefix[] = "BTN_";
+static const char kConfigSuffix[] = ".conf";
+static const char kDropInDirSuffix[] = ".d";
+static const int kDefaultRateLimitIntervalMsec = 1000;
+static const int kDefaultTimeoutMsec = 5000;
 
-static void StrvFree(char **values) {
-  for (char **p = values; p != NULL && *p != NULL; p++) {
-    free(*p);
-  }
+static const char *kGestureNames[kConfigGestureCount] = {
+    [kConfigGesturePress] = "press",
+    [kConfigGestureDouble] = "double",
+    [kConfigGestureLong] = "long",
+    [kConfigGestureChord] = "chord",
+};
+static const uint64_t kUsecPerMsec = 1000;
+
+// Where programs of exec rules are looked up, the same as systemd's own default.
+static const char *kExecSearchPath[] = {"/usr/local/sbin", "/usr/local/bin", "/usr/sbin",
+                                        "/usr/bin"};
+
+typedef struct ConfigNameIndex ConfigNameIndex;
+
+struct ConfigNameIndex {
+  // A lowercased user or group name.
+  char *name;
+  ConfigRule *rule;
+
+  UT_hash_handle hh;
+};
+
+struct ConfigTriggerIndex {
+  ConfigTrigger trigger;
+  ConfigNameIndex *users;
+  ConfigNameIndex *groups;
 
-  free(values);
+  UT_hash_handle hh;
+};
+
+static _Atomic(Config *) current_config = NULL;
+
+Config *Config_Ref(Config *config) {
+  atomic_fetch_add_explicit(&config->refcount, 1, memory_order_relaxed);
+  return config;
 }
 
-Config *Config_GetInstance() {
-  static Config config = {NULL};
-  return &config;
+void Config_Unref(Config *config) {
+  if (atomic_fetch_sub_explicit(&config->refcount, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+
+  // The hash tables' bucket arrays are the only parts not allocated from the arena.
+  ConfigTriggerIndex *trigger_index = NULL, *tmp = NULL;
+  HASH_ITER(hh, config->index, trigger_index, tmp) {
+    HASH_CLEAR(hh, trigger_index->users);
+    HASH_CLEAR(hh, trigger_index->groups);
+  }
+  HASH_CLEAR(hh, config->index);
+
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    RateLimiter_Clear(&rule->limiter);
+  }
+
+  for (size_t i = 0; i < config->part_count; i++) {
+    Config_Unref(config->parts[i]);
+  }
+
+  Arena_Clear(&config->arena);
+
+  if (config->mapping != NULL) {
+    munmap(config->mapping, config->mapping_size);
+  }
+
+  free(config);
 }
 
-void Config_Clear(Config *config) {
-  for (ConfigRule *rule = STEAL_POINTER(&config->rules); rule != NULL;) {
-    StrvFree(rule->buttons);
-    StrvFree(rule->users);
-    free(rule->action);
+Config *Config_GetCurrent() {
+  return atomic_load_explicit(&current_config, memory_order_acquire);
+}
 
-    ConfigRule *next = rule->next;
-    free(rule);
-    rule = next;
+void Config_SetCurrent(Config *config) {
+  Config *old_config =
+      atomic_exchange_explicit(&current_config, config, memory_order_acq_rel);
+  if (old_config != NULL) {
+    Config_Unref(old_config);
   }
 }
 
@@ -47,24 +114,339 @@ static void LibConfuseErrorHandler(cfg_t *cfg, const char *fmt, va_list args) {
   LogError("Failed to parse %s:%d: %s", cfg->filename, cfg->line, message);
 }
 
-static char **CfgStringListToStrv(cfg_t *cfg, const char *key) {
+static char **CfgStringListToStrv(Arena *arena, cfg_t *cfg, const char *key) {
   size_t count = cfg_size(cfg, key);
-  char **strv = Alloc(sizeof(char *) * (count + 1));
+  char **strv = Arena_Alloc(arena, sizeof(char *) * (count + 1));
 
   for (size_t i = 0; i < count; i++) {
-    strv[i] = StrDup(cfg_getnstr(cfg, key, i));
+    strv[i] = Arena_StrDup(arena, cfg_getnstr(cfg, key, i));
   }
 
   return strv;
 }
 
-bool Config_Load(Config *config) {
-  CLEANUP(Config_Clear) Config new_config = {NULL};
+// Lowercases str into buffer, returning false if it does not fit.
+static bool AsciiLowerInto(const char *str, char *buffer, size_t size) {
+  size_t i = 0;
+  for (; str[i] != '\0'; i++) {
+    if (i + 1 >= size) {
+      return false;
+    }
+
+    buffer[i] = tolower((unsigned char)str[i]);
+  }
+
+  buffer[i] = '\0';
+  return true;
+}
+
+int Config_ResolveButtonCode(const char *button) {
+  CLEANUP_AUTOFREE char *evdev_name = NULL;
+  if (asprintf(&evdev_name, "%s%s", kButtonNamePrefix, button) == -1) {
+    abort();
+  }
+
+  for (char *p = evdev_name; *p != '\0'; p++) {
+    *p = toupper((unsigned char)*p);
+  }
+
+  return libevdev_event_code_from_name(EV_KEY, evdev_name);
+}
+
+static bool ResolveButtonCodes(Arena *arena, ConfigRule *rule) {
+  size_t count = 0;
+  while (rule->buttons[count] != NULL) {
+    count++;
+  }
+
+  rule->button_codes = Arena_Alloc(arena, sizeof(unsigned int) * (count + 1));
+  rule->button_count = count;
+
+  for (size_t i = 0; i < count; i++) {
+    int code = Config_ResolveButtonCode(rule->buttons[i]);
+    if (code == -1) {
+      LogError("Unknown button '%s' in rule #%zu", rule->buttons[i], rule->index + 1);
+      return false;
+    }
+
+    rule->button_codes[i] = code;
+  }
+
+  return true;
+}
+
+static bool LoadGesture(ConfigRule *rule, cfg_t *rule_cfg) {
+  const char *name = cfg_getstr(rule_cfg, "gesture");
+
+  ConfigGesture gesture = 0;
+  while (gesture < kConfigGestureCount && strcmp(name, kGestureNames[gesture]) != 0) {
+    gesture++;
+  }
+
+  if (gesture == kConfigGestureCount) {
+    LogError("Unknown gesture '%s' in rule #%zu", name, rule->index + 1);
+    return false;
+  }
+
+  rule->gesture = gesture;
+
+  if (rule->gesture == kConfigGestureChord &&
+      (rule->button_count < 2 || rule->button_count > kConfigMaxChordButtons)) {
+    LogError("Chord in rule #%zu needs 2 to %d buttons", rule->index + 1,
+             kConfigMaxChordButtons);
+    return false;
+  }
+
+  return true;
+}
+
+static bool IsExecutable(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+// Returns the absolute path of program, which is looked up in kExecSearchPath unless it
+// contains a slash, or NULL if it is not an executable file.
+static char *ResolveExecutable(Arena *arena, const char *program) {
+  if (strchr(program, '/') != NULL) {
+    return program[0] == '/' && IsExecutable(program) ? Arena_StrDup(arena, program)
+                                                      : NULL;
+  }
+
+  for (size_t i = 0; i < sizeof(kExecSearchPath) / sizeof(kExecSearchPath[0]); i++) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", kExecSearchPath[i], program) <
+            (int)sizeof(path) &&
+        IsExecutable(path)) {
+      return Arena_StrDup(arena, path);
+    }
+  }
+
+  return NULL;
+}
+
+static char *JoinStrv(Arena *arena, char **strv) {
+  size_t size = 1;
+  for (char **str = strv; *str != NULL; str++) {
+    size += strlen(*str) + 1;
+  }
+
+  char *joined = Arena_Alloc(arena, size);
+  char *p = joined;
+  for (char **str = strv; *str != NULL; str++) {
+    if (p != joined) {
+      *p++ = ' ';
+    }
+    p = stpcpy(p, *str);
+  }
+
+  return joined;
+}
+
+static bool LoadAction(Arena *arena, ConfigRule *rule, cfg_t *rule_cfg) {
+  const char *action = cfg_getstr(rule_cfg, "action");
+  bool has_exec = cfg_size(rule_cfg, "exec") > 0;
+
+  if ((action != NULL) == has_exec) {
+    LogError("Rule #%zu needs exactly one of action and exec", rule->index + 1);
+    return false;
+  }
+
+  if (action != NULL) {
+    rule->action = Arena_StrDup(arena, action);
+    return true;
+  }
+
+  rule->exec = CfgStringListToStrv(arena, rule_cfg, "exec");
+
+  // Checking once here saves the unit from failing on every press.
+  char *program = ResolveExecutable(arena, rule->exec[0]);
+  if (program == NULL) {
+    LogError("No executable '%s' for rule #%zu", rule->exec[0], rule->index + 1);
+    return false;
+  }
+
+  rule->exec[0] = program;
+  rule->action = JoinStrv(arena, rule->exec);
+  return true;
+}
+
+static bool LoadRateLimit(ConfigRule *rule, cfg_t *rule_cfg) {
+  long burst = cfg_getint(rule_cfg, "rate-limit");
+  long interval_msec = cfg_getint(rule_cfg, "rate-limit-interval");
+  long debounce_msec = cfg_getint(rule_cfg, "debounce");
+
+  if (burst < 0 || burst > UINT_MAX || interval_msec <= 0 || debounce_msec < 0) {
+    LogError("Invalid rate limit in rule #%zu", rule->index + 1);
+    return false;
+  }
+
+  rule->limiter.burst = burst;
+  rule->limiter.interval_usec = interval_msec * kUsecPerMsec;
+  rule->limiter.debounce_usec = debounce_msec * kUsecPerMsec;
+  return true;
+}
+
+static bool LoadTimeout(ConfigRule *rule, cfg_t *rule_cfg) {
+  long timeout_msec = cfg_getint(rule_cfg, "timeout");
+  if (timeout_msec <= 0) {
+    LogError("Invalid timeout in rule #%zu", rule->index + 1);
+    return false;
+  }
+
+  rule->timeout_usec = timeout_msec * kUsecPerMsec;
+  return true;
+}
+
+static void AddToIndex(Config *config, ConfigNameIndex **table, ConfigRule *rule,
+                       const char *name) {
+  char key[LOGIN_NAME_MAX];
+  if (!AsciiLowerInto(name, key, sizeof(key))) {
+    LogInfo("Ignoring overlong name in rule #%zu", rule->index + 1);
+    return;
+  }
+
+  ConfigNameIndex *name_index = NULL;
+  HASH_FIND_STR(*table, key, name_index);
+  if (name_index != NULL) {
+    // A rule with higher precedence already handles this combination.
+    return;
+  }
+
+  name_index = Arena_Alloc(&config->arena, sizeof(ConfigNameIndex));
+  name_index->name = Arena_StrDup(&config->arena, key);
+  name_index->rule = rule;
+  HASH_ADD_STR(*table, name, name_index);
+}
+
+static void AddRuleToIndex(Config *config, ConfigRule *rule,
+                           const ConfigTrigger *trigger) {
+  ConfigTriggerIndex *trigger_index = NULL;
+  HASH_FIND(hh, config->index, trigger, sizeof(ConfigTrigger), trigger_index);
+  if (trigger_index == NULL) {
+    trigger_index = Arena_Alloc(&config->arena, sizeof(ConfigTriggerIndex));
+    trigger_index->trigger = *trigger;
+    HASH_ADD(hh, config->index, trigger, sizeof(ConfigTrigger), trigger_index);
+  }
+
+  for (char **user = rule->users; *user != NULL; user++) {
+    AddToIndex(config, &trigger_index->users, rule, *user);
+  }
+
+  for (char **group = rule->groups; *group != NULL; group++) {
+    AddToIndex(config, &trigger_index->groups, rule, *group);
+  }
+}
+
+void Config_BuildIndex(Config *config) {
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    ConfigTrigger trigger;
+
+    if (rule->gesture == kConfigGestureChord) {
+      ConfigTrigger_Init(&trigger, rule->gesture, rule->button_codes, rule->button_count);
+      AddRuleToIndex(config, rule, &trigger);
+
+      // Lets a press wait for the rest of a chord before triggering rules of its own.
+      for (size_t i = 0; i < rule->button_count; i++) {
+        ConfigTrigger_Init(&trigger, rule->gesture, &rule->button_codes[i], 1);
+        AddRuleToIndex(config, rule, &trigger);
+      }
+      continue;
+    }
+
+    for (size_t i = 0; i < rule->button_count; i++) {
+      ConfigTrigger_Init(&trigger, rule->gesture, &rule->button_codes[i], 1);
+      AddRuleToIndex(config, rule, &trigger);
+    }
+  }
+}
+
+Config *Config_New() {
+  Config *config = Alloc(sizeof(Config));
+  atomic_init(&config->refcount, 1);
+  return config;
+}
+
+Config *Config_Merge(Config *const *parts, size_t count) {
+  Config *config = Config_New();
+  config->parts = Arena_Alloc(&config->arena, sizeof(Config *) * (count + 1));
+  config->part_count = count;
+
+  size_t *offsets = Arena_Alloc(&config->arena, sizeof(size_t) * (count + 1));
+  for (size_t i = 0; i < count; i++) {
+    config->parts[i] = Config_Ref(parts[i]);
+    offsets[i + 1] = offsets[i] + parts[i]->rule_count;
+  }
+
+  // Later files come first, with each file's rules already in order of precedence.
+  ConfigRule **tail = &config->rules;
+  for (size_t i = count; i-- > 0;) {
+    for (ConfigRule *part_rule = parts[i]->rules; part_rule != NULL;
+         part_rule = part_rule->next) {
+      // Only the settings are shared, while the rate limiter state and statistics start
+      // out empty, like they do for a freshly parsed file.
+      ConfigRule *rule = Arena_Alloc(&config->arena, sizeof(ConfigRule));
+      rule->buttons = part_rule->buttons;
+      rule->button_codes = part_rule->button_codes;
+      rule->button_count = part_rule->button_count;
+      rule->users = part_rule->users;
+      rule->groups = part_rule->groups;
+      rule->action = part_rule->action;
+      rule->exec = part_rule->exec;
+      rule->gesture = part_rule->gesture;
+      rule->limiter.burst = part_rule->limiter.burst;
+      rule->limiter.interval_usec = part_rule->limiter.interval_usec;
+      rule->limiter.debounce_usec = part_rule->limiter.debounce_usec;
+      rule->timeout_usec = part_rule->timeout_usec;
+      rule->index = offsets[i] + part_rule->index;
+
+      *tail = rule;
+      tail = &rule->next;
+      config->rule_count++;
+    }
+  }
+
+  Config_BuildIndex(config);
+  return config;
+}
+
+char *Config_GetDropInDir(const char *path) {
+  size_t length = strlen(path);
+  size_t suffix_length = strlen(kConfigSuffix);
+  if (length >= suffix_length &&
+      strcmp(path + length - suffix_length, kConfigSuffix) == 0) {
+    length -= suffix_length;
+  }
+
+  char *dir = NULL;
+  if (asprintf(&dir, "%.*s%s", (int)length, path, kDropInDirSuffix) == -1) {
+    abort();
+  }
+
+  return dir;
+}
+
+bool Config_IsDropInName(const char *name) {
+  size_t length = strlen(name);
+  size_t suffix_length = strlen(kConfigSuffix);
+  return name[0] != '.' && length > suffix_length &&
+         strcmp(name + length - suffix_length, kConfigSuffix) == 0;
+}
+
+Config *Config_Load(const char *path) {
+  CLEANUP_AUTOPTR(Config) config = Config_New();
 
   cfg_opt_t rule_opts[] = {
       CFG_STR_LIST("buttons", "{}", CFGF_NODEFAULT),
       CFG_STR_LIST("users", "{}", CFGF_NONE),
+      CFG_STR_LIST("groups", "{}", CFGF_NONE),
       CFG_STR("action", NULL, CFGF_NODEFAULT),
+      CFG_STR_LIST("exec", "{}", CFGF_NODEFAULT),
+      CFG_STR("gesture", (char *)kGestureNames[kConfigGesturePress], CFGF_NONE),
+      CFG_INT("rate-limit", 0, CFGF_NONE),
+      CFG_INT("rate-limit-interval", kDefaultRateLimitIntervalMsec, CFGF_NONE),
+      CFG_INT("debounce", 0, CFGF_NONE),
+      CFG_INT("timeout", kDefaultTimeoutMsec, CFGF_NONE),
       CFG_END(),
   };
 
@@ -76,46 +458,115 @@ bool Config_Load(Config *config) {
   CLEANUP_AUTOPTR(cfg_t) cfg = cfg_init(opts, CFGF_NONE);
   cfg_set_error_function(cfg, LibConfuseErrorHandler);
 
-  int ret = cfg_parse(cfg, CONFIG_FILE);
+  int ret = cfg_parse(cfg, path);
   if (ret != CFG_SUCCESS) {
-    LogError("Failed to parse config file");
-    return false;
+    LogError("Failed to parse config file %s", path);
+    return NULL;
   }
 
   for (size_t i = 0; i < cfg_size(cfg, "rule"); i++) {
     cfg_t *rule_cfg = cfg_getnsec(cfg, "rule", i);
 
-    ConfigRule *rule = Alloc(sizeof(ConfigRule));
-    rule->buttons = CfgStringListToStrv(rule_cfg, "buttons");
-    rule->users = CfgStringListToStrv(rule_cfg, "users");
-    rule->action = StrDup(cfg_getstr(rule_cfg, "action"));
-    rule->next = new_config.rules;
-    new_config.rules = rule;
+    ConfigRule *rule = Arena_Alloc(&config->arena, sizeof(ConfigRule));
+    rule->buttons = CfgStringListToStrv(&config->arena, rule_cfg, "buttons");
+    rule->users = CfgStringListToStrv(&config->arena, rule_cfg, "users");
+    rule->groups = CfgStringListToStrv(&config->arena, rule_cfg, "groups");
+    rule->index = i;
+    rule->next = config->rules;
+    config->rules = rule;
+    config->rule_count++;
+
+    if (!ResolveButtonCodes(&config->arena, rule) || !LoadGesture(rule, rule_cfg) ||
+        !LoadAction(&config->arena, rule, rule_cfg) || !LoadRateLimit(rule, rule_cfg) ||
+        !LoadTimeout(rule, rule_cfg)) {
+      return NULL;
+    }
   }
 
-  Config_Clear(config);
-  config->rules = STEAL_POINTER(&new_config.rules);
-  return true;
+  Config_BuildIndex(config);
+  return STEAL_POINTER(&config);
 }
 
-static bool StrvContainsIgnoreCase(char **strv, const char *item) {
-  for (; *strv != NULL; strv++) {
-    if (strcasecmp(*strv, item) == 0) {
-      return true;
+static int CompareCodes(const void *a, const void *b) {
+  unsigned int code_a = *(const unsigned int *)a, code_b = *(const unsigned int *)b;
+  return (code_a > code_b) - (code_a < code_b);
+}
+
+void ConfigTrigger_Init(ConfigTrigger *trigger, ConfigGesture gesture,
+                        const unsigned int *codes, size_t count) {
+  // Zero everything, padding included, since triggers are hashed as raw bytes.
+  memset(trigger, 0, sizeof(*trigger));
+  trigger->gesture = gesture;
+
+  if (count > kConfigMaxChordButtons) {
+    count = kConfigMaxChordButtons;
+  }
+
+  memcpy(trigger->codes, codes, sizeof(unsigned int) * count);
+  qsort(trigger->codes, count, sizeof(unsigned int), CompareCodes);
+}
+
+const char *Config_GetGestureName(ConfigGesture gesture) {
+  return kGestureNames[gesture];
+}
+
+unsigned int *Config_GetButtonCodes(Config *config, size_t *count) {
+  size_t total = 0;
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    total += rule->button_count;
+  }
+
+  unsigned int *codes = Alloc(sizeof(unsigned int) * (total + 1));
+
+  size_t i = 0;
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    memcpy(&codes[i], rule->button_codes, sizeof(unsigned int) * rule->button_count);
+    i += rule->button_count;
+  }
+
+  qsort(codes, total, sizeof(unsigned int), CompareCodes);
+
+  // Drop the duplicates.
+  *count = 0;
+  for (i = 0; i < total; i++) {
+    if (*count == 0 || codes[*count - 1] != codes[i]) {
+      codes[(*count)++] = codes[i];
     }
   }
 
-  return false;
+  return codes;
+}
+
+static ConfigRule *FindInIndex(ConfigNameIndex *table, const char *name) {
+  char key[LOGIN_NAME_MAX];
+  if (!AsciiLowerInto(name, key, sizeof(key))) {
+    return NULL;
+  }
+
+  ConfigNameIndex *name_index = NULL;
+  HASH_FIND_STR(table, key, name_index);
+  return name_index != NULL ? name_index->rule : NULL;
 }
 
 ConfigRule *Config_FindMatchingRule(Config *config, const char *user,
-                                    const char *button) {
-  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
-    if (StrvContainsIgnoreCase(rule->users, user) &&
-        StrvContainsIgnoreCase(rule->buttons, button)) {
-      return rule;
+                                    char *const *groups, const ConfigTrigger *trigger) {
+  ConfigTriggerIndex *trigger_index = NULL;
+  HASH_FIND(hh, config->index, trigger, sizeof(ConfigTrigger), trigger_index);
+  if (trigger_index == NULL) {
+    return NULL;
+  }
+
+  ConfigRule *rule = FindInIndex(trigger_index->users, user);
+
+  if (trigger_index->groups != NULL) {
+    for (char *const *group = groups; group != NULL && *group != NULL; group++) {
+      // Rules further down the file take precedence.
+      ConfigRule *group_rule = FindInIndex(trigger_index->groups, *group);
+      if (group_rule != NULL && (rule == NULL || group_rule->index > rule->index)) {
+        rule = group_rule;
+      }
     }
   }
 
-  return NULL;
+  return rule;
 }
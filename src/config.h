@@ -4,26 +4,143 @@
 
 #pragma once
 
+#include "arena.h"
+#include "ratelimit.h"
+#include "stats.h"
 #include "utils.h"
 
+#include <stdatomic.h>
+
+#define CONFIG_FILE SYSCONFDIR "/pucro.conf"
+
+typedef struct ConfigTrigger ConfigTrigger;
 typedef struct ConfigRule ConfigRule;
+typedef struct ConfigTriggerIndex ConfigTriggerIndex;
 typedef struct Config Config;
 
+typedef enum {
+  // Any of the rule's buttons being pressed.
+  kConfigGesturePress,
+  // Any of the rule's buttons being clicked twice in a row.
+  kConfigGestureDouble,
+  // Any of the rule's buttons being held down.
+  kConfigGestureLong,
+  // All of the rule's buttons being held down together.
+  kConfigGestureChord,
+
+  kConfigGestureCount,
+} ConfigGesture;
+
+enum { kConfigMaxChordButtons = 4 };
+
+// A gesture of specific buttons, which rules are looked up by.
+struct ConfigTrigger {
+  ConfigGesture gesture;
+  // The button codes in ascending order, followed by zeros. Only chords have several, and
+  // a chord trigger of a single button finds the chords that button is part of.
+  unsigned int codes[kConfigMaxChordButtons];
+};
+
 struct ConfigRule {
   char **buttons;
+  // The evdev codes of buttons, resolved at load time.
+  unsigned int *button_codes;
+  size_t button_count;
   char **users;
+  char **groups;
+  // The shell command to run, or the argv of exec rules joined by spaces, for display.
   char *action;
+  // For exec rules, the argv to run as is, with argv[0] resolved to an absolute path at
+  // load time. NULL for rules that run action through the user's login shell.
+  char **exec;
+  ConfigGesture gesture;
+
+  // Limits how often each user can trigger the rule, reset on every reload.
+  RateLimiter limiter;
+
+  // The rule's position in the config file, starting from 0.
+  size_t index;
+
+  // How long to wait for the action to start before giving up on it.
+  uint64_t timeout_usec;
+
+  // Latency from input events to this rule's dispatches.
+  LatencyHistogram latency;
+  // Latency from this rule's dispatches to their actions having started, and how many
+  // failed or timed out instead.
+  LatencyHistogram start_latency;
+  uint64_t failed_starts;
 
   ConfigRule *next;
 };
 
+// An immutable snapshot of the rules, apart from their rate limiter state and statistics,
+// which only the main thread touches. Everything is allocated from the arena, so a
+// snapshot is freed in one go once the last reference to it is dropped.
 struct Config {
+  _Atomic unsigned int refcount;
+  Arena arena;
+  // The rule cache the strings point into, if the snapshot was loaded from one.
+  void *mapping;
+  size_t mapping_size;
+  // The snapshots of single files that a merged snapshot's rules point into.
+  Config **parts;
+  size_t part_count;
+
+  // Rules in order of precedence, i.e. the reverse of the order in the file.
   ConfigRule *rules;
+  size_t rule_count;
+
+  // Maps (trigger, lowercased user or group) to the first matching rule in rules.
+  ConfigTriggerIndex *index;
 };
 
-Config *Config_GetInstance();
+// Parses path into a new snapshot with a single reference, or returns NULL on failure.
+// Safe to call from any thread, though only one parse may run at a time.
+Config *Config_Load(const char *path);
+
+// Returns an empty snapshot with a single reference, to be filled in by hand and then
+// passed to Config_BuildIndex.
+Config *Config_New();
+void Config_BuildIndex(Config *config);
+
+// Combines the rules of snapshots loaded from single files into a new one, as if the
+// files were concatenated in order, so rules in later ones take precedence. The new
+// snapshot holds a reference to each of them.
+Config *Config_Merge(Config *const *parts, size_t count);
+
+// Returns the directory of drop-ins for the config file at path, which is path with its
+// .conf suffix replaced by .d, e.g. /etc/pucro.d for /etc/pucro.conf.
+char *Config_GetDropInDir(const char *path);
+// Returns true if a file named name in the drop-in directory is loaded, i.e. if it ends
+// in .conf and isn't hidden.
+bool Config_IsDropInName(const char *name);
+
+Config *Config_Ref(Config *config);
+void Config_Unref(Config *config);
+
+// Returns the snapshot in use. Only valid on the main thread, and only until the next
+// Config_SetCurrent unless a reference is taken.
+Config *Config_GetCurrent();
+// Replaces the snapshot in use by config, taking over its reference. Work that already
+// holds a reference to the old snapshot keeps using it until it is done.
+void Config_SetCurrent(Config *config);
+
+// Returns the evdev code of a button name as used in the config, or -1 if unknown.
+int Config_ResolveButtonCode(const char *button);
+
+// Fills in trigger from up to kConfigMaxChordButtons codes in any order.
+void ConfigTrigger_Init(ConfigTrigger *trigger, ConfigGesture gesture,
+                        const unsigned int *codes, size_t count);
+
+const char *Config_GetGestureName(ConfigGesture gesture);
+
+// Returns the distinct button codes used by any rule, setting count to their number.
+unsigned int *Config_GetButtonCodes(Config *config, size_t *count);
 
-void Config_Clear(Config *config);
-bool Config_Load(Config *config);
+// Finds the rule for trigger that applies to user by name or to any of groups, which may
+// be NULL.
+ConfigRule *Config_FindMatchingRule(Config *config, const char *user,
+                                    char *const *groups, const ConfigTrigger *trigger);
 
-ConfigRule *Config_FindMatchingRule(Config *config, const char *user, const char *button);
+CLEANUP_AUTOPTR_DEFINE(Config, Config_Unref)
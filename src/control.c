@@ -0,0 +1,321 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "control.h"
+
+#include "config.h"
+#include "flight-recorder.h"
+#include "loop.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <systemd/sd-bus.h>
+
+const char kControlService[] = "com.refi64.Pucro1";
+const char kControlObject[] = "/com/refi64/Pucro1";
+const char kControlInterface[] = "com.refi64.Pucro1.Daemon";
+
+// The RequestName results that mean we own the name.
+static const uint32_t kRequestNamePrimaryOwner = 1;
+static const uint32_t kRequestNameAlreadyOwner = 4;
+
+struct Control {
+  SeatMonitor *seat_monitor;
+  Dispatcher *dispatcher;
+  UserCache *user_cache;
+  WorkerPool *pool;
+
+  sd_bus_slot *vtable_slot;
+};
+
+static int SendReply(sd_bus_message *reply) {
+  int rc = 0;
+  if ((rc = sd_bus_send(NULL, reply, NULL)) < 0) {
+    LogErrno(-rc, "Failed to send control reply");
+  }
+
+  return rc;
+}
+
+static int MethodGetCounters(sd_bus_message *message, void *userdata,
+                             sd_bus_error *error) {
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+  int rc = 0;
+
+  if ((rc = sd_bus_message_new_method_return(message, &reply)) < 0 ||
+      (rc = sd_bus_message_open_container(reply, 'a', "{st}")) < 0) {
+    return rc;
+  }
+
+  for (StatsCounter counter = 0; counter < kStatsCounterCount; counter++) {
+    if ((rc = sd_bus_message_append(reply, "{st}", Stats_GetCounterName(counter),
+                                    Stats_GetCounter(counter))) < 0) {
+      return rc;
+    }
+  }
+
+  if ((rc = sd_bus_message_close_container(reply)) < 0) {
+    return rc;
+  }
+
+  return SendReply(reply);
+}
+
+static int MethodGetLatency(sd_bus_message *message, void *userdata,
+                            sd_bus_error *error) {
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+  int rc = 0;
+
+  if ((rc = sd_bus_message_new_method_return(message, &reply)) < 0 ||
+      (rc = sd_bus_message_open_container(reply, 'a', "(sttt)")) < 0) {
+    return rc;
+  }
+
+  Stats *stats = Stats_GetInstance();
+  for (LatencyStage stage = 0; stage < kLatencyStageCount; stage++) {
+    const LatencyHistogram *histogram = &stats->stages[stage];
+    if ((rc = sd_bus_message_append(reply, "(sttt)", Stats_GetStageName(stage),
+                                    LatencyHistogram_GetCount(histogram),
+                                    LatencyHistogram_GetPercentile(histogram, 50),
+                                    LatencyHistogram_GetPercentile(histogram, 99))) <
+        0) {
+      return rc;
+    }
+  }
+
+  if ((rc = sd_bus_message_close_container(reply)) < 0) {
+    return rc;
+  }
+
+  return SendReply(reply);
+}
+
+static int MethodListRules(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+  int rc = 0;
+
+  if ((rc = sd_bus_message_new_method_return(message, &reply)) < 0 ||
+      (rc = sd_bus_message_open_container(reply, 'a', "(uasass)")) < 0) {
+    return rc;
+  }
+
+  Config *config = Config_GetCurrent();
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    if ((rc = sd_bus_message_open_container(reply, 'r', "uasass")) < 0 ||
+        (rc = sd_bus_message_append(reply, "u", (uint32_t)rule->index + 1)) < 0 ||
+        (rc = sd_bus_message_append_strv(reply, rule->buttons)) < 0 ||
+        (rc = sd_bus_message_append_strv(reply, rule->users)) < 0 ||
+        (rc = sd_bus_message_append(reply, "s", rule->action)) < 0 ||
+        (rc = sd_bus_message_close_container(reply)) < 0) {
+      return rc;
+    }
+  }
+
+  if ((rc = sd_bus_message_close_container(reply)) < 0) {
+    return rc;
+  }
+
+  return SendReply(reply);
+}
+
+static int MethodListSeats(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  Control *control = userdata;
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+  int rc = 0;
+
+  if ((rc = sd_bus_message_new_method_return(message, &reply)) < 0 ||
+      (rc = sd_bus_message_open_container(reply, 'a', "(ssu)")) < 0) {
+    return rc;
+  }
+
+  for (const SeatMonitorSeat *seat = SeatMonitor_GetSeats(control->seat_monitor);
+       seat != NULL; seat = seat->hh.next) {
+    const char *user = SeatMonitor_GetUser(control->seat_monitor, seat);
+    unsigned int in_flight =
+        user != NULL ? Dispatcher_CountInFlight(control->dispatcher, user) : 0;
+
+    if ((rc = sd_bus_message_append(reply, "(ssu)", seat->id, user != NULL ? user : "",
+                                    in_flight)) < 0) {
+      return rc;
+    }
+  }
+
+  if ((rc = sd_bus_message_close_container(reply)) < 0) {
+    return rc;
+  }
+
+  return SendReply(reply);
+}
+
+static int MethodMatch(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  Control *control = userdata;
+  int rc = 0;
+
+  const char *seat_id = NULL, *button = NULL;
+  if ((rc = sd_bus_message_read(message, "ss", &seat_id, &button)) < 0) {
+    return rc;
+  }
+
+  const SeatMonitorSeat *seat = SeatMonitor_FindSeat(control->seat_monitor, seat_id);
+  if (seat == NULL) {
+    return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Unknown seat: %s",
+                             seat_id);
+  }
+
+  int code = Config_ResolveButtonCode(button);
+  if (code == -1) {
+    return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Unknown button: %s",
+                             button);
+  }
+
+  ConfigTrigger trigger;
+  unsigned int trigger_code = code;
+  ConfigTrigger_Init(&trigger, kConfigGesturePress, &trigger_code, 1);
+
+  const char *user = SeatMonitor_GetUser(control->seat_monitor, seat);
+  ConfigRule *rule = NULL;
+  if (user != NULL) {
+    const UserInfo *info = UserCache_Lookup(control->user_cache, user);
+    rule = Config_FindMatchingRule(Config_GetCurrent(), user,
+                                   info != NULL ? info->groups : NULL, &trigger);
+  }
+
+  return sd_bus_reply_method_return(message, "bsus", rule != NULL,
+                                    user != NULL ? user : "",
+                                    rule != NULL ? (uint32_t)rule->index + 1 : 0,
+                                    rule != NULL ? rule->action : "");
+}
+
+// Replies to the DumpFlightRecorder call that userdata holds a reference to.
+static void ReplyWithDump(const char *path, void *userdata) {
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *message = userdata;
+
+  int rc = 0;
+  if (path != NULL) {
+    rc = sd_bus_reply_method_return(message, "s", path);
+  } else {
+    rc = sd_bus_reply_method_errorf(message, SD_BUS_ERROR_FAILED,
+                                    "Failed to dump the flight recorder");
+  }
+
+  if (rc < 0) {
+    LogErrno(-rc, "Failed to send control reply");
+  }
+}
+
+static int MethodDumpFlightRecorder(sd_bus_message *message, void *userdata,
+                                    sd_bus_error *error) {
+  Control *control = userdata;
+
+  // Replied to once the dump is written, which doesn't need the control interface.
+  FlightRecorder_Dump(control->pool, "control request", ReplyWithDump,
+                      sd_bus_message_ref(message));
+  return 1;
+}
+
+static int MethodGetStalls(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+  int rc = 0;
+
+  LoopOffender offenders[kLoopMaxOffenders];
+  size_t count = Loop_GetOffenders(offenders, kLoopMaxOffenders);
+
+  if ((rc = sd_bus_message_new_method_return(message, &reply)) < 0 ||
+      (rc = sd_bus_message_open_container(reply, 'a', "(sttt)")) < 0) {
+    return rc;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if ((rc = sd_bus_message_append(reply, "(sttt)", offenders[i].name,
+                                    offenders[i].stalls, offenders[i].worst_usec,
+                                    offenders[i].total_usec)) < 0) {
+      return rc;
+    }
+  }
+
+  if ((rc = sd_bus_message_close_container(reply)) < 0) {
+    return rc;
+  }
+
+  return SendReply(reply);
+}
+
+static const sd_bus_vtable kControlVtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD_WITH_NAMES("GetCounters", NULL, , "a{st}", SD_BUS_PARAM(counters),
+                             MethodGetCounters, 0),
+    SD_BUS_METHOD_WITH_NAMES("GetLatency", NULL, , "a(sttt)", SD_BUS_PARAM(stages),
+                             MethodGetLatency, 0),
+    SD_BUS_METHOD_WITH_NAMES("ListRules", NULL, , "a(uasass)", SD_BUS_PARAM(rules),
+                             MethodListRules, 0),
+    SD_BUS_METHOD_WITH_NAMES("ListSeats", NULL, , "a(ssu)", SD_BUS_PARAM(seats),
+                             MethodListSeats, 0),
+    SD_BUS_METHOD_WITH_NAMES("Match", "ss", SD_BUS_PARAM(seat) SD_BUS_PARAM(button),
+                             "bsus",
+                             SD_BUS_PARAM(matched) SD_BUS_PARAM(user) SD_BUS_PARAM(rule)
+                                 SD_BUS_PARAM(action),
+                             MethodMatch, 0),
+    SD_BUS_METHOD_WITH_NAMES("DumpFlightRecorder", NULL, , "s", SD_BUS_PARAM(path),
+                             MethodDumpFlightRecorder, 0),
+    SD_BUS_METHOD_WITH_NAMES("GetStalls", NULL, , "a(sttt)", SD_BUS_PARAM(stalls),
+                             MethodGetStalls, 0),
+    SD_BUS_VTABLE_END,
+};
+
+// Without the name, nothing can reach the control interface, so treat it like any other
+// failure to set up.
+static int OnNameRequested(sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+  sd_bus *bus = sd_bus_message_get_bus(reply);
+  int rc = 0;
+
+  const sd_bus_error *reply_error = sd_bus_message_get_error(reply);
+  uint32_t result = 0;
+  if (reply_error != NULL) {
+    LogError("Failed to request control bus name %s: %s: %s", kControlService,
+             reply_error->name, reply_error->message);
+  } else if ((rc = sd_bus_message_read(reply, "u", &result)) < 0) {
+    LogErrno(-rc, "Failed to parse reply to requesting control bus name %s",
+             kControlService);
+  } else if (result != kRequestNamePrimaryOwner && result != kRequestNameAlreadyOwner) {
+    LogError("Control bus name %s is already taken", kControlService);
+  } else {
+    return 0;
+  }
+
+  sd_event_exit(sd_bus_get_event(bus), 1);
+  return 0;
+}
+
+Control *Control_New(SeatMonitor *seat_monitor, Dispatcher *dispatcher,
+                     UserCache *user_cache, WorkerPool *pool) {
+  sd_bus *bus = SeatMonitor_GetBus(seat_monitor);
+  int rc = 0;
+
+  Control *control = Alloc(sizeof(Control));
+  control->seat_monitor = seat_monitor;
+  control->dispatcher = dispatcher;
+  control->user_cache = user_cache;
+  control->pool = pool;
+
+  if ((rc = sd_bus_add_object_vtable(bus, &control->vtable_slot, kControlObject,
+                                     kControlInterface, kControlVtable, control)) < 0) {
+    LogErrno(-rc, "Failed to export control interface");
+    Control_Free(control);
+    return NULL;
+  }
+
+  if ((rc = sd_bus_request_name_async(bus, NULL, kControlService, 0, OnNameRequested,
+                                      NULL)) < 0) {
+    LogErrno(-rc, "Failed to request control bus name");
+    Control_Free(control);
+    return NULL;
+  }
+
+  return control;
+}
+
+void Control_Free(Control *control) {
+  sd_bus_slot_unref(STEAL_POINTER(&control->vtable_slot));
+  free(control);
+}
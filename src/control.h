@@ -0,0 +1,22 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "dispatch.h"
+#include "seat.h"
+#include "users.h"
+#include "utils.h"
+#include "workers.h"
+
+typedef struct Control Control;
+
+// Exports the daemon's control and statistics interface on the seat monitor's bus, doing
+// slow work like dumping the flight recorder on pool.
+Control *Control_New(SeatMonitor *seat_monitor, Dispatcher *dispatcher,
+                     UserCache *user_cache, WorkerPool *pool);
+
+void Control_Free(Control *control);
+
+CLEANUP_AUTOPTR_DEFINE(Control, Control_Free)
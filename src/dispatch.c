@@ -4,29 +4,62 @@
 
 #include "dispatch.h"
 
+#include "agent.h"
+#include "loop.h"
+#include "stats.h"
+#include "transient.h"
 #include "utils.h"
+#include "workers.h"
 
 #include <assert.h>
 #include <errno.h>
-#include <pwd.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
 #include <unistd.h>
+#include <uthash.h>
 
-static const int kDispatchTimeoutSec = 5;
+static const int kUserBusIdleTimeoutSec = 60;
 static const int kUsecPerSec = 1000000;
+// Dispatch processes give up on their own once the timeout passes, and are only killed
+// if they still haven't exited this much later.
+static const uint64_t kProcessKillGraceUsec = 1000000;
+// How long to go without trying a user's agent after it couldn't be reached.
+static const uint64_t kAgentRetryUsec = 10 * 1000000ull;
 
-const char kSystemdService[] = "org.freedesktop.systemd1";
-const char kSystemdObject[] = "/org/freedesktop/systemd1";
-const char kSystemdManagerInterface[] = "org.freedesktop.systemd1.Manager";
-const char kSystemdManagerStartTransientUnit[] = "StartTransientUnit";
+static const char kDispatchHelper[] = PKGLIBEXECDIR "/pucro-dispatch";
+#ifdef PUCRO_BENCH_HOOKS
+// Overrides kDispatchHelper, so benchmarks can run the helper from the build directory.
+static const char kDispatchHelperEnv[] = "PUCRO_DISPATCH_HELPER";
+#endif
 
+typedef struct DispatcherCompletion DispatcherCompletion;
 typedef struct DispatcherProcess DispatcherProcess;
 
+// What every kind of pending dispatch keeps around to report its result.
+struct DispatcherCompletion {
+  // When the input event happened, or 0 if unknown.
+  uint64_t event_usec;
+  // When Dispatcher_RunAsUser was called.
+  uint64_t dispatch_usec;
+
+  DispatcherDoneCallback done;
+  void *userdata;
+};
+
 struct DispatcherProcess {
   pid_t pid;
+  char *user;
+  DispatcherCompletion completion;
 
-  sd_event_source *timer_event;
+  sd_event_source *kill_timer;
   sd_event_source *death_event;
 
   Dispatcher *dispatcher;
@@ -35,12 +68,129 @@ struct DispatcherProcess {
   DispatcherProcess *next;
 };
 
+typedef struct DispatcherUserBus DispatcherUserBus;
+typedef struct DispatcherConnect DispatcherConnect;
+typedef struct DispatcherCall DispatcherCall;
+
+struct DispatcherUserBus {
+  char *user;
+  // The login shell, for dispatches that come without one.
+  char *shell;
+  // NULL while connecting, during which calls are only queued.
+  sd_bus *bus;
+  sd_bus_slot *job_removed_slot;
+  DispatcherConnect *connect;
+
+  // Evicts the connection once it has been unused for kUserBusIdleTimeoutSec.
+  sd_event_source *idle_timer;
+  // Calls whose start job hasn't completed yet, keyed by unit name.
+  DispatcherCall *calls;
+
+  Dispatcher *dispatcher;
+
+  UT_hash_handle hh;
+};
+
+// Connects to a user's bus on the worker pool, which keeps it until its done callback
+// ran, since both connecting and looking up the login shell may block.
+struct DispatcherConnect {
+  // Cleared if the user bus is freed before the connection is set up.
+  DispatcherUserBus *user_bus;
+  char *user;
+
+  // Written by the worker.
+  sd_bus *bus;
+  char *shell;
+};
+
+struct DispatcherCall {
+  DispatcherUserBus *user_bus;
+  char *unit_name;
+  // A copy of the command while the call waits for the bus to be connected, or NULL
+  // once it was sent.
+  TransientCommand *queued_command;
+  // Only known once StartTransientUnit replied.
+  char *job_path;
+  DispatcherCompletion completion;
+
+  sd_bus_slot *reply_slot;
+  sd_event_source *deadline;
+
+  UT_hash_handle hh;
+};
+
+typedef struct DispatcherAgent DispatcherAgent;
+typedef struct DispatcherAgentCall DispatcherAgentCall;
+
+// A connection to a user's pucro-agent, which is tried before starting a transient unit.
+struct DispatcherAgent {
+  uid_t uid;
+  char *user;
+
+  // -1 while disconnected.
+  int fd;
+  sd_event_source *source;
+  // When to try connecting again after the agent couldn't be reached.
+  uint64_t retry_usec;
+
+  uint32_t call_counter;
+  DispatcherAgentCall *calls;
+
+  UT_hash_handle hh;
+};
+
+struct DispatcherAgentCall {
+  DispatcherAgent *agent;
+  uint32_t id;
+  char *command;
+  DispatcherCompletion completion;
+
+  sd_event_source *deadline;
+
+  UT_hash_handle hh;
+};
+
 struct Dispatcher {
   sd_event *event;
+  WorkerPool *pool;
+  DispatcherMode mode;
+  const char *helper;
+
+  // Used to give every transient unit a unique name.
+  uint64_t unit_counter;
 
   DispatcherProcess *processes;
+  DispatcherUserBus *user_buses;
+  DispatcherAgent *agents;
+
+  // Requests to agents are encoded here.
+  char agent_buffer[kAgentMaxMessageSize];
 };
 
+static void Complete(const DispatcherCompletion *completion, DispatcherResult result) {
+  uint64_t now = GetMonotonicUsec();
+
+  switch (result) {
+  case kDispatcherResultStarted:
+    Stats_Increment(kStatsCounterDispatchesSucceeded);
+    Stats_RecordStage(kLatencyStageStartUnit, completion->dispatch_usec, now);
+    Stats_RecordStage(kLatencyStageTotal, completion->event_usec, now);
+    break;
+  case kDispatcherResultFailed:
+    Stats_Increment(kStatsCounterDispatchesFailed);
+    break;
+  case kDispatcherResultTimedOut:
+    Stats_Increment(kStatsCounterDispatchesTimedOut);
+    break;
+  case kDispatcherResultAbandoned:
+    break;
+  }
+
+  if (completion->done != NULL) {
+    completion->done(result, now - completion->dispatch_usec, completion->userdata);
+  }
+}
+
 static void AddProcess(Dispatcher *dispatcher, DispatcherProcess *process) {
   process->dispatcher = dispatcher;
   process->next = dispatcher->processes;
@@ -53,11 +203,11 @@ static void AddProcess(Dispatcher *dispatcher, DispatcherProcess *process) {
 
 static void RemoveProcess(DispatcherProcess *process) {
   if (process->next != NULL) {
-    process->next->prev = NULL;
+    process->next->prev = process->prev;
   }
 
   if (process->prev != NULL) {
-    process->prev->next = NULL;
+    process->prev->next = process->next;
   } else {
     // Should be head of list.
     assert(process == process->dispatcher->processes);
@@ -70,14 +220,141 @@ static void RemoveProcess(DispatcherProcess *process) {
 
 static void DispatcherProcess_Free(DispatcherProcess *process) {
   sd_event_source_disable_unref(process->death_event);
-  sd_event_source_disable_unref(process->timer_event);
+  sd_event_source_disable_unref(process->kill_timer);
 
+  free(process->user);
   free(process);
 }
 
-Dispatcher *Dispatcher_New(sd_event *event) {
+static TransientCommand *CopyCommand(const TransientCommand *command) {
+  TransientCommand *copy = Alloc(sizeof(TransientCommand));
+  copy->command = StrDup(command->command);
+  copy->shell = command->shell != NULL ? StrDup(command->shell) : NULL;
+
+  if (command->argv != NULL) {
+    size_t argc = 0;
+    while (command->argv[argc] != NULL) {
+      argc++;
+    }
+
+    char **argv = Alloc(sizeof(char *) * (argc + 1));
+    for (size_t i = 0; i < argc; i++) {
+      argv[i] = StrDup(command->argv[i]);
+    }
+
+    copy->argv = argv;
+  }
+
+  return copy;
+}
+
+static void FreeCommand(TransientCommand *command) {
+  free((char *)command->command);
+  free((char *)command->shell);
+  StrvFree((char **)command->argv);
+  free(command);
+}
+
+static void DispatcherCall_Free(DispatcherCall *call) {
+  if (call->queued_command != NULL) {
+    FreeCommand(STEAL_POINTER(&call->queued_command));
+  }
+
+  sd_bus_slot_unref(STEAL_POINTER(&call->reply_slot));
+  sd_event_source_disable_unref(STEAL_POINTER(&call->deadline));
+  free(STEAL_POINTER(&call->job_path));
+  free(STEAL_POINTER(&call->unit_name));
+  free(call);
+}
+
+static void FinishCall(DispatcherCall *call, DispatcherResult result) {
+  HASH_DEL(call->user_bus->calls, call);
+  Complete(&call->completion, result);
+  DispatcherCall_Free(call);
+}
+
+static void DispatcherUserBus_Free(DispatcherUserBus *user_bus) {
+  DispatcherCall *call = NULL, *tmp = NULL;
+  HASH_ITER(hh, user_bus->calls, call, tmp) {
+    FinishCall(call, kDispatcherResultAbandoned);
+  }
+
+  // The pool frees the connection attempt once it is done.
+  if (user_bus->connect != NULL) {
+    STEAL_POINTER(&user_bus->connect)->user_bus = NULL;
+  }
+
+  sd_event_source_disable_unref(STEAL_POINTER(&user_bus->idle_timer));
+  sd_bus_slot_unref(STEAL_POINTER(&user_bus->job_removed_slot));
+  sd_bus_flush_close_unref(STEAL_POINTER(&user_bus->bus));
+
+  free(STEAL_POINTER(&user_bus->shell));
+  free(STEAL_POINTER(&user_bus->user));
+  free(user_bus);
+}
+
+CLEANUP_AUTOPTR_DEFINE(DispatcherUserBus, DispatcherUserBus_Free)
+
+static void DispatcherConnect_Free(DispatcherConnect *connect) {
+  sd_bus_flush_close_unref(STEAL_POINTER(&connect->bus));
+  free(STEAL_POINTER(&connect->shell));
+  free(STEAL_POINTER(&connect->user));
+  free(connect);
+}
+
+CLEANUP_AUTOPTR_DEFINE(DispatcherConnect, DispatcherConnect_Free)
+
+static void DispatcherAgentCall_Free(DispatcherAgentCall *call) {
+  sd_event_source_disable_unref(STEAL_POINTER(&call->deadline));
+  free(STEAL_POINTER(&call->command));
+  free(call);
+}
+
+static void FinishAgentCall(DispatcherAgentCall *call, DispatcherResult result) {
+  HASH_DEL(call->agent->calls, call);
+  Complete(&call->completion, result);
+  DispatcherAgentCall_Free(call);
+}
+
+// Drops the connection, and with it the calls still waiting for a reply. They aren't
+// retried, since the agent may well have spawned them already.
+static void DisconnectAgent(DispatcherAgent *agent, DispatcherResult pending_result) {
+  sd_event_source_disable_unref(STEAL_POINTER(&agent->source));
+  if (agent->fd != -1) {
+    close(agent->fd);
+    agent->fd = -1;
+  }
+
+  DispatcherAgentCall *call = NULL, *tmp = NULL;
+  HASH_ITER(hh, agent->calls, call, tmp) {
+    if (pending_result == kDispatcherResultFailed) {
+      LogError("Lost track of '%s' as %s when the agent disconnected", call->command,
+               agent->user);
+    }
+
+    FinishAgentCall(call, pending_result);
+  }
+}
+
+static void DispatcherAgent_Free(DispatcherAgent *agent) {
+  DisconnectAgent(agent, kDispatcherResultAbandoned);
+  free(STEAL_POINTER(&agent->user));
+  free(agent);
+}
+
+Dispatcher *Dispatcher_New(sd_event *event, WorkerPool *pool, DispatcherMode mode) {
   Dispatcher *dispatcher = Alloc(sizeof(Dispatcher));
   dispatcher->event = sd_event_ref(event);
+  dispatcher->pool = pool;
+  dispatcher->mode = mode;
+
+  dispatcher->helper = kDispatchHelper;
+#ifdef PUCRO_BENCH_HOOKS
+  if (getenv(kDispatchHelperEnv) != NULL) {
+    dispatcher->helper = getenv(kDispatchHelperEnv);
+  }
+#endif
+
   return dispatcher;
 }
 
@@ -85,191 +362,721 @@ void Dispatcher_Free(Dispatcher *dispatcher) {
   for (DispatcherProcess *process = dispatcher->processes; process != NULL;) {
     DispatcherProcess *to_free = process;
     process = process->next;
+    Complete(&to_free->completion, kDispatcherResultAbandoned);
     DispatcherProcess_Free(to_free);
   }
 
+  DispatcherUserBus *user_bus = NULL, *tmp = NULL;
+  HASH_ITER(hh, dispatcher->user_buses, user_bus, tmp) {
+    HASH_DEL(dispatcher->user_buses, user_bus);
+    DispatcherUserBus_Free(user_bus);
+  }
+
+  DispatcherAgent *agent = NULL, *tmp_agent = NULL;
+  HASH_ITER(hh, dispatcher->agents, agent, tmp_agent) {
+    HASH_DEL(dispatcher->agents, agent);
+    DispatcherAgent_Free(agent);
+  }
+
   sd_event_unref(dispatcher->event);
   free(dispatcher);
 }
 
-static int OnTimerExpiration(sd_event_source *source, uint64_t usec, void *userdata) {
+static int OnKillTimer(sd_event_source *source, uint64_t usec, void *userdata) {
   DispatcherProcess *process = userdata;
 
-  LogError("Process %d took too long to spawn subprocess, killing now", process->pid);
+  LogError("Process %d is still running past its timeout, killing now", process->pid);
+
   if (kill(process->pid, SIGKILL) == -1) {
     LogErrno(errno, "Failed to kill %d", process->pid);
-    return 0;
   }
 
-  RemoveProcess(process);
-  DispatcherProcess_Free(process);
+  // The process is freed once the death event reaps it.
   return 0;
 }
 
+static DispatcherResult GetProcessResult(DispatcherProcess *process,
+                                         const siginfo_t *si) {
+  if (si->si_code != CLD_EXITED) {
+    LogError("Process %d failed with signal %d", process->pid, si->si_status);
+    // Only the kill timer should be sending signals.
+    return si->si_status == SIGKILL ? kDispatcherResultTimedOut : kDispatcherResultFailed;
+  }
+
+  switch (si->si_status) {
+  case kTransientResultStarted:
+    return kDispatcherResultStarted;
+  case kTransientResultTimedOut:
+    return kDispatcherResultTimedOut;
+  default:
+    LogError("Process %d failed with exit status %d", process->pid, si->si_status);
+    return kDispatcherResultFailed;
+  }
+}
+
 static int OnProcessDeath(sd_event_source *source, const siginfo_t *si, void *userdata) {
   DispatcherProcess *process = userdata;
 
   LogDebug("Process %d died", process->pid);
 
-  if (si->si_code != CLD_EXITED) {
-    LogError("Process %d failed with signal %d", process->pid, si->si_signo);
+  RemoveProcess(process);
+  Complete(&process->completion, GetProcessResult(process, si));
+  DispatcherProcess_Free(process);
+  return 0;
+}
+
+static char *MakeUnitName(Dispatcher *dispatcher) {
+  char *unit_name = NULL;
+  if (asprintf(&unit_name, "pucro-%d-%" PRIu64 ".service", getpid(),
+               ++dispatcher->unit_counter) == -1) {
+    abort();
   }
 
-  if (si->si_code == CLD_EXITED && si->si_status != 0) {
-    LogError("Process %d failed with exit status %d", process->pid, si->si_status);
+  return unit_name;
+}
+
+static int OnUserBusIdle(sd_event_source *source, uint64_t usec, void *userdata) {
+  DispatcherUserBus *user_bus = userdata;
+  Dispatcher *dispatcher = user_bus->dispatcher;
+
+  if (user_bus->calls != NULL) {
+    // Still waiting on jobs, so check back later.
+    int rc = 0;
+    if ((rc = sd_event_source_set_time_relative(
+             source, kUserBusIdleTimeoutSec * kUsecPerSec)) < 0 ||
+        (rc = sd_event_source_set_enabled(source, SD_EVENT_ONESHOT)) < 0) {
+      LogErrno(-rc, "Failed to re-arm idle timer for %s bus", user_bus->user);
+    }
+
+    return 0;
   }
 
-  RemoveProcess(process);
-  DispatcherProcess_Free(process);
+  LogDebug("Closing idle bus connection for %s", user_bus->user);
+
+  HASH_DEL(dispatcher->user_buses, user_bus);
+  DispatcherUserBus_Free(user_bus);
+  return 0;
+}
+
+static int OnJobRemoved(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  DispatcherUserBus *user_bus = userdata;
+
+  const char *job_path = NULL, *unit_name = NULL, *result = NULL;
+  if (!TransientUnit_ReadJobRemoved(message, &job_path, &unit_name, &result)) {
+    return 0;
+  }
+
+  DispatcherCall *call = NULL;
+  HASH_FIND_STR(user_bus->calls, unit_name, call);
+  // The signal may come before the reply, but if the job is known, it must match.
+  if (call == NULL || (call->job_path != NULL && strcmp(call->job_path, job_path) != 0)) {
+    return 0;
+  }
+
+  if (!TransientUnit_IsJobResultSuccess(result)) {
+    LogError("Unit %s as %s failed to start: %s", unit_name, user_bus->user, result);
+    FinishCall(call, kDispatcherResultFailed);
+    return 0;
+  }
+
+  LogDebug("Started transient unit %s as %s", unit_name, user_bus->user);
+  FinishCall(call, kDispatcherResultStarted);
   return 0;
 }
 
-static sd_bus *ConnectToUserBus(const char *user) {
-  CLEANUP(sd_bus_unrefp) sd_bus *bus = NULL;
+static void ConnectOnWorker(void *userdata) {
+  DispatcherConnect *connect = userdata;
+
+  connect->bus = TransientUnit_ConnectToUserBus(connect->user);
+  if (connect->bus != NULL) {
+    connect->shell = TransientUnit_GetLoginShell(connect->user);
+  }
+}
+
+static bool AttachUserBus(DispatcherUserBus *user_bus) {
   int rc = 0;
+  if ((rc = sd_bus_attach_event(user_bus->bus, user_bus->dispatcher->event,
+                                SD_EVENT_PRIORITY_NORMAL)) < 0) {
+    LogErrno(-rc, "Failed to attach %s bus to event", user_bus->user);
+    return false;
+  }
 
-  CLEANUP_AUTOFREE char *machine = NULL;
-  if (asprintf(&machine, "%s@", user) == -1) {
-    abort();
+  return TransientUnit_WatchJobs(user_bus->bus, &user_bus->job_removed_slot,
+                                 OnJobRemoved, user_bus);
+}
+
+static bool SendCall(DispatcherCall *call, const TransientCommand *command);
+
+static void OnUserBusConnected(void *userdata) {
+  CLEANUP_AUTOPTR(DispatcherConnect) connect = userdata;
+  DispatcherUserBus *user_bus = connect->user_bus;
+  if (user_bus == NULL) {
+    return;
   }
 
-  if ((rc = sd_bus_open_user_machine(&bus, machine)) < 0) {
-    LogErrno(-rc, "Failed to connect to %s bus", user);
-    return NULL;
+  user_bus->connect = NULL;
+  user_bus->bus = STEAL_POINTER(&connect->bus);
+  user_bus->shell = STEAL_POINTER(&connect->shell);
+
+  bool connected = user_bus->bus != NULL && AttachUserBus(user_bus);
+  if (!connected) {
+    LogError("Failed to connect to user bus %s", user_bus->user);
   }
 
-  return STEAL_POINTER(&bus);
+  DispatcherCall *call = NULL, *tmp = NULL;
+  HASH_ITER(hh, user_bus->calls, call, tmp) {
+    TransientCommand *command = STEAL_POINTER(&call->queued_command);
+    bool sent = connected && SendCall(call, command);
+    FreeCommand(command);
+
+    if (!sent) {
+      FinishCall(call, kDispatcherResultFailed);
+    }
+  }
+
+  if (!connected) {
+    // The next dispatch tries again.
+    HASH_DEL(user_bus->dispatcher->user_buses, user_bus);
+    DispatcherUserBus_Free(user_bus);
+  }
 }
 
-static char *GetLoginShell(const char *user) {
-  struct passwd *pwd = getpwnam(user);
-  if (pwd == NULL) {
-    LogErrno(errno, "Failed to look up user %s", user);
+static DispatcherUserBus *ConnectUserBus(Dispatcher *dispatcher, const char *user) {
+  int rc = 0;
+
+  CLEANUP_AUTOPTR(DispatcherUserBus) user_bus = Alloc(sizeof(DispatcherUserBus));
+  user_bus->user = StrDup(user);
+  user_bus->dispatcher = dispatcher;
+
+  if ((rc = Loop_AddTimeRelative(dispatcher->event, &user_bus->idle_timer,
+                                 CLOCK_MONOTONIC, kUserBusIdleTimeoutSec * kUsecPerSec, 0,
+                                 OnUserBusIdle, user_bus, "user-bus-idle")) < 0) {
+    LogErrno(-rc, "Failed to add idle timer for %s bus", user);
     return NULL;
   }
 
-  return StrDup(pwd->pw_shell);
+  LogDebug("Connecting to %s bus", user);
+
+  DispatcherConnect *connect = Alloc(sizeof(DispatcherConnect));
+  connect->user_bus = user_bus;
+  connect->user = StrDup(user);
+  user_bus->connect = connect;
+  WorkerPool_Submit(dispatcher->pool, ConnectOnWorker, OnUserBusConnected, connect);
+
+  return STEAL_POINTER(&user_bus);
 }
 
-static char *GetUnitName(sd_bus *bus) {
+static DispatcherUserBus *GetUserBus(Dispatcher *dispatcher, const char *user) {
+  DispatcherUserBus *user_bus = NULL;
+  HASH_FIND_STR(dispatcher->user_buses, user, user_bus);
+  if (user_bus != NULL && user_bus->bus != NULL && sd_bus_is_open(user_bus->bus) <= 0) {
+    LogDebug("Bus connection for %s was closed, reconnecting", user);
+    HASH_DEL(dispatcher->user_buses, user_bus);
+    DispatcherUserBus_Free(STEAL_POINTER(&user_bus));
+  }
+
+  if (user_bus == NULL) {
+    user_bus = ConnectUserBus(dispatcher, user);
+    if (user_bus == NULL) {
+      return NULL;
+    }
+
+    HASH_ADD_STR(dispatcher->user_buses, user, user_bus);
+  }
+
   int rc = 0;
+  if ((rc = sd_event_source_set_time_relative(user_bus->idle_timer,
+                                              kUserBusIdleTimeoutSec * kUsecPerSec)) <
+          0 ||
+      (rc = sd_event_source_set_enabled(user_bus->idle_timer, SD_EVENT_ONESHOT)) < 0) {
+    LogErrno(-rc, "Failed to reset idle timer for %s bus", user);
+  }
 
-  const char *name = NULL;
-  if ((rc = sd_bus_get_unique_name(bus, &name)) < 0) {
-    LogErrno(-rc, "Failed to get bus name");
-    return NULL;
+  return user_bus;
+}
+
+static int OnStartTransientUnitReply(sd_bus_message *reply, void *userdata,
+                                     sd_bus_error *error) {
+  DispatcherCall *call = userdata;
+  DispatcherUserBus *user_bus = call->user_bus;
+
+  const sd_bus_error *reply_error = sd_bus_message_get_error(reply);
+  if (reply_error != NULL) {
+    LogError("Failed to start transient unit %s as %s: %s: %s", call->unit_name,
+             user_bus->user, reply_error->name, reply_error->message);
+    FinishCall(call, kDispatcherResultFailed);
+    return 0;
   }
 
-  const char *name_suffix = strchr(name, '.');
-  if (name_suffix == NULL || name_suffix[1] == '\0') {
-    LogError("Invalid bus name: %s", name_suffix);
-    return NULL;
+  const char *job_path = NULL;
+  int rc = 0;
+  if ((rc = sd_bus_message_read(reply, "o", &job_path)) < 0) {
+    LogErrno(-rc, "Failed to read job of %s", call->unit_name);
+    FinishCall(call, kDispatcherResultFailed);
+    return 0;
   }
 
-  CLEANUP_AUTOFREE char *unit_name = NULL;
-  if (asprintf(&unit_name, "pucro-%s.service", name_suffix + 1) == -1) {
-    abort();
+  // JobRemoved completes the call.
+  call->job_path = StrDup(job_path);
+  return 0;
+}
+
+static int OnCallDeadline(sd_event_source *source, uint64_t usec, void *userdata) {
+  DispatcherCall *call = userdata;
+  DispatcherUserBus *user_bus = call->user_bus;
+
+  LogError("Unit %s as %s did not start in time, canceling", call->unit_name,
+           user_bus->user);
+  if (call->queued_command == NULL) {
+    TransientUnit_CancelStart(user_bus->bus, call->unit_name, call->job_path);
   }
 
-  return STEAL_POINTER(&unit_name);
+  FinishCall(call, kDispatcherResultTimedOut);
+  return 0;
 }
 
-static bool RunCommandAsTransientUnit(sd_bus *bus, const char *shell,
-                                      const char *command) {
-  CLEANUP_AUTOFREE char *unit_name = GetUnitName(bus);
-  if (unit_name == NULL) {
-    LogError("Failed to find unit name");
+static bool SendCall(DispatcherCall *call, const TransientCommand *command) {
+  DispatcherUserBus *user_bus = call->user_bus;
+
+  TransientCommand resolved = *command;
+  if (resolved.argv == NULL && resolved.shell == NULL) {
+    if (user_bus->shell == NULL) {
+      LogError("Failed to get login shell of %s", user_bus->user);
+      return false;
+    }
+
+    resolved.shell = user_bus->shell;
+  }
+
+  CLEANUP(sd_bus_message_unrefp)
+  sd_bus_message *message = TransientUnit_NewStartMessage(user_bus->bus, call->unit_name,
+                                                          &resolved);
+  if (message == NULL) {
     return false;
   }
 
-  CLEANUP(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
-  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
-
-  if (sd_bus_call_method(bus, kSystemdService, kSystemdObject, kSystemdManagerInterface,
-                         kSystemdManagerStartTransientUnit, &error, &reply,
-                         "ssa(sv)a(sa(sv))",
-                         // Unit name
-                         unit_name,
-                         // Unit mode
-                         "replace",
-                         // # of properties
-                         1,
-                         // ExecStart=...
-                         "ExecStart",
-                         // List with a single ExecStart value
-                         "a(sasb)", 1,
-                         // argv0
-                         shell,
-                         // argv
-                         3, shell, "-c", command,
-                         // Literally don't remember what this is
-                         false,
-                         // # of values in aux array, must be empty
-                         0) < 0) {
-    LogError("Failed to start transient unit: %s: %s", error.name, error.message);
+  int rc = 0;
+  if ((rc = sd_bus_call_async(user_bus->bus, &call->reply_slot, message,
+                              OnStartTransientUnitReply, call, 0)) < 0) {
+    LogErrno(-rc, "Failed to send StartTransientUnit to %s bus", user_bus->user);
     return false;
   }
 
   return true;
 }
 
-static bool RunAsUser(const char *command, const char *user) {
-  CLEANUP(sd_bus_unrefp) sd_bus *bus = ConnectToUserBus(user);
-  if (bus == NULL) {
-    LogError("Failed to connect to user bus %s", user);
+static bool RunOverUserBus(Dispatcher *dispatcher, const DispatcherRequest *request,
+                           const DispatcherCompletion *completion) {
+  DispatcherUserBus *user_bus = GetUserBus(dispatcher, request->user);
+  if (user_bus == NULL) {
     return false;
   }
 
-  CLEANUP_AUTOFREE char *shell = GetLoginShell(user);
-  if (shell == NULL) {
-    LogError("Failed to get login shell");
+  DispatcherCall *call = Alloc(sizeof(DispatcherCall));
+  call->user_bus = user_bus;
+  call->unit_name = MakeUnitName(dispatcher);
+  call->completion = *completion;
+
+  int rc = 0;
+  if ((rc = Loop_AddTimeRelative(dispatcher->event, &call->deadline, CLOCK_MONOTONIC,
+                                 request->timeout_usec, 0, OnCallDeadline, call,
+                                 "dispatch-deadline")) < 0) {
+    LogErrno(-rc, "Failed to add deadline for %s", call->unit_name);
+    DispatcherCall_Free(call);
     return false;
   }
 
-  if (!RunCommandAsTransientUnit(bus, shell, command)) {
-    LogError("Failed to run transient unit for: %s", command);
+  if (user_bus->bus == NULL) {
+    // Sent once the bus is connected, with the deadline already running.
+    call->queued_command = CopyCommand(&request->command);
+  } else if (!SendCall(call, &request->command)) {
+    DispatcherCall_Free(call);
     return false;
   }
 
+  HASH_ADD_KEYPTR(hh, user_bus->calls, call->unit_name, strlen(call->unit_name), call);
   return true;
 }
 
-bool Dispatcher_RunAsUser(Dispatcher *dispatcher, const char *command, const char *user) {
-  pid_t pid = fork();
-  if (pid == -1) {
-    LogErrno(errno, "fork failed");
+static bool WatchProcess(Dispatcher *dispatcher, pid_t pid,
+                         const DispatcherRequest *request,
+                         const DispatcherCompletion *completion) {
+  int rc = 0;
+  CLEANUP(sd_event_source_unrefp) sd_event_source *kill_timer = NULL;
+  CLEANUP(sd_event_source_unrefp) sd_event_source *death_event = NULL;
+
+  CLEANUP_AUTOFREE DispatcherProcess *process = Alloc(sizeof(DispatcherProcess));
+  process->pid = pid;
+  process->completion = *completion;
+
+  if ((rc = Loop_AddTimeRelative(dispatcher->event, &kill_timer, CLOCK_MONOTONIC,
+                                 request->timeout_usec + kProcessKillGraceUsec, 0,
+                                 OnKillTimer, process, "dispatch-kill")) < 0 ||
+      (rc = Loop_AddChild(dispatcher->event, &death_event, pid, WEXITED, OnProcessDeath,
+                          process, "dispatch-exit")) < 0) {
+    LogErrno(-rc, "Failed to add timer and death watch events for %d", pid);
+    if (kill(pid, SIGKILL) == -1) {
+      LogErrno(errno, "Failed to kill process after failure to monitor");
+    }
+
+    return false;
+  }
+
+  process->kill_timer = STEAL_POINTER(&kill_timer);
+  process->death_event = STEAL_POINTER(&death_event);
+  process->user = StrDup(request->user);
+  AddProcess(dispatcher, STEAL_POINTER(&process));
+  return true;
+}
+
+// Builds the helper's command line, see pucro-dispatch.c.
+static char **MakeHelperArgv(Dispatcher *dispatcher, const char *unit_name,
+                             const DispatcherRequest *request) {
+  const TransientCommand *command = &request->command;
+
+  size_t argc = 0;
+  while (command->argv != NULL && command->argv[argc] != NULL) {
+    argc++;
+  }
+
+  char *timeout_arg = NULL;
+  if (asprintf(&timeout_arg, "--timeout=%" PRIu64, request->timeout_usec) == -1) {
+    abort();
+  }
+
+  char **argv = Alloc(sizeof(char *) * (argc + 7));
+  size_t i = 0;
+  argv[i++] = (char *)dispatcher->helper;
+  argv[i++] = timeout_arg;
+  argv[i++] = (char *)unit_name;
+  argv[i++] = (char *)request->user;
+
+  if (command->argv != NULL) {
+    argv[i++] = "--";
+    memcpy(&argv[i], command->argv, sizeof(char *) * argc);
+  } else {
+    // Without a shell, argv just ends early and the helper looks it up itself.
+    argv[i++] = (char *)command->command;
+    argv[i++] = (char *)command->shell;
+  }
+
+  return argv;
+}
+
+static void FreeHelperArgv(char ***argv) {
+  // Only the timeout argument is owned by argv.
+  free((*argv)[1]);
+  free(STEAL_POINTER(argv));
+}
+
+static bool RunInHelper(Dispatcher *dispatcher, const DispatcherRequest *request,
+                        const DispatcherCompletion *completion) {
+  CLEANUP_AUTOFREE char *unit_name = MakeUnitName(dispatcher);
+  CLEANUP(FreeHelperArgv) char **argv = MakeHelperArgv(dispatcher, unit_name, request);
+
+  posix_spawnattr_t attr;
+  int rc = 0;
+  if ((rc = posix_spawnattr_init(&attr)) != 0) {
+    LogErrno(rc, "Failed to initialize spawn attributes");
+    return false;
+  }
+
+  // The daemon blocks the signals it handles via sd-event, so make sure the helper starts
+  // out with a clean mask and default dispositions.
+  sigset_t empty_mask, all_signals;
+  sigemptyset(&empty_mask);
+  sigfillset(&all_signals);
+
+  if ((rc = posix_spawnattr_setsigmask(&attr, &empty_mask)) != 0 ||
+      (rc = posix_spawnattr_setsigdefault(&attr, &all_signals)) != 0 ||
+      (rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                                POSIX_SPAWN_SETSIGDEF)) != 0) {
+    LogErrno(rc, "Failed to set spawn attributes");
+    posix_spawnattr_destroy(&attr);
+    return false;
+  }
+
+  pid_t pid = 0;
+  rc = posix_spawn(&pid, dispatcher->helper, NULL, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  if (rc != 0) {
+    LogErrno(rc, "Failed to spawn %s", dispatcher->helper);
     return false;
-  } else if (pid == 0) {
-    if (!RunAsUser(command, user)) {
-      LogError("Failed to complete dispatch of '%s' as '%s'", command, user);
-      exit(1);
+  }
+
+  uint64_t spawned_usec = GetMonotonicUsec();
+  Stats_RecordStage(kLatencyStageSpawn, completion->dispatch_usec, spawned_usec);
+  LogDebug("Spawned dispatch helper %d in %" PRIu64 "us", pid,
+           spawned_usec - completion->dispatch_usec);
+  return WatchProcess(dispatcher, pid, request, completion);
+}
+
+static void HandleAgentReply(DispatcherAgent *agent, const AgentReply *reply) {
+  DispatcherAgentCall *call = NULL;
+  HASH_FIND(hh, agent->calls, &reply->id, sizeof(reply->id), call);
+  if (call == NULL) {
+    // Most likely a call that already timed out.
+    LogDebug("Agent of %s replied to unknown call %" PRIu32, agent->user, reply->id);
+    return;
+  }
+
+  if (reply->error != 0) {
+    LogErrno(reply->error, "Agent of %s failed to spawn '%s'", agent->user,
+             call->command);
+    FinishAgentCall(call, kDispatcherResultFailed);
+    return;
+  }
+
+  LogDebug("Agent of %s spawned '%s' as %" PRId32, agent->user, call->command,
+           reply->pid);
+  FinishAgentCall(call, kDispatcherResultStarted);
+}
+
+static int OnAgentReplies(sd_event_source *source, int fd, uint32_t revents,
+                          void *userdata) {
+  DispatcherAgent *agent = userdata;
+
+  for (;;) {
+    AgentReply reply;
+    ssize_t size = recv(fd, &reply, sizeof(reply), MSG_DONTWAIT);
+    if (size == -1 && errno == EAGAIN) {
+      return 0;
+    } else if (size == -1 && errno == EINTR) {
+      continue;
+    } else if (size == -1) {
+      LogErrno(errno, "Failed to receive from agent of %s", agent->user);
+      break;
+    } else if (size == 0) {
+      LogInfo("Agent of %s went away", agent->user);
+      break;
+    } else if (size != sizeof(reply)) {
+      LogError("Received a malformed reply from agent of %s", agent->user);
+      break;
     }
 
-    exit(0);
+    HandleAgentReply(agent, &reply);
+  }
+
+  DisconnectAgent(agent, kDispatcherResultFailed);
+  return 0;
+}
+
+static int OnAgentCallDeadline(sd_event_source *source, uint64_t usec, void *userdata) {
+  DispatcherAgentCall *call = userdata;
+
+  // The agent has no jobs to cancel, and the reply is ignored should it still come.
+  LogError("Agent of %s did not spawn '%s' in time", call->agent->user, call->command);
+  FinishAgentCall(call, kDispatcherResultTimedOut);
+  return 0;
+}
+
+// Makes sure the socket is served by the user, and not somebody else's agent the user
+// pointed it to.
+static bool IsAgentPeerValid(DispatcherAgent *agent) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(agent->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+    LogErrno(errno, "Failed to get credentials of agent of %s", agent->user);
+    return false;
+  }
+
+  if (cred.uid != agent->uid) {
+    LogError("Agent socket of %s is served by uid %u", agent->user,
+             (unsigned int)cred.uid);
+    return false;
+  }
+
+  return true;
+}
+
+static bool ConnectAgent(Dispatcher *dispatcher, DispatcherAgent *agent) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  CLEANUP_AUTOFREE char *path = Agent_GetSocketPath(agent->uid);
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return false;
+  }
+
+  strcpy(addr.sun_path, path);
+
+  agent->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (agent->fd == -1) {
+    LogErrno(errno, "Failed to create agent socket");
+    return false;
+  }
+
+  // Connecting to a Unix socket never blocks, it either succeeds or fails right away.
+  if (connect(agent->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    LogDebug("No agent for %s at %s: %s", agent->user, path, strerror(errno));
+    DisconnectAgent(agent, kDispatcherResultFailed);
+    return false;
+  }
+
+  if (!IsAgentPeerValid(agent)) {
+    DisconnectAgent(agent, kDispatcherResultFailed);
+    return false;
+  }
+
+  int rc = 0;
+  if ((rc = Loop_AddIo(dispatcher->event, &agent->source, agent->fd, EPOLLIN,
+                       OnAgentReplies, agent, "agent-replies")) < 0) {
+    LogErrno(-rc, "Failed to monitor agent of %s", agent->user);
+    DisconnectAgent(agent, kDispatcherResultFailed);
+    return false;
+  }
+
+  LogInfo("Connected to agent of %s", agent->user);
+  return true;
+}
+
+// Returns the connection to uid's agent, or NULL if it isn't running.
+static DispatcherAgent *GetAgent(Dispatcher *dispatcher, const char *user, uid_t uid) {
+  DispatcherAgent *agent = NULL;
+  HASH_FIND(hh, dispatcher->agents, &uid, sizeof(uid), agent);
+  if (agent == NULL) {
+    agent = Alloc(sizeof(DispatcherAgent));
+    agent->uid = uid;
+    agent->user = StrDup(user);
+    agent->fd = -1;
+    HASH_ADD(hh, dispatcher->agents, uid, sizeof(uid), agent);
+  }
+
+  if (agent->fd == -1) {
+    uint64_t now = GetMonotonicUsec();
+    if (now < agent->retry_usec) {
+      return NULL;
+    }
+
+    if (!ConnectAgent(dispatcher, agent)) {
+      agent->retry_usec = now + kAgentRetryUsec;
+      return NULL;
+    }
+  }
+
+  return agent;
+}
+
+// Hands the command to the user's agent, returning false if that wasn't possible and a
+// transient unit has to be started instead.
+static bool RunInAgent(Dispatcher *dispatcher, const DispatcherRequest *request,
+                       const DispatcherCompletion *completion) {
+  const TransientCommand *command = &request->command;
+  DispatcherAgent *agent = GetAgent(dispatcher, request->user, request->uid);
+  if (agent == NULL) {
+    return false;
+  }
+
+  AgentRequest agent_request = {.id = ++agent->call_counter};
+  char *const shell_argv[] = {(char *)command->shell, "-c", (char *)command->command,
+                              NULL};
+  char *const login_shell_argv[] = {(char *)command->command, NULL};
+
+  if (command->argv != NULL) {
+    agent_request.argv = (char **)command->argv;
+  } else if (command->shell != NULL) {
+    agent_request.argv = (char **)shell_argv;
   } else {
-    int rc = 0;
-    CLEANUP(sd_event_source_unrefp) sd_event_source *timer_event = NULL;
-    CLEANUP(sd_event_source_unrefp) sd_event_source *death_event = NULL;
-
-    CLEANUP_AUTOFREE DispatcherProcess *process = Alloc(sizeof(DispatcherProcess));
-    process->pid = pid;
-
-    if ((rc = sd_event_add_time_relative(dispatcher->event, &timer_event, CLOCK_MONOTONIC,
-                                         kDispatchTimeoutSec * kUsecPerSec, 0,
-                                         OnTimerExpiration, process)) < 0 ||
-        (rc = sd_event_add_child(dispatcher->event, &death_event, pid, WEXITED,
-                                 OnProcessDeath, process)) < 0) {
-      LogErrno(-rc, "Failed to add timer and death watch events for %d", pid);
-      if (kill(pid, SIGKILL) == -1) {
-        LogErrno(errno, "Failed to kill process after failure to monitor");
-      }
+    agent_request.flags = kAgentRequestLoginShell;
+    agent_request.argv = (char **)login_shell_argv;
+  }
 
-      return false;
+  while (agent_request.argv[agent_request.argc] != NULL) {
+    agent_request.argc++;
+  }
+
+  size_t size = AgentRequest_Encode(&agent_request, dispatcher->agent_buffer,
+                                    sizeof(dispatcher->agent_buffer));
+  if (size == 0) {
+    LogError("'%s' is too long to send to the agent", command->command);
+    return false;
+  }
+
+  DispatcherAgentCall *call = Alloc(sizeof(DispatcherAgentCall));
+  call->agent = agent;
+  call->id = agent_request.id;
+  call->completion = *completion;
+
+  int rc = 0;
+  if ((rc = Loop_AddTimeRelative(dispatcher->event, &call->deadline, CLOCK_MONOTONIC,
+                                 request->timeout_usec, 0, OnAgentCallDeadline, call,
+                                 "agent-deadline")) < 0) {
+    LogErrno(-rc, "Failed to add deadline for agent call");
+    DispatcherAgentCall_Free(call);
+    return false;
+  }
+
+  if (send(agent->fd, dispatcher->agent_buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+      -1) {
+    int error = errno;
+    DispatcherAgentCall_Free(call);
+
+    // A full socket means the agent is falling behind, so leave it be for this one.
+    if (error != EAGAIN) {
+      LogErrno(error, "Failed to send to agent of %s", request->user);
+      DisconnectAgent(agent, kDispatcherResultFailed);
+    }
+
+    return false;
+  }
+
+  call->command = StrDup(command->command);
+  HASH_ADD(hh, agent->calls, id, sizeof(call->id), call);
+
+  Stats_Increment(kStatsCounterDispatchesViaAgent);
+  return true;
+}
+
+static bool RunInTransientUnit(Dispatcher *dispatcher, const DispatcherRequest *request,
+                               const DispatcherCompletion *completion) {
+  switch (dispatcher->mode) {
+  case kDispatcherModeSpawn:
+    return RunInHelper(dispatcher, request, completion);
+  case kDispatcherModeBus:
+    return RunOverUserBus(dispatcher, request, completion);
+  default:
+    abort();
+  }
+}
+
+bool Dispatcher_RunAsUser(Dispatcher *dispatcher, const DispatcherRequest *request) {
+  DispatcherCompletion completion = {
+      .event_usec = request->event_usec,
+      .dispatch_usec = GetMonotonicUsec(),
+      .done = request->done,
+      .userdata = request->userdata,
+  };
+
+  bool started = (request->uid != kDispatcherUnknownUid &&
+                  RunInAgent(dispatcher, request, &completion)) ||
+                 RunInTransientUnit(dispatcher, request, &completion);
+
+  Stats_Increment(started ? kStatsCounterDispatchesStarted
+                          : kStatsCounterDispatchesFailed);
+  return started;
+}
+
+unsigned int Dispatcher_CountInFlight(Dispatcher *dispatcher, const char *user) {
+  unsigned int count = 0;
+
+  for (DispatcherProcess *process = dispatcher->processes; process != NULL;
+       process = process->next) {
+    if (user == NULL || strcmp(process->user, user) == 0) {
+      count++;
     }
+  }
 
-    process->timer_event = STEAL_POINTER(&timer_event);
-    process->death_event = STEAL_POINTER(&death_event);
-    AddProcess(dispatcher, STEAL_POINTER(&process));
-    return true;
+  for (DispatcherUserBus *user_bus = dispatcher->user_buses; user_bus != NULL;
+       user_bus = user_bus->hh.next) {
+    if (user == NULL || strcmp(user_bus->user, user) == 0) {
+      count += HASH_COUNT(user_bus->calls);
+    }
   }
+
+  for (DispatcherAgent *agent = dispatcher->agents; agent != NULL;
+       agent = agent->hh.next) {
+    if (user == NULL || strcmp(agent->user, user) == 0) {
+      count += HASH_COUNT(agent->calls);
+    }
+  }
+
+  return count;
 }
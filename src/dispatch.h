@@ -4,16 +4,69 @@
 
 #pragma once
 
+#include "transient.h"
 #include "utils.h"
+#include "workers.h"
 
+#include <sys/types.h>
 #include <systemd/sd-event.h>
 
 typedef struct Dispatcher Dispatcher;
 
-Dispatcher *Dispatcher_New(sd_event *event);
+typedef enum {
+  // Spawn the small pucro-dispatch helper, which starts the transient unit.
+  kDispatcherModeSpawn,
+  // Start the transient unit asynchronously over a pooled per-user bus connection, which
+  // is set up on the worker pool.
+  kDispatcherModeBus,
+} DispatcherMode;
+
+Dispatcher *Dispatcher_New(sd_event *event, WorkerPool *pool, DispatcherMode mode);
 
 void Dispatcher_Free(Dispatcher *dispatcher);
 
-bool Dispatcher_RunAsUser(Dispatcher *dispatcher, const char *command, const char *user);
+// Passed for users whose uid isn't known yet.
+static const uid_t kDispatcherUnknownUid = (uid_t)-1;
+
+typedef enum {
+  // The command's unit was started, or the user's agent spawned it.
+  kDispatcherResultStarted,
+  kDispatcherResultFailed,
+  // The command didn't start within the request's timeout, and was given up on.
+  kDispatcherResultTimedOut,
+  // The dispatcher was freed before the result was known.
+  kDispatcherResultAbandoned,
+} DispatcherResult;
+
+// Called once the result of a dispatch is known, with the time from the dispatch to it.
+typedef void (*DispatcherDoneCallback)(DispatcherResult result, uint64_t elapsed_usec,
+                                       void *userdata);
+
+typedef struct DispatcherRequest DispatcherRequest;
+
+struct DispatcherRequest {
+  TransientCommand command;
+  const char *user;
+  // Used to reach the user's pucro-agent, or kDispatcherUnknownUid to skip it.
+  uid_t uid;
+
+  // The CLOCK_MONOTONIC time of the input event that triggered the dispatch, or 0 if
+  // unknown, which is used to record the end-to-end latency once the command started.
+  uint64_t event_usec;
+  // How long the command may take to start before its start job is canceled.
+  uint64_t timeout_usec;
+
+  // If set, called exactly once unless the dispatch fails right away.
+  DispatcherDoneCallback done;
+  void *userdata;
+};
+
+// Runs the request's command, through the user's pucro-agent if it is running, or else in
+// a transient unit as set by the mode. Returns false if the dispatch failed right away.
+bool Dispatcher_RunAsUser(Dispatcher *dispatcher, const DispatcherRequest *request);
+
+// Returns the number of dispatches for user, or for everyone if NULL, that have not
+// completed yet.
+unsigned int Dispatcher_CountInFlight(Dispatcher *dispatcher, const char *user);
 
 CLEANUP_AUTOPTR_DEFINE(Dispatcher, Dispatcher_Free)
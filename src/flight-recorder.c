@@ -0,0 +1,233 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "flight-recorder.h"
+
+#include "config.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libevdev/libevdev.h>
+#include <linux/input.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define LOGS_DIR LOCALSTATEDIR "/log/pucro"
+
+typedef struct FlightRecorder FlightRecorder;
+typedef struct FlightRecorderSlot FlightRecorderSlot;
+typedef struct FlightRecorderDump FlightRecorderDump;
+
+static const char kDumpName[] = "flight-recorder.txt";
+
+static const char *kKindNames[] = {
+    [kFlightRecordInput] = "input",
+    [kFlightRecordDispatch] = "dispatch",
+    [kFlightRecordDone] = "done",
+};
+
+static const char *kOutcomeNames[kFlightOutcomeCount] = {
+    [kFlightOutcomeNoSeat] = "no-seat",
+    [kFlightOutcomeNoUser] = "no-user",
+    [kFlightOutcomeNoRule] = "no-rule",
+    [kFlightOutcomeDebounced] = "debounced",
+    [kFlightOutcomeRateLimited] = "rate-limited",
+    [kFlightOutcomeDispatched] = "dispatched",
+    [kFlightOutcomeDispatchFailed] = "dispatch-failed",
+    [kFlightOutcomeStarted] = "started",
+    [kFlightOutcomeFailed] = "failed",
+    [kFlightOutcomeTimedOut] = "timed-out",
+    [kFlightOutcomeAbandoned] = "abandoned",
+};
+
+// Writers mark a slot as being written by zeroing its sequence, and readers skip slots
+// whose sequence isn't the one they expect or changed while copying the record.
+struct FlightRecorderSlot {
+  // 1 more than the sequence number of the record in the slot, or 0 if not complete.
+  _Atomic uint64_t sequence;
+  FlightRecord record;
+};
+
+struct FlightRecorder {
+  _Atomic uint64_t head;
+  FlightRecorderSlot slots[kFlightRecorderCapacity];
+};
+
+_Static_assert((kFlightRecorderCapacity & (kFlightRecorderCapacity - 1)) == 0,
+               "capacity must be a power of two");
+
+static FlightRecorder *GetInstance() {
+  static FlightRecorder recorder;
+  return &recorder;
+}
+
+uint64_t FlightRecorder_Record(const FlightRecord *record) {
+  FlightRecorder *recorder = GetInstance();
+  uint64_t seq = atomic_fetch_add_explicit(&recorder->head, 1, memory_order_relaxed);
+  FlightRecorderSlot *slot = &recorder->slots[seq & (kFlightRecorderCapacity - 1)];
+
+  atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->record = *record;
+  atomic_store_explicit(&slot->sequence, seq + 1, memory_order_release);
+  return seq;
+}
+
+void FlightRecord_SetSeat(FlightRecord *record, const char *seat_id) {
+  strncpy(record->seat, seat_id, sizeof(record->seat) - 1);
+  record->seat[sizeof(record->seat) - 1] = '\0';
+}
+
+uint32_t FlightRecord_ClampUsec(uint64_t usec) {
+  return usec < UINT32_MAX ? usec : UINT32_MAX;
+}
+
+// Copies the record with the given sequence number, returning false if it was already
+// overwritten or is still being written.
+static bool ReadRecord(FlightRecorder *recorder, uint64_t seq, FlightRecord *record) {
+  FlightRecorderSlot *slot = &recorder->slots[seq & (kFlightRecorderCapacity - 1)];
+
+  uint64_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+  if (before != seq + 1) {
+    return false;
+  }
+
+  *record = slot->record;
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before;
+}
+
+static const char *GetButtonName(uint32_t code) {
+  const char *name = libevdev_event_code_get_name(EV_KEY, code);
+  return name != NULL ? name : "?";
+}
+
+static void WriteRecord(FILE *file, uint64_t seq, const FlightRecord *record) {
+  fprintf(file, "%" PRIu64 " %" PRIu64 " %s", seq, record->time_usec,
+          kKindNames[record->kind]);
+
+  switch (record->kind) {
+  case kFlightRecordInput:
+    fprintf(file, " %s %s %s\n", record->seat, GetButtonName(record->code),
+            record->pressed ? "pressed" : "released");
+    break;
+  case kFlightRecordDispatch:
+    fprintf(file,
+            " %s %s %s rule=%" PRIu32 " %s user=%" PRIu32 "us match=%" PRIu32
+            "us dispatch=%" PRIu32 "us\n",
+            record->seat, Config_GetGestureName(record->gesture),
+            GetButtonName(record->code), record->rule, kOutcomeNames[record->outcome],
+            record->stage_usec[kFlightStageUser], record->stage_usec[kFlightStageMatch],
+            record->stage_usec[kFlightStageDispatch]);
+    break;
+  case kFlightRecordDone:
+    fprintf(file, " of=%" PRIu64 " rule=%" PRIu32 " %s after=%" PRIu32 "us\n",
+            record->dispatch_seq, record->rule, kOutcomeNames[record->outcome],
+            record->stage_usec[0]);
+    break;
+  }
+}
+
+static char *GetDumpPath() {
+  // Set by systemd from the service's LogsDirectory=.
+  const char *dir = getenv("LOGS_DIRECTORY");
+  if (dir == NULL) {
+    dir = LOGS_DIR;
+  }
+
+  char *path = NULL;
+  if (asprintf(&path, "%s/%s", dir, kDumpName) == -1) {
+    abort();
+  }
+
+  return path;
+}
+
+// Runs on a worker, which reads the ring while the loop keeps appending to it.
+static char *WriteDump(const char *reason) {
+  FlightRecorder *recorder = GetInstance();
+
+  CLEANUP_AUTOFREE char *path = GetDumpPath();
+  CLEANUP_AUTOFREE char *temp_path = NULL;
+  if (asprintf(&temp_path, "%s.XXXXXX", path) == -1) {
+    abort();
+  }
+
+  int fd = mkostemp(temp_path, O_CLOEXEC);
+  if (fd == -1) {
+    LogErrno(errno, "Failed to create %s", temp_path);
+    return NULL;
+  }
+
+  CLEANUP_FCLOSE FILE *file = fdopen(fd, "w");
+  if (file == NULL) {
+    LogErrno(errno, "Failed to open %s", temp_path);
+    close(fd);
+    unlink(temp_path);
+    return NULL;
+  }
+
+  uint64_t head = atomic_load_explicit(&recorder->head, memory_order_acquire);
+  uint64_t first = head > kFlightRecorderCapacity ? head - kFlightRecorderCapacity : 0;
+
+  fprintf(file, "# pucro flight recorder, dumped at %" PRIu64 " for %s\n",
+          GetMonotonicUsec(), reason);
+  fprintf(file, "# SEQ TIME KIND ...\n");
+
+  // Records written while dumping may overwrite the oldest ones, which are skipped.
+  for (uint64_t seq = first; seq < head; seq++) {
+    FlightRecord record;
+    if (ReadRecord(recorder, seq, &record)) {
+      WriteRecord(file, seq, &record);
+    }
+  }
+
+  if (fclose(STEAL_POINTER(&file)) != 0) {
+    LogErrno(errno, "Failed to write %s", temp_path);
+    unlink(temp_path);
+    return NULL;
+  }
+
+  if (rename(temp_path, path) == -1) {
+    LogErrno(errno, "Failed to move %s into place", temp_path);
+    unlink(temp_path);
+    return NULL;
+  }
+
+  return STEAL_POINTER(&path);
+}
+
+struct FlightRecorderDump {
+  char *reason;
+  // Set by the worker.
+  char *path;
+
+  FlightRecorder_OnDumped on_dumped;
+  void *userdata;
+};
+
+static void RunDump(void *userdata) {
+  FlightRecorderDump *dump = userdata;
+  dump->path = WriteDump(dump->reason);
+}
+
+static void OnDumpDone(void *userdata) {
+  FlightRecorderDump *dump = userdata;
+  dump->on_dumped(dump->path, dump->userdata);
+
+  free(dump->reason);
+  free(dump->path);
+  free(dump);
+}
+
+void FlightRecorder_Dump(WorkerPool *pool, const char *reason,
+                         FlightRecorder_OnDumped on_dumped, void *userdata) {
+  FlightRecorderDump *dump = Alloc(sizeof(FlightRecorderDump));
+  dump->reason = StrDup(reason);
+  dump->on_dumped = on_dumped;
+  dump->userdata = userdata;
+  WorkerPool_Submit(pool, RunDump, OnDumpDone, dump);
+}
@@ -0,0 +1,98 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// Keeps the most recent button events and dispatch decisions in a fixed-size ring of
+// compact binary records, which is always on and cheap enough to leave that way. The ring
+// is only formatted as text when it is dumped, so that a missed or slow click can be
+// investigated after the fact without running with debug logging.
+
+#include "utils.h"
+#include "workers.h"
+
+#include <stdint.h>
+
+typedef struct FlightRecord FlightRecord;
+
+enum {
+  kFlightRecorderCapacity = 4096,
+  kFlightRecordSeatSize = 16,
+};
+
+typedef enum {
+  // A button was pressed or released.
+  kFlightRecordInput,
+  // A gesture was looked up, and possibly dispatched.
+  kFlightRecordDispatch,
+  // A dispatch finished.
+  kFlightRecordDone,
+} FlightRecordKind;
+
+typedef enum {
+  // Outcomes of kFlightRecordDispatch.
+  kFlightOutcomeNoSeat,
+  kFlightOutcomeNoUser,
+  kFlightOutcomeNoRule,
+  kFlightOutcomeDebounced,
+  kFlightOutcomeRateLimited,
+  kFlightOutcomeDispatched,
+  kFlightOutcomeDispatchFailed,
+
+  // Outcomes of kFlightRecordDone.
+  kFlightOutcomeStarted,
+  kFlightOutcomeFailed,
+  kFlightOutcomeTimedOut,
+  kFlightOutcomeAbandoned,
+
+  kFlightOutcomeCount,
+} FlightOutcome;
+
+typedef enum {
+  kFlightStageUser,
+  kFlightStageMatch,
+  kFlightStageDispatch,
+
+  kFlightStageCount,
+} FlightStage;
+
+struct FlightRecord {
+  // The CLOCK_MONOTONIC time of the input event, or of the dispatch finishing.
+  uint64_t time_usec;
+  // For kFlightRecordDone, the sequence number of the kFlightRecordDispatch record.
+  uint64_t dispatch_seq;
+
+  uint8_t kind;
+  uint8_t outcome;
+  // The ConfigGesture of dispatch records.
+  uint8_t gesture;
+  uint8_t pressed;
+  uint32_t code;
+  // The rule's position in the config file starting from 1, or 0 if none matched.
+  uint32_t rule;
+  // How long each FlightStage took for dispatch records, while done records only use the
+  // first entry for the time from dispatching to finishing. Saturates at UINT32_MAX.
+  uint32_t stage_usec[kFlightStageCount];
+
+  // Truncated if longer, and empty for done records.
+  char seat[kFlightRecordSeatSize];
+};
+
+// Appends a copy of record to the ring, overwriting the oldest record once it is full,
+// and returns its sequence number. Lock-free and safe to call from any thread.
+uint64_t FlightRecorder_Record(const FlightRecord *record);
+
+// Fills in record's seat from seat_id.
+void FlightRecord_SetSeat(FlightRecord *record, const char *seat_id);
+
+// Returns usec clamped to what fits in a record.
+uint32_t FlightRecord_ClampUsec(uint64_t usec);
+
+// Called back on the loop with the path of the dump, or NULL if it failed.
+typedef void (*FlightRecorder_OnDumped)(const char *path, void *userdata);
+
+// Writes the records in the ring as text to the logs directory on one of pool's
+// threads, mentioning reason at the top, so that the loop never waits on the disk.
+void FlightRecorder_Dump(WorkerPool *pool, const char *reason,
+                         FlightRecorder_OnDumped on_dumped, void *userdata);
@@ -0,0 +1,326 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "gesture.h"
+
+#include "timerwheel.h"
+#include "utils.h"
+
+#include <string.h>
+#include <uthash.h>
+
+// How long after a click a second one counts as a double click.
+static const uint64_t kDoubleClickUsec = 400000;
+// How long a button must be held down for a long press.
+static const uint64_t kLongPressUsec = 600000;
+// How long a press of a button that is part of a chord waits for the chord's other
+// buttons before it counts on its own.
+static const uint64_t kChordWindowUsec = 250000;
+
+typedef struct GestureButton GestureButton;
+typedef struct GestureSeat GestureSeat;
+
+struct GestureButton {
+  unsigned int code;
+  GestureSeat *seat;
+
+  bool pressed;
+  // The current press was used up by a chord or a long press, so its release is ignored.
+  bool consumed;
+  // A long press rule made the current press wait for its release to count as a click.
+  bool awaiting_release;
+  // A chord rule made the current press wait for the rest of the chord.
+  bool awaiting_chord;
+  // When the current press was received.
+  uint64_t pressed_usec;
+
+  TimerWheelEntry chord_timer;
+  TimerWheelEntry long_press_timer;
+  // Scheduled while a click waits to see whether a second one follows.
+  TimerWheelEntry click_timer;
+
+  UT_hash_handle hh;
+};
+
+struct GestureSeat {
+  char *seat_id;
+  GestureEngine *engine;
+
+  GestureButton *buttons;
+
+  // The buttons held down right now, in the order they were pressed.
+  unsigned int held[kConfigMaxChordButtons];
+  size_t held_count;
+
+  UT_hash_handle hh;
+};
+
+struct GestureEngine {
+  TimerWheel *timers;
+  GestureSeat *seats;
+
+  GestureEngine_HasRule has_rule;
+  GestureEngine_OnGesture on_gesture;
+  void *userdata;
+};
+
+static void GestureSeat_Free(GestureSeat *seat) {
+  GestureButton *button = NULL, *tmp = NULL;
+  HASH_ITER(hh, seat->buttons, button, tmp) {
+    HASH_DEL(seat->buttons, button);
+    TimerWheel_Cancel(seat->engine->timers, &button->chord_timer);
+    TimerWheel_Cancel(seat->engine->timers, &button->long_press_timer);
+    TimerWheel_Cancel(seat->engine->timers, &button->click_timer);
+    free(button);
+  }
+
+  free(seat->seat_id);
+  free(seat);
+}
+
+GestureEngine *GestureEngine_New(sd_event *event) {
+  CLEANUP_AUTOPTR(TimerWheel) timers = TimerWheel_New(event);
+  if (timers == NULL) {
+    return NULL;
+  }
+
+  GestureEngine *engine = Alloc(sizeof(GestureEngine));
+  engine->timers = STEAL_POINTER(&timers);
+  return engine;
+}
+
+void GestureEngine_Free(GestureEngine *engine) {
+  GestureSeat *seat = NULL, *tmp = NULL;
+  HASH_ITER(hh, engine->seats, seat, tmp) {
+    HASH_DEL(engine->seats, seat);
+    GestureSeat_Free(seat);
+  }
+
+  TimerWheel_Free(engine->timers);
+  free(engine);
+}
+
+void GestureEngine_SetRuleCheck(GestureEngine *engine, GestureEngine_HasRule has_rule) {
+  engine->has_rule = has_rule;
+}
+
+void GestureEngine_SetGestureCallback(GestureEngine *engine,
+                                      GestureEngine_OnGesture on_gesture) {
+  engine->on_gesture = on_gesture;
+}
+
+void GestureEngine_SetUserData(GestureEngine *engine, void *userdata) {
+  engine->userdata = userdata;
+}
+
+static bool HasTrigger(GestureSeat *seat, const ConfigTrigger *trigger) {
+  GestureEngine *engine = seat->engine;
+  return engine->has_rule != NULL &&
+         engine->has_rule(engine, seat->seat_id, trigger, engine->userdata);
+}
+
+static bool HasRule(GestureSeat *seat, ConfigGesture gesture, unsigned int code) {
+  ConfigTrigger trigger;
+  ConfigTrigger_Init(&trigger, gesture, &code, 1);
+  return HasTrigger(seat, &trigger);
+}
+
+static void Emit(GestureSeat *seat, const ConfigTrigger *trigger, uint64_t event_usec) {
+  GestureEngine *engine = seat->engine;
+  if (engine->on_gesture != NULL) {
+    engine->on_gesture(engine, seat->seat_id, trigger, event_usec, engine->userdata);
+  }
+}
+
+static void EmitButton(GestureButton *button, ConfigGesture gesture,
+                       uint64_t event_usec) {
+  ConfigTrigger trigger;
+  ConfigTrigger_Init(&trigger, gesture, &button->code, 1);
+  Emit(button->seat, &trigger, event_usec);
+}
+
+static void OnClickTimeout(TimerWheelEntry *entry, void *userdata) {
+  GestureButton *button = userdata;
+  EmitButton(button, kConfigGesturePress, GetMonotonicUsec());
+}
+
+static void OnLongPressTimeout(TimerWheelEntry *entry, void *userdata) {
+  GestureButton *button = userdata;
+
+  button->consumed = true;
+  button->awaiting_release = false;
+  TimerWheel_Cancel(button->seat->engine->timers, &button->click_timer);
+
+  EmitButton(button, kConfigGestureLong, GetMonotonicUsec());
+}
+
+static void Click(GestureButton *button, uint64_t event_usec) {
+  TimerWheel *timers = button->seat->engine->timers;
+
+  if (TimerWheelEntry_IsScheduled(&button->click_timer)) {
+    TimerWheel_Cancel(timers, &button->click_timer);
+    EmitButton(button, kConfigGestureDouble, event_usec);
+  } else if (HasRule(button->seat, kConfigGestureDouble, button->code)) {
+    TimerWheel_Schedule(timers, &button->click_timer,
+                        GetMonotonicUsec() + kDoubleClickUsec, OnClickTimeout, button);
+  } else {
+    EmitButton(button, kConfigGesturePress, event_usec);
+  }
+}
+
+// Returns true if the buttons held on the seat made up a chord that some rule uses.
+static bool TryChord(GestureSeat *seat, uint64_t event_usec) {
+  if (seat->held_count < 2) {
+    return false;
+  }
+
+  ConfigTrigger trigger;
+  ConfigTrigger_Init(&trigger, kConfigGestureChord, seat->held, seat->held_count);
+  if (!HasTrigger(seat, &trigger)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < seat->held_count; i++) {
+    GestureButton *button = NULL;
+    HASH_FIND_INT(seat->buttons, &seat->held[i], button);
+    if (button != NULL) {
+      button->consumed = true;
+      button->awaiting_release = false;
+      button->awaiting_chord = false;
+      TimerWheel_Cancel(seat->engine->timers, &button->chord_timer);
+      TimerWheel_Cancel(seat->engine->timers, &button->long_press_timer);
+      TimerWheel_Cancel(seat->engine->timers, &button->click_timer);
+    }
+  }
+
+  Emit(seat, &trigger, event_usec);
+  return true;
+}
+
+// Handles a press that is not part of a chord.
+static void PressAlone(GestureButton *button, uint64_t event_usec) {
+  if (HasRule(button->seat, kConfigGestureLong, button->code)) {
+    button->awaiting_release = true;
+    TimerWheel_Schedule(button->seat->engine->timers, &button->long_press_timer,
+                        button->pressed_usec + kLongPressUsec, OnLongPressTimeout,
+                        button);
+    return;
+  }
+
+  Click(button, event_usec);
+}
+
+static void OnChordWindowTimeout(TimerWheelEntry *entry, void *userdata) {
+  GestureButton *button = userdata;
+
+  button->awaiting_chord = false;
+  PressAlone(button, GetMonotonicUsec());
+}
+
+static void OnPress(GestureSeat *seat, GestureButton *button, uint64_t event_usec) {
+  if (button->pressed) {
+    return;
+  }
+
+  button->pressed = true;
+  button->consumed = false;
+  button->awaiting_release = false;
+  button->pressed_usec = GetMonotonicUsec();
+
+  if (seat->held_count < kConfigMaxChordButtons) {
+    seat->held[seat->held_count++] = button->code;
+  }
+
+  if (TryChord(seat, event_usec)) {
+    return;
+  }
+
+  // Otherwise the press would trigger the button's own rules before the chord is done.
+  if (HasRule(seat, kConfigGestureChord, button->code)) {
+    button->awaiting_chord = true;
+    TimerWheel_Schedule(seat->engine->timers, &button->chord_timer,
+                        button->pressed_usec + kChordWindowUsec, OnChordWindowTimeout,
+                        button);
+    return;
+  }
+
+  PressAlone(button, event_usec);
+}
+
+static void OnRelease(GestureSeat *seat, GestureButton *button, uint64_t event_usec) {
+  if (!button->pressed) {
+    return;
+  }
+
+  button->pressed = false;
+
+  for (size_t i = 0; i < seat->held_count; i++) {
+    if (seat->held[i] == button->code) {
+      memmove(&seat->held[i], &seat->held[i + 1],
+              sizeof(unsigned int) * (seat->held_count - i - 1));
+      seat->held_count--;
+      break;
+    }
+  }
+
+  TimerWheel_Cancel(seat->engine->timers, &button->long_press_timer);
+
+  if (button->consumed) {
+    button->consumed = false;
+  } else if (button->awaiting_chord) {
+    // Released before the rest of the chord came, which makes it a plain click.
+    button->awaiting_chord = false;
+    TimerWheel_Cancel(seat->engine->timers, &button->chord_timer);
+    Click(button, event_usec);
+  } else if (button->awaiting_release) {
+    button->awaiting_release = false;
+    Click(button, event_usec);
+  }
+}
+
+static GestureSeat *GetSeat(GestureEngine *engine, const char *seat_id) {
+  GestureSeat *seat = NULL;
+  HASH_FIND_STR(engine->seats, seat_id, seat);
+  if (seat == NULL) {
+    seat = Alloc(sizeof(GestureSeat));
+    seat->seat_id = StrDup(seat_id);
+    seat->engine = engine;
+    HASH_ADD_STR(engine->seats, seat_id, seat);
+  }
+
+  return seat;
+}
+
+static GestureButton *GetButton(GestureSeat *seat, unsigned int code) {
+  GestureButton *button = NULL;
+  HASH_FIND_INT(seat->buttons, &code, button);
+  if (button == NULL) {
+    button = Alloc(sizeof(GestureButton));
+    button->code = code;
+    button->seat = seat;
+    HASH_ADD_INT(seat->buttons, code, button);
+  }
+
+  return button;
+}
+
+void GestureEngine_Feed(GestureEngine *engine, const InputMonitorEvent *event) {
+  GestureSeat *seat = GetSeat(engine, event->seat_id);
+  GestureButton *button = GetButton(seat, event->button);
+
+  if (event->pressed) {
+    OnPress(seat, button, event->time_usec);
+  } else {
+    OnRelease(seat, button, event->time_usec);
+  }
+}
+
+void GestureEngine_RemoveSeat(GestureEngine *engine, const char *seat_id) {
+  GestureSeat *seat = NULL;
+  HASH_FIND_STR(engine->seats, seat_id, seat);
+  if (seat != NULL) {
+    HASH_DEL(engine->seats, seat);
+    GestureSeat_Free(seat);
+  }
+}
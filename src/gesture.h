@@ -0,0 +1,40 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "config.h"
+#include "input.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <systemd/sd-event.h>
+
+typedef struct GestureEngine GestureEngine;
+
+// Returns whether any rule could be triggered by trigger on the given seat, so that the
+// engine only delays presses to tell gestures apart when that matters.
+typedef bool (*GestureEngine_HasRule)(GestureEngine *engine, const char *seat_id,
+                                      const ConfigTrigger *trigger, void *userdata);
+// event_usec is the time of the input event that completed the gesture, or the time it
+// was recognized for gestures completed by a timeout.
+typedef void (*GestureEngine_OnGesture)(GestureEngine *engine, const char *seat_id,
+                                        const ConfigTrigger *trigger, uint64_t event_usec,
+                                        void *userdata);
+
+// Turns the button presses and releases of every seat into the gestures rules use, with
+// all pending timeouts sharing one timer wheel.
+GestureEngine *GestureEngine_New(sd_event *event);
+void GestureEngine_Free(GestureEngine *engine);
+
+void GestureEngine_SetRuleCheck(GestureEngine *engine, GestureEngine_HasRule has_rule);
+void GestureEngine_SetGestureCallback(GestureEngine *engine,
+                                      GestureEngine_OnGesture on_gesture);
+void GestureEngine_SetUserData(GestureEngine *engine, void *userdata);
+
+void GestureEngine_Feed(GestureEngine *engine, const InputMonitorEvent *event);
+// Forgets the state of a seat, dropping any gestures still in progress on it.
+void GestureEngine_RemoveSeat(GestureEngine *engine, const char *seat_id);
+
+CLEANUP_AUTOPTR_DEFINE(GestureEngine, GestureEngine_Free)
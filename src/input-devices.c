@@ -0,0 +1,300 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Tracking of input devices and their seats for the backends that open devices
+// themselves, instead of having a libinput udev context per seat.
+
+#include "input-private.h"
+#include "src/loop.h"
+#include "src/utils.h"
+
+#include <errno.h>
+#include <libudev.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <systemd/sd-event.h>
+#include <uthash.h>
+
+typedef struct InputTrackedSeat InputTrackedSeat;
+
+static const char kDefaultSeat[] = "seat0";
+
+struct InputTrackedSeat {
+  char *seat_id;
+
+  UT_hash_handle hh;
+};
+
+struct InputDeviceTracker {
+  InputMonitor *monitor;
+  const InputDeviceHooks *hooks;
+
+  struct udev *udev;
+  struct udev_monitor *udev_monitor;
+  sd_event_source *udev_source;
+
+  InputTrackedSeat *seats;
+  // Every input event device, whether its seat is monitored or not, keyed by syspath.
+  InputDevice *devices;
+};
+
+CLEANUP_AUTOPTR_DEFINE(udev_device, udev_device_unref)
+CLEANUP_AUTOPTR_DEFINE(udev_enumerate, udev_enumerate_unref)
+
+static const char *GetDeviceSeat(struct udev_device *udev_device) {
+  const char *seat_id = udev_device_get_property_value(udev_device, "ID_SEAT");
+  return seat_id != NULL ? seat_id : kDefaultSeat;
+}
+
+// Returns true for the devices libinput's udev backend would pick up.
+static bool IsInputEventDevice(struct udev_device *udev_device) {
+  const char *sysname = udev_device_get_sysname(udev_device);
+  return udev_device_get_devnode(udev_device) != NULL && sysname != NULL &&
+         strncmp(sysname, "event", strlen("event")) == 0 &&
+         udev_device_get_property_value(udev_device, "ID_INPUT") != NULL;
+}
+
+static bool IsSeatMonitored(InputDeviceTracker *tracker, const char *seat_id) {
+  InputTrackedSeat *seat = NULL;
+  HASH_FIND_STR(tracker->seats, seat_id, seat);
+  return seat != NULL;
+}
+
+static void AttachDevice(InputDeviceTracker *tracker, InputDevice *device) {
+  if (device->state == NULL) {
+    device->state = tracker->hooks->attach(tracker->monitor, device);
+  }
+}
+
+static void DetachDevice(InputDeviceTracker *tracker, InputDevice *device) {
+  if (device->state != NULL) {
+    tracker->hooks->detach(tracker->monitor, device);
+    device->state = NULL;
+  }
+}
+
+static void FreeDevice(InputDeviceTracker *tracker, InputDevice *device) {
+  DetachDevice(tracker, device);
+  free(device->syspath);
+  free(device->sysname);
+  free(device->devnode);
+  free(device->seat_id);
+  free(device);
+}
+
+static void UpdateDevice(InputDeviceTracker *tracker, struct udev_device *udev_device) {
+  if (!IsInputEventDevice(udev_device)) {
+    return;
+  }
+
+  const char *syspath = udev_device_get_syspath(udev_device);
+  const char *seat_id = GetDeviceSeat(udev_device);
+
+  InputDevice *device = NULL;
+  HASH_FIND_STR(tracker->devices, syspath, device);
+  if (device == NULL) {
+    device = Alloc(sizeof(InputDevice));
+    device->syspath = StrDup(syspath);
+    device->sysname = StrDup(udev_device_get_sysname(udev_device));
+    device->devnode = StrDup(udev_device_get_devnode(udev_device));
+    device->seat_id = StrDup(seat_id);
+    HASH_ADD_STR(tracker->devices, syspath, device);
+  } else if (strcmp(device->seat_id, seat_id) != 0) {
+    LogDebug("Moving %s from seat %s to %s", device->devnode, device->seat_id, seat_id);
+    DetachDevice(tracker, device);
+    free(device->seat_id);
+    device->seat_id = StrDup(seat_id);
+  }
+
+  if (IsSeatMonitored(tracker, device->seat_id)) {
+    AttachDevice(tracker, device);
+  }
+}
+
+static void ForgetDevice(InputDeviceTracker *tracker, struct udev_device *udev_device) {
+  InputDevice *device = NULL;
+  HASH_FIND_STR(tracker->devices, udev_device_get_syspath(udev_device), device);
+  if (device != NULL) {
+    HASH_DEL(tracker->devices, device);
+    FreeDevice(tracker, device);
+  }
+}
+
+static int OnUdevEvents(sd_event_source *source, int fd, uint32_t revents,
+                        void *userdata) {
+  InputDeviceTracker *tracker = userdata;
+
+  for (;;) {
+    CLEANUP_AUTOPTR(udev_device)
+    udev_device = udev_monitor_receive_device(tracker->udev_monitor);
+    if (udev_device == NULL) {
+      break;
+    }
+
+    const char *action = udev_device_get_action(udev_device);
+    if (action != NULL && strcmp(action, "remove") == 0) {
+      ForgetDevice(tracker, udev_device);
+    } else {
+      UpdateDevice(tracker, udev_device);
+    }
+  }
+
+  return 0;
+}
+
+static bool EnumerateDevices(InputDeviceTracker *tracker) {
+  CLEANUP_AUTOPTR(udev_enumerate) enumerate = udev_enumerate_new(tracker->udev);
+  if (enumerate == NULL) {
+    LogError("Failed to create udev enumerator");
+    return false;
+  }
+
+  int rc = 0;
+  if ((rc = udev_enumerate_add_match_subsystem(enumerate, "input")) < 0 ||
+      (rc = udev_enumerate_add_match_sysname(enumerate, "event*")) < 0 ||
+      (rc = udev_enumerate_scan_devices(enumerate)) < 0) {
+    LogErrno(-rc, "Failed to enumerate input devices");
+    return false;
+  }
+
+  struct udev_list_entry *entry = NULL;
+  udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+    CLEANUP_AUTOPTR(udev_device)
+    udev_device =
+        udev_device_new_from_syspath(tracker->udev, udev_list_entry_get_name(entry));
+    if (udev_device != NULL) {
+      UpdateDevice(tracker, udev_device);
+    }
+  }
+
+  return true;
+}
+
+void InputDeviceTracker_Free(InputDeviceTracker *tracker) {
+  sd_event_source_disable_unref(STEAL_POINTER(&tracker->udev_source));
+
+  InputDevice *device = NULL, *tmp_device = NULL;
+  HASH_ITER(hh, tracker->devices, device, tmp_device) {
+    HASH_DEL(tracker->devices, device);
+    FreeDevice(tracker, device);
+  }
+
+  InputTrackedSeat *seat = NULL, *tmp_seat = NULL;
+  HASH_ITER(hh, tracker->seats, seat, tmp_seat) {
+    HASH_DEL(tracker->seats, seat);
+    free(seat->seat_id);
+    free(seat);
+  }
+
+  if (tracker->udev_monitor != NULL) {
+    udev_monitor_unref(tracker->udev_monitor);
+  }
+
+  if (tracker->udev != NULL) {
+    udev_unref(tracker->udev);
+  }
+
+  free(tracker);
+}
+
+CLEANUP_AUTOPTR_DEFINE(InputDeviceTracker, InputDeviceTracker_Free)
+
+InputDeviceTracker *InputDeviceTracker_New(InputMonitor *monitor,
+                                           const InputDeviceHooks *hooks) {
+  CLEANUP_AUTOPTR(InputDeviceTracker) tracker = Alloc(sizeof(InputDeviceTracker));
+  tracker->monitor = monitor;
+  tracker->hooks = hooks;
+
+  tracker->udev = udev_new();
+  if (tracker->udev == NULL) {
+    LogError("Failed to create udev instance");
+    return NULL;
+  }
+
+  tracker->udev_monitor = udev_monitor_new_from_netlink(tracker->udev, "udev");
+  if (tracker->udev_monitor == NULL) {
+    LogError("Failed to create udev monitor");
+    return NULL;
+  }
+
+  int rc = 0;
+  if ((rc = udev_monitor_filter_add_match_subsystem_devtype(tracker->udev_monitor,
+                                                             "input", NULL)) < 0 ||
+      (rc = udev_monitor_enable_receiving(tracker->udev_monitor)) < 0) {
+    LogErrno(-rc, "Failed to start udev monitor");
+    return NULL;
+  }
+
+  if ((rc = Loop_AddIo(monitor->event, &tracker->udev_source,
+                       udev_monitor_get_fd(tracker->udev_monitor), EPOLLIN, OnUdevEvents,
+                       tracker, "udev-devices")) < 0) {
+    LogErrno(-rc, "Failed to monitor udev");
+    return NULL;
+  }
+
+  // The udev monitor is already receiving, so devices that appear during enumeration are
+  // not missed, just seen twice.
+  if (!EnumerateDevices(tracker)) {
+    return NULL;
+  }
+
+  return STEAL_POINTER(&tracker);
+}
+
+bool InputDeviceTracker_AddSeat(InputDeviceTracker *tracker, const char *seat_id) {
+  if (IsSeatMonitored(tracker, seat_id)) {
+    LogInfo("Ignoring duplicate input seat: %s", seat_id);
+    return false;
+  }
+
+  InputTrackedSeat *seat = Alloc(sizeof(InputTrackedSeat));
+  seat->seat_id = StrDup(seat_id);
+  HASH_ADD_STR(tracker->seats, seat_id, seat);
+
+  InputDevice *device = NULL, *tmp = NULL;
+  HASH_ITER(hh, tracker->devices, device, tmp) {
+    if (strcmp(device->seat_id, seat_id) == 0) {
+      AttachDevice(tracker, device);
+    }
+  }
+
+  return true;
+}
+
+bool InputDeviceTracker_RemoveSeat(InputDeviceTracker *tracker, const char *seat_id) {
+  InputTrackedSeat *seat = NULL;
+  HASH_FIND_STR(tracker->seats, seat_id, seat);
+  if (seat == NULL) {
+    LogInfo("Ignoring removal of missing input seat: %s", seat_id);
+    return false;
+  }
+
+  InputDevice *device = NULL, *tmp = NULL;
+  HASH_ITER(hh, tracker->devices, device, tmp) {
+    if (strcmp(device->seat_id, seat_id) == 0) {
+      DetachDevice(tracker, device);
+    }
+  }
+
+  HASH_DEL(tracker->seats, seat);
+  free(seat->seat_id);
+  free(seat);
+  return true;
+}
+
+void InputDeviceTracker_Refresh(InputDeviceTracker *tracker) {
+  InputDevice *device = NULL, *tmp = NULL;
+  HASH_ITER(hh, tracker->devices, device, tmp) {
+    if (!IsSeatMonitored(tracker, device->seat_id)) {
+      continue;
+    }
+
+    if (device->state == NULL) {
+      AttachDevice(tracker, device);
+    } else if (tracker->hooks->update != NULL &&
+               !tracker->hooks->update(tracker->monitor, device)) {
+      DetachDevice(tracker, device);
+    }
+  }
+}
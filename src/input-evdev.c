@@ -0,0 +1,299 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// An input backend that reads evdev devices directly. Only devices that can send one of
+// the buttons used by the rules are opened, and EVIOCSMASK has the kernel drop every
+// other event, so pointer motion, scrolling and typing never wake the daemon.
+
+#include "input-private.h"
+#include "input.h"
+#include "src/loop.h"
+#include "src/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libevdev/libevdev.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BITS_TO_LONGS(bits) (((bits) + LONG_BIT - 1) / LONG_BIT)
+
+typedef struct InputEvdevDevice InputEvdevDevice;
+typedef struct InputMonitorEvdev InputMonitorEvdev;
+
+static const int kKeyRepeatValue = 2;
+
+struct InputEvdevDevice {
+  InputMonitor *monitor;
+  InputDevice *device;
+
+  int fd;
+  struct libevdev *evdev;
+  sd_event_source *source;
+};
+
+struct InputMonitorEvdev {
+  // The EV_KEY codes used by the rules, in the bitmap format EVIOCSMASK takes.
+  unsigned long buttons[BITS_TO_LONGS(KEY_CNT)];
+
+  InputDeviceTracker *tracker;
+};
+
+static bool TestBit(const unsigned long *bitmap, unsigned int bit) {
+  return (bitmap[bit / LONG_BIT] >> (bit % LONG_BIT)) & 1;
+}
+
+static void SetBit(unsigned long *bitmap, unsigned int bit) {
+  bitmap[bit / LONG_BIT] |= 1UL << (bit % LONG_BIT);
+}
+
+static void InputEvdevDevice_Free(InputEvdevDevice *evdev_device) {
+  sd_event_source_disable_unref(STEAL_POINTER(&evdev_device->source));
+
+  if (evdev_device->evdev != NULL) {
+    libevdev_free(evdev_device->evdev);
+  }
+
+  if (evdev_device->fd != -1) {
+    close(evdev_device->fd);
+  }
+
+  free(evdev_device);
+}
+
+CLEANUP_AUTOPTR_DEFINE(InputEvdevDevice, InputEvdevDevice_Free)
+
+static bool HasAnyButton(InputMonitorEvdev *evdev_monitor, struct libevdev *evdev) {
+  for (unsigned int code = 0; code < KEY_CNT; code++) {
+    if (TestBit(evdev_monitor->buttons, code) &&
+        libevdev_has_event_code(evdev, EV_KEY, code)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Has the kernel only deliver the given EV_KEY codes. EV_SYN can't be masked, but empty
+// SYN_REPORTs are dropped, so frames without one of the buttons don't cause wakeups.
+static bool SetEventMask(int fd, const unsigned long *buttons) {
+  unsigned long types[BITS_TO_LONGS(EV_CNT)] = {0};
+  SetBit(types, EV_KEY);
+
+  // The mask for type 0 (EV_SYN) selects which event types are delivered at all.
+  struct input_mask type_mask = {
+      .type = EV_SYN,
+      .codes_size = sizeof(types),
+      .codes_ptr = (uintptr_t)types,
+  };
+  struct input_mask key_mask = {
+      .type = EV_KEY,
+      .codes_size = sizeof(unsigned long) * BITS_TO_LONGS(KEY_CNT),
+      .codes_ptr = (uintptr_t)buttons,
+  };
+
+  return ioctl(fd, EVIOCSMASK, &type_mask) != -1 &&
+         ioctl(fd, EVIOCSMASK, &key_mask) != -1;
+}
+
+static void DeliverEvdevEvent(InputEvdevDevice *evdev_device,
+                              const struct input_event *event) {
+  InputMonitorEvdev *evdev_monitor = evdev_device->monitor->backend_data;
+
+  // The mask may be unsupported, and key repeats pass it anyway.
+  if (event->type != EV_KEY || event->value == kKeyRepeatValue ||
+      event->code >= KEY_CNT || !TestBit(evdev_monitor->buttons, event->code)) {
+    return;
+  }
+
+  InputMonitorEvent monitor_event = {
+      .seat_id = evdev_device->device->seat_id,
+      .device = evdev_device->device->sysname,
+      .button = event->code,
+      .pressed = event->value != 0,
+      .time_usec = (uint64_t)event->input_event_sec * 1000000 + event->input_event_usec,
+  };
+
+  InputMonitor_Deliver(evdev_device->monitor, &monitor_event);
+}
+
+static int OnEvdevEvents(sd_event_source *source, int fd, uint32_t revents,
+                         void *userdata) {
+  InputEvdevDevice *evdev_device = userdata;
+
+  if (revents & (EPOLLHUP | EPOLLERR)) {
+    LogError("Hangup / error while monitoring %s, disabling",
+             evdev_device->device->devnode);
+    return -ENODEV;
+  }
+
+  // libevdev reads as many events as it can per read(), and hands them out one by one.
+  unsigned int flags = LIBEVDEV_READ_FLAG_NORMAL;
+  for (;;) {
+    struct input_event event;
+    int rc = libevdev_next_event(evdev_device->evdev, flags, &event);
+    if (rc == -EAGAIN) {
+      if (flags == LIBEVDEV_READ_FLAG_SYNC) {
+        flags = LIBEVDEV_READ_FLAG_NORMAL;
+        continue;
+      }
+
+      break;
+    } else if (rc < 0) {
+      LogErrno(-rc, "Failed to read events from %s", evdev_device->device->devnode);
+      return rc;
+    } else if (rc == LIBEVDEV_READ_STATUS_SYNC && flags == LIBEVDEV_READ_FLAG_NORMAL) {
+      // Events were dropped, so catch up with the key state changes that were missed.
+      LogDebug("Resyncing %s after dropped events", evdev_device->device->devnode);
+      flags = LIBEVDEV_READ_FLAG_SYNC;
+      continue;
+    }
+
+    DeliverEvdevEvent(evdev_device, &event);
+  }
+
+  return 0;
+}
+
+static void *AttachDevice(InputMonitor *monitor, InputDevice *device) {
+  InputMonitorEvdev *evdev_monitor = monitor->backend_data;
+
+  CLEANUP_AUTOPTR(InputEvdevDevice) evdev_device = Alloc(sizeof(InputEvdevDevice));
+  evdev_device->monitor = monitor;
+  evdev_device->device = device;
+
+  evdev_device->fd = open(device->devnode, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (evdev_device->fd == -1) {
+    LogErrno(errno, "Failed to open %s", device->devnode);
+    return NULL;
+  }
+
+  int rc = 0;
+  if ((rc = libevdev_new_from_fd(evdev_device->fd, &evdev_device->evdev)) < 0) {
+    LogErrno(-rc, "Failed to initialize libevdev for %s", device->devnode);
+    return NULL;
+  }
+
+  if (!HasAnyButton(evdev_monitor, evdev_device->evdev)) {
+    LogDebug("Skipping %s, which has none of the buttons in use", device->devnode);
+    return NULL;
+  }
+
+  // Match libinput's timestamps, which the rest of the daemon expects.
+  if ((rc = libevdev_set_clock_id(evdev_device->evdev, CLOCK_MONOTONIC)) < 0) {
+    LogErrno(-rc, "Failed to set the clock of %s", device->devnode);
+    return NULL;
+  }
+
+  if (!SetEventMask(evdev_device->fd, evdev_monitor->buttons)) {
+    LogErrno(errno, "Failed to mask events of %s, filtering them here instead",
+             device->devnode);
+  }
+
+  if ((rc = Loop_AddIo(monitor->event, &evdev_device->source, evdev_device->fd, EPOLLIN,
+                       OnEvdevEvents, evdev_device, "evdev-input")) < 0 ||
+      (rc = sd_event_source_set_priority(evdev_device->source, monitor->priority)) < 0) {
+    LogErrno(-rc, "Failed to monitor %s", device->devnode);
+    return NULL;
+  }
+
+  LogDebug("Monitoring %s (%s) on seat %s", device->devnode,
+           libevdev_get_name(evdev_device->evdev), device->seat_id);
+  return STEAL_POINTER(&evdev_device);
+}
+
+static void DetachDevice(InputMonitor *monitor, InputDevice *device) {
+  InputEvdevDevice_Free(device->state);
+}
+
+static bool UpdateDevice(InputMonitor *monitor, InputDevice *device) {
+  InputMonitorEvdev *evdev_monitor = monitor->backend_data;
+  InputEvdevDevice *evdev_device = device->state;
+
+  if (!HasAnyButton(evdev_monitor, evdev_device->evdev)) {
+    LogDebug("Closing %s, which has none of the buttons in use anymore", device->devnode);
+    return false;
+  }
+
+  if (!SetEventMask(evdev_device->fd, evdev_monitor->buttons)) {
+    LogErrno(errno, "Failed to update the event mask of %s", device->devnode);
+  }
+
+  return true;
+}
+
+static const InputDeviceHooks kInputEvdevDeviceHooks = {
+    .attach = AttachDevice,
+    .detach = DetachDevice,
+    .update = UpdateDevice,
+};
+
+static bool InputMonitorEvdev_Add(InputMonitor *monitor, const char *seat_id) {
+  InputMonitorEvdev *evdev_monitor = monitor->backend_data;
+  return InputDeviceTracker_AddSeat(evdev_monitor->tracker, seat_id);
+}
+
+static bool InputMonitorEvdev_Remove(InputMonitor *monitor, const char *seat_id) {
+  InputMonitorEvdev *evdev_monitor = monitor->backend_data;
+  return InputDeviceTracker_RemoveSeat(evdev_monitor->tracker, seat_id);
+}
+
+static void InputMonitorEvdev_SetButtons(InputMonitor *monitor, const unsigned int *codes,
+                                         size_t count) {
+  InputMonitorEvdev *evdev_monitor = monitor->backend_data;
+
+  unsigned long buttons[BITS_TO_LONGS(KEY_CNT)] = {0};
+  for (size_t i = 0; i < count; i++) {
+    if (codes[i] < KEY_CNT) {
+      SetBit(buttons, codes[i]);
+    }
+  }
+
+  // Most reloads don't touch the buttons in use, so leave the devices alone then.
+  if (memcmp(buttons, evdev_monitor->buttons, sizeof(buttons)) == 0) {
+    return;
+  }
+
+  memcpy(evdev_monitor->buttons, buttons, sizeof(buttons));
+
+  // Devices may have become (ir)relevant, and the open ones need their masks updated.
+  InputDeviceTracker_Refresh(evdev_monitor->tracker);
+}
+
+static void InputMonitorEvdev_Free(InputMonitor *monitor) {
+  InputMonitorEvdev *evdev_monitor = STEAL_POINTER(&monitor->backend_data);
+
+  if (evdev_monitor->tracker != NULL) {
+    InputDeviceTracker_Free(evdev_monitor->tracker);
+  }
+
+  free(evdev_monitor);
+}
+
+static const InputMonitorBackend kInputMonitorEvdevBackend = {
+    .add = InputMonitorEvdev_Add,
+    .remove = InputMonitorEvdev_Remove,
+    .free = InputMonitorEvdev_Free,
+    .set_buttons = InputMonitorEvdev_SetButtons,
+};
+
+InputMonitor *InputMonitor_NewEvdev(sd_event *event, int priority) {
+  InputMonitorEvdev *evdev_monitor = Alloc(sizeof(InputMonitorEvdev));
+  CLEANUP_AUTOPTR(InputMonitor)
+  monitor = InputMonitor_NewWithBackend(event, priority, &kInputMonitorEvdevBackend,
+                                        evdev_monitor);
+
+  evdev_monitor->tracker = InputDeviceTracker_New(monitor, &kInputEvdevDeviceHooks);
+  if (evdev_monitor->tracker == NULL) {
+    return NULL;
+  }
+
+  return STEAL_POINTER(&monitor);
+}
@@ -0,0 +1,117 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "input.h"
+#include "utils.h"
+
+#include <libinput.h>
+#include <stdio.h>
+#include <systemd/sd-event.h>
+#include <uthash.h>
+
+typedef struct InputMonitorBackend InputMonitorBackend;
+typedef struct InputDevice InputDevice;
+typedef struct InputDeviceHooks InputDeviceHooks;
+typedef struct InputDeviceTracker InputDeviceTracker;
+typedef struct InputShards InputShards;
+
+// The source of the events of an InputMonitor.
+struct InputMonitorBackend {
+  bool (*add)(InputMonitor *monitor, const char *seat_id);
+  bool (*remove)(InputMonitor *monitor, const char *seat_id);
+  void (*free)(InputMonitor *monitor);
+  // Optional, tells the backend which button codes the rules use, so it can skip the
+  // devices and events that can't match any.
+  void (*set_buttons)(InputMonitor *monitor, const unsigned int *codes, size_t count);
+};
+
+struct InputMonitor {
+  sd_event *event;
+  // The sd-event priority of the sources reading live input.
+  int priority;
+
+  const InputMonitorBackend *backend;
+  void *backend_data;
+
+  FILE *recording;
+
+  InputMonitor_OnInputEvent on_input_event;
+  InputMonitor_OnReplayFinished on_replay_finished;
+
+  void *userdata;
+  InputMonitor_UserDataDestroy userdata_destroy;
+};
+
+InputMonitor *InputMonitor_NewWithBackend(sd_event *event, int priority,
+                                          const InputMonitorBackend *backend,
+                                          void *backend_data);
+
+// Passes an event from the backend on to the callback, recording it if requested.
+void InputMonitor_Deliver(InputMonitor *monitor, const InputMonitorEvent *event);
+
+// Fills in decoded from a libinput event if it is a pointer button event, pointing into
+// seat_id and the event's device.
+bool InputMonitor_DecodeLibInputEvent(const char *seat_id, struct libinput_event *event,
+                                      InputMonitorEvent *decoded);
+
+// Passes a libinput event on to InputMonitor_Deliver if it is a pointer button event.
+void InputMonitor_DeliverLibInputEvent(InputMonitor *monitor, const char *seat_id,
+                                       struct libinput_event *event);
+
+// Opens and closes devices directly for libinput, since pucrod runs as root.
+extern const struct libinput_interface kInputLibInputInterface;
+
+extern const char kInputRecordingHeader[];
+
+// An input event device known to udev, e.g. /dev/input/event4.
+struct InputDevice {
+  char *syspath;
+  char *sysname;
+  char *devnode;
+  // The seat named by the device's ID_SEAT property, seat0 if unset.
+  char *seat_id;
+
+  // The backend's state for the device, set while it is attached.
+  void *state;
+
+  UT_hash_handle hh;
+};
+
+// Called as the seat of a device starts or stops being monitored.
+struct InputDeviceHooks {
+  // Returns the backend's state for the device, or NULL to leave it detached.
+  void *(*attach)(InputMonitor *monitor, InputDevice *device);
+  void (*detach)(InputMonitor *monitor, InputDevice *device);
+  // Optional, adapts an attached device to what the backend wants now. Returns false to
+  // have it detached.
+  bool (*update)(InputMonitor *monitor, InputDevice *device);
+};
+
+// Keeps track of every input event device via a single udev monitor, attaching each one
+// to the backend while its seat is monitored.
+InputDeviceTracker *InputDeviceTracker_New(InputMonitor *monitor,
+                                           const InputDeviceHooks *hooks);
+void InputDeviceTracker_Free(InputDeviceTracker *tracker);
+
+bool InputDeviceTracker_AddSeat(InputDeviceTracker *tracker, const char *seat_id);
+bool InputDeviceTracker_RemoveSeat(InputDeviceTracker *tracker, const char *seat_id);
+
+// Updates the attached devices of monitored seats and attaches the others again, for when
+// the backend changed which devices it wants. Attached devices are never reopened, so
+// buttons held at the time stay held.
+void InputDeviceTracker_Refresh(InputDeviceTracker *tracker);
+
+// Reads the libinput contexts of seats on shard_count threads with event loops of their
+// own, and delivers their button events to monitor from its loop.
+InputShards *InputShards_New(InputMonitor *monitor, size_t shard_count);
+void InputShards_Free(InputShards *shards);
+
+// Hands libinput over to the shard picked by hashing seat_id, which reads and frees it
+// from then on.
+void InputShards_Attach(InputShards *shards, const char *seat_id,
+                        struct libinput *libinput);
+// Has the shard of seat_id stop reading its context.
+void InputShards_Detach(InputShards *shards, const char *seat_id);
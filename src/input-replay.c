@@ -0,0 +1,281 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// An input backend that replays events written by InputMonitor_StartRecording, so the
+// rest of the pipeline can be exercised without any input devices.
+
+#include "input-private.h"
+#include "input.h"
+#include "src/loop.h"
+#include "src/utils.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+
+// How many events to deliver per event loop iteration when replaying at max speed, so
+// that dispatch completions still get processed in between.
+static const size_t kReplayBatchSize = 64;
+
+typedef struct InputReplayEvent InputReplayEvent;
+typedef struct InputMonitorReplay InputMonitorReplay;
+
+struct InputReplayEvent {
+  uint64_t time_usec;
+  char *seat_id;
+  char *device;
+  uint32_t button;
+  bool pressed;
+};
+
+struct InputMonitorReplay {
+  InputReplaySpeed speed;
+
+  InputReplayEvent *events;
+  size_t event_count;
+  size_t next_event;
+
+  // When the replay started, on CLOCK_MONOTONIC.
+  uint64_t start_usec;
+  sd_event_source *source;
+};
+
+static void InputMonitorReplay_Free(InputMonitorReplay *replay) {
+  sd_event_source_disable_unref(STEAL_POINTER(&replay->source));
+
+  for (size_t i = 0; i < replay->event_count; i++) {
+    free(replay->events[i].seat_id);
+    free(replay->events[i].device);
+  }
+
+  free(replay->events);
+  free(replay);
+}
+
+CLEANUP_AUTOPTR_DEFINE(InputMonitorReplay, InputMonitorReplay_Free)
+
+static bool ParseRecording(InputMonitorReplay *replay, const char *path) {
+  CLEANUP_FCLOSE FILE *file = fopen(path, "re");
+  if (file == NULL) {
+    LogErrno(errno, "Failed to open %s", path);
+    return false;
+  }
+
+  size_t capacity = 0;
+  size_t line_number = 0;
+  CLEANUP_AUTOFREE char *line = NULL;
+  size_t line_capacity = 0;
+
+  // Anything else would most likely be replayed as garbage.
+  if (getline(&line, &line_capacity, file) == -1) {
+    LogError("%s is empty", path);
+    return false;
+  }
+
+  line_number++;
+  line[strcspn(line, "\n")] = '\0';
+  if (strcmp(line, kInputRecordingHeader) != 0) {
+    LogError("%s doesn't start with '%s'", path, kInputRecordingHeader);
+    return false;
+  }
+
+  while (getline(&line, &line_capacity, file) != -1) {
+    line_number++;
+
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+
+    InputReplayEvent event = {0};
+    int pressed = 0;
+    if (sscanf(line, "%" SCNu64 " %ms %ms %" SCNu32 " %d", &event.time_usec,
+               &event.seat_id, &event.device, &event.button, &pressed) != 5) {
+      LogError("Invalid event at %s:%zu", path, line_number);
+      free(event.seat_id);
+      free(event.device);
+      return false;
+    }
+
+    event.pressed = pressed != 0;
+
+    if (replay->event_count > 0 &&
+        event.time_usec < replay->events[replay->event_count - 1].time_usec) {
+      LogError("Event at %s:%zu is older than the one before it", path, line_number);
+      free(event.seat_id);
+      free(event.device);
+      return false;
+    }
+
+    if (replay->event_count == capacity) {
+      capacity = capacity != 0 ? capacity * 2 : 64;
+      replay->events = realloc(replay->events, sizeof(InputReplayEvent) * capacity);
+      if (replay->events == NULL) {
+        abort();
+      }
+    }
+
+    replay->events[replay->event_count++] = event;
+  }
+
+  if (ferror(file)) {
+    LogErrno(errno, "Failed to read %s", path);
+    return false;
+  }
+
+  return true;
+}
+
+static void DeliverReplayEvent(InputMonitor *monitor, const InputReplayEvent *event,
+                               uint64_t time_usec) {
+  InputMonitorEvent monitor_event = {
+      .seat_id = event->seat_id,
+      .device = event->device,
+      .button = event->button,
+      .pressed = event->pressed,
+      .time_usec = time_usec,
+  };
+
+  InputMonitor_Deliver(monitor, &monitor_event);
+}
+
+static void FinishReplay(InputMonitor *monitor) {
+  InputMonitorReplay *replay = monitor->backend_data;
+
+  sd_event_source_set_enabled(replay->source, SD_EVENT_OFF);
+
+  uint64_t elapsed_usec = GetMonotonicUsec() - replay->start_usec;
+  LogInfo("Replayed %zu events in %" PRIu64 "us (%.0f events/s)", replay->event_count,
+          elapsed_usec,
+          elapsed_usec != 0 ? replay->event_count * 1e6 / elapsed_usec : 0.0);
+
+  if (monitor->on_replay_finished) {
+    monitor->on_replay_finished(monitor, monitor->userdata);
+  }
+}
+
+// Returns when the given event should be delivered, on CLOCK_MONOTONIC.
+static uint64_t GetReplayTime(InputMonitorReplay *replay, const InputReplayEvent *event) {
+  return replay->start_usec + (event->time_usec - replay->events[0].time_usec);
+}
+
+static int OnReplayTimer(sd_event_source *source, uint64_t usec, void *userdata) {
+  InputMonitor *monitor = userdata;
+  InputMonitorReplay *replay = monitor->backend_data;
+
+  uint64_t now = GetMonotonicUsec();
+  while (replay->next_event < replay->event_count) {
+    const InputReplayEvent *event = &replay->events[replay->next_event];
+    uint64_t event_usec = GetReplayTime(replay, event);
+    if (event_usec > now) {
+      int rc = 0;
+      if ((rc = sd_event_source_set_time(source, event_usec)) < 0 ||
+          (rc = sd_event_source_set_enabled(source, SD_EVENT_ONESHOT)) < 0) {
+        LogErrno(-rc, "Failed to schedule next replayed event");
+        FinishReplay(monitor);
+      }
+
+      return 0;
+    }
+
+    replay->next_event++;
+    // Pretend the kernel saw the event when it was due, so any delay in delivering it
+    // shows up in the input latency.
+    DeliverReplayEvent(monitor, event, event_usec);
+  }
+
+  FinishReplay(monitor);
+  return 0;
+}
+
+static int OnReplayBatch(sd_event_source *source, void *userdata) {
+  InputMonitor *monitor = userdata;
+  InputMonitorReplay *replay = monitor->backend_data;
+
+  for (size_t i = 0; i < kReplayBatchSize && replay->next_event < replay->event_count;
+       i++) {
+    DeliverReplayEvent(monitor, &replay->events[replay->next_event++],
+                       GetMonotonicUsec());
+  }
+
+  if (replay->next_event == replay->event_count) {
+    FinishReplay(monitor);
+  }
+
+  return 0;
+}
+
+static bool StartReplay(InputMonitor *monitor) {
+  InputMonitorReplay *replay = monitor->backend_data;
+  int rc = 0;
+
+  LogInfo("Starting replay of %zu events", replay->event_count);
+  replay->start_usec = GetMonotonicUsec();
+
+  if (replay->event_count == 0) {
+    FinishReplay(monitor);
+    return true;
+  }
+
+  switch (replay->speed) {
+  case kInputReplaySpeedRealtime:
+    rc = Loop_AddTime(monitor->event, &replay->source, CLOCK_MONOTONIC,
+                      replay->start_usec, 0, OnReplayTimer, monitor, "replay");
+    break;
+  case kInputReplaySpeedMax:
+    if ((rc = Loop_AddDefer(monitor->event, &replay->source, OnReplayBatch, monitor,
+                            "replay")) >= 0) {
+      rc = sd_event_source_set_enabled(replay->source, SD_EVENT_ON);
+    }
+    break;
+  }
+
+  if (rc < 0) {
+    LogErrno(-rc, "Failed to start replay");
+    return false;
+  }
+
+  return true;
+}
+
+static bool InputMonitorReplay_Add(InputMonitor *monitor, const char *seat_id) {
+  InputMonitorReplay *replay = monitor->backend_data;
+
+  // Events for seats that are added later will still be delivered, and dropped by the
+  // pipeline like any event from an unknown seat would be.
+  if (replay->start_usec == 0) {
+    return StartReplay(monitor);
+  }
+
+  return true;
+}
+
+static bool InputMonitorReplay_Remove(InputMonitor *monitor, const char *seat_id) {
+  return true;
+}
+
+static void InputMonitorReplay_FreeBackend(InputMonitor *monitor) {
+  InputMonitorReplay_Free(STEAL_POINTER(&monitor->backend_data));
+}
+
+static const InputMonitorBackend kInputMonitorReplayBackend = {
+    .add = InputMonitorReplay_Add,
+    .remove = InputMonitorReplay_Remove,
+    .free = InputMonitorReplay_FreeBackend,
+};
+
+InputMonitor *InputMonitor_NewReplay(sd_event *event, const char *path,
+                                     InputReplaySpeed speed) {
+  CLEANUP_AUTOPTR(InputMonitorReplay) replay = Alloc(sizeof(InputMonitorReplay));
+  replay->speed = speed;
+
+  if (!ParseRecording(replay, path)) {
+    LogError("Failed to load recorded events from %s", path);
+    return NULL;
+  }
+
+  return InputMonitor_NewWithBackend(event, SD_EVENT_PRIORITY_NORMAL,
+                                     &kInputMonitorReplayBackend, STEAL_POINTER(&replay));
+}
@@ -0,0 +1,441 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Reads the libinput contexts of seats on threads of their own, each running an event
+// loop for its share of the seats, so that a burst of events or hotplugged devices on one
+// seat only holds up the seats sharing its thread. The shards only decode button events,
+// which are handed to the monitor's loop to be matched and dispatched.
+
+#include "input-private.h"
+#include "input.h"
+#include "src/loop.h"
+#include "src/utils.h"
+
+#include <errno.h>
+#include <libinput.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+#include <uthash.h>
+
+typedef struct InputShard InputShard;
+typedef struct InputShardCommand InputShardCommand;
+typedef struct InputShardSeat InputShardSeat;
+typedef struct InputShardEvent InputShardEvent;
+
+static const uint32_t kFnvOffsetBasis = 2166136261u;
+static const uint32_t kFnvPrime = 16777619u;
+
+typedef enum {
+  kInputShardCommandAttach,
+  kInputShardCommandDetach,
+  kInputShardCommandExit,
+} InputShardCommandKind;
+
+// Sent from the monitor's loop to a shard, which runs them in order.
+struct InputShardCommand {
+  InputShardCommandKind kind;
+  char *seat_id;
+  // Handed over to the shard by attach commands.
+  struct libinput *libinput;
+
+  InputShardCommand *next;
+};
+
+// A seat whose libinput context is read by a shard, only ever touched by its thread.
+struct InputShardSeat {
+  char *seat_id;
+  struct libinput *libinput;
+  sd_event_source *source;
+
+  InputShard *shard;
+
+  UT_hash_handle hh;
+};
+
+// A decoded button event on its way from a shard to the monitor's loop.
+struct InputShardEvent {
+  InputMonitorEvent event;
+  char *seat_id;
+  char *device;
+
+  InputShardEvent *next;
+};
+
+struct InputShard {
+  InputShards *shards;
+  size_t index;
+
+  sd_event *event;
+  pthread_t thread;
+  bool running;
+
+  pthread_mutex_t lock;
+  // Commands not run yet, oldest first.
+  InputShardCommand *commands_head;
+  InputShardCommand **commands_tail;
+  int command_fd;
+  sd_event_source *command_source;
+
+  InputShardSeat *seats;
+};
+
+struct InputShards {
+  InputMonitor *monitor;
+
+  InputShard *shards;
+  size_t shard_count;
+
+  // Decoded events, newest first, pushed by the shards without a lock and taken all at
+  // once by the monitor's loop.
+  _Atomic(InputShardEvent *) events;
+  // Signaled by a shard when it pushes onto an empty stack.
+  int events_fd;
+  sd_event_source *events_source;
+};
+
+static void InputShardCommand_Free(InputShardCommand *command) {
+  if (command->libinput != NULL) {
+    libinput_unref(STEAL_POINTER(&command->libinput));
+  }
+
+  free(STEAL_POINTER(&command->seat_id));
+  free(command);
+}
+
+static void InputShardSeat_Free(InputShardSeat *seat) {
+  sd_event_source_disable_unref(STEAL_POINTER(&seat->source));
+  libinput_unref(STEAL_POINTER(&seat->libinput));
+  free(STEAL_POINTER(&seat->seat_id));
+  free(seat);
+}
+
+static void InputShardEvent_Free(InputShardEvent *event) {
+  free(STEAL_POINTER(&event->seat_id));
+  free(STEAL_POINTER(&event->device));
+  free(event);
+}
+
+// Runs on the shard.
+static void PushEvent(InputShards *shards, const InputMonitorEvent *decoded) {
+  InputShardEvent *event = Alloc(sizeof(InputShardEvent));
+  event->event = *decoded;
+  event->event.seat_id = event->seat_id = StrDup(decoded->seat_id);
+  event->event.device = event->device = StrDup(decoded->device);
+
+  InputShardEvent *head = atomic_load_explicit(&shards->events, memory_order_relaxed);
+  do {
+    event->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&shards->events, &head, event,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+
+  if (head == NULL && eventfd_write(shards->events_fd, 1) == -1) {
+    LogErrno(errno, "Failed to signal input events");
+  }
+}
+
+static int OnShardInput(sd_event_source *source, int fd, uint32_t revents,
+                        void *userdata) {
+  InputShardSeat *seat = userdata;
+
+  if (revents & (EPOLLHUP | EPOLLERR)) {
+    LogError("Hangup / error while monitoring %s, disabling", seat->seat_id);
+    return -EINTR;
+  }
+
+  for (;;) {
+    int rc = 0;
+    if ((rc = libinput_dispatch(seat->libinput)) < 0) {
+      LogErrno(-rc, "Failed to dispatch events for %s", seat->seat_id);
+      return rc;
+    }
+
+    struct libinput_event *event = libinput_get_event(seat->libinput);
+    if (event == NULL) {
+      break;
+    }
+
+    InputMonitorEvent decoded;
+    if (InputMonitor_DecodeLibInputEvent(seat->seat_id, event, &decoded)) {
+      PushEvent(seat->shard->shards, &decoded);
+    }
+
+    libinput_event_destroy(event);
+  }
+
+  return 0;
+}
+
+// Runs on the shard.
+static void RunCommand(InputShard *shard, InputShardCommand *command) {
+  InputShardSeat *seat = NULL;
+  int rc = 0;
+
+  switch (command->kind) {
+  case kInputShardCommandAttach:
+    seat = Alloc(sizeof(InputShardSeat));
+    seat->seat_id = STEAL_POINTER(&command->seat_id);
+    seat->libinput = STEAL_POINTER(&command->libinput);
+    seat->shard = shard;
+
+    if ((rc = Loop_AddIo(shard->event, &seat->source, libinput_get_fd(seat->libinput),
+                         EPOLLIN, OnShardInput, seat, "libinput-input")) < 0) {
+      LogErrno(-rc, "Failed to monitor libinput seat %s", seat->seat_id);
+      InputShardSeat_Free(seat);
+      break;
+    }
+
+    LogDebug("Input shard %zu: attached seat %s", shard->index, seat->seat_id);
+    HASH_ADD_STR(shard->seats, seat_id, seat);
+    break;
+  case kInputShardCommandDetach:
+    HASH_FIND_STR(shard->seats, command->seat_id, seat);
+    if (seat != NULL) {
+      LogDebug("Input shard %zu: detached seat %s", shard->index, seat->seat_id);
+      HASH_DEL(shard->seats, seat);
+      InputShardSeat_Free(seat);
+    }
+    break;
+  case kInputShardCommandExit:
+    sd_event_exit(shard->event, 0);
+    break;
+  }
+}
+
+static int OnShardCommands(sd_event_source *source, int fd, uint32_t revents,
+                           void *userdata) {
+  InputShard *shard = userdata;
+
+  eventfd_t value = 0;
+  if (eventfd_read(fd, &value) == -1 && errno != EAGAIN) {
+    LogErrno(errno, "Failed to read input shard commands");
+  }
+
+  pthread_mutex_lock(&shard->lock);
+  InputShardCommand *commands = STEAL_POINTER(&shard->commands_head);
+  shard->commands_tail = &shard->commands_head;
+  pthread_mutex_unlock(&shard->lock);
+
+  while (commands != NULL) {
+    InputShardCommand *next = commands->next;
+    RunCommand(shard, commands);
+    InputShardCommand_Free(commands);
+    commands = next;
+  }
+
+  return 0;
+}
+
+static void PostCommand(InputShard *shard, InputShardCommandKind kind,
+                        const char *seat_id, struct libinput *libinput) {
+  InputShardCommand *command = Alloc(sizeof(InputShardCommand));
+  command->kind = kind;
+  command->seat_id = seat_id != NULL ? StrDup(seat_id) : NULL;
+  command->libinput = libinput;
+
+  pthread_mutex_lock(&shard->lock);
+  *shard->commands_tail = command;
+  shard->commands_tail = &command->next;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (eventfd_write(shard->command_fd, 1) == -1) {
+    LogErrno(errno, "Failed to signal input shard %zu", shard->index);
+  }
+}
+
+static void *RunShard(void *data) {
+  InputShard *shard = data;
+
+  int rc = 0;
+  if ((rc = Loop_Run(shard->event)) < 0) {
+    LogErrno(-rc, "Failed to run event loop of input shard %zu", shard->index);
+  }
+
+  return NULL;
+}
+
+static int OnShardEvents(sd_event_source *source, int fd, uint32_t revents,
+                         void *userdata) {
+  InputShards *shards = userdata;
+
+  eventfd_t value = 0;
+  if (eventfd_read(fd, &value) == -1 && errno != EAGAIN) {
+    LogErrno(errno, "Failed to read input shard events");
+  }
+
+  InputShardEvent *event =
+      atomic_exchange_explicit(&shards->events, NULL, memory_order_acquire);
+
+  // Reverse the stack, so that every seat's events are delivered in order.
+  InputShardEvent *ordered = NULL;
+  while (event != NULL) {
+    InputShardEvent *next = event->next;
+    event->next = ordered;
+    ordered = event;
+    event = next;
+  }
+
+  while (ordered != NULL) {
+    InputShardEvent *next = ordered->next;
+    InputMonitor_Deliver(shards->monitor, &ordered->event);
+    InputShardEvent_Free(ordered);
+    ordered = next;
+  }
+
+  return 0;
+}
+
+static void InputShard_Stop(InputShard *shard) {
+  if (shard->running) {
+    PostCommand(shard, kInputShardCommandExit, NULL, NULL);
+    pthread_join(shard->thread, NULL);
+    shard->running = false;
+  }
+
+  // Commands may have been posted after the exit.
+  InputShardCommand *command = STEAL_POINTER(&shard->commands_head);
+  while (command != NULL) {
+    InputShardCommand *next = command->next;
+    InputShardCommand_Free(command);
+    command = next;
+  }
+
+  InputShardSeat *seat = NULL, *tmp = NULL;
+  HASH_ITER(hh, shard->seats, seat, tmp) {
+    HASH_DEL(shard->seats, seat);
+    InputShardSeat_Free(seat);
+  }
+
+  sd_event_source_disable_unref(STEAL_POINTER(&shard->command_source));
+  if (shard->command_fd != -1) {
+    close(shard->command_fd);
+  }
+
+  sd_event_unref(STEAL_POINTER(&shard->event));
+  pthread_mutex_destroy(&shard->lock);
+}
+
+static bool InputShard_Start(InputShard *shard) {
+  int rc = 0;
+  if ((rc = sd_event_new(&shard->event)) < 0) {
+    LogErrno(-rc, "Failed to create event loop of input shard %zu", shard->index);
+    return false;
+  }
+
+  shard->command_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (shard->command_fd == -1) {
+    LogErrno(errno, "Failed to create eventfd of input shard %zu", shard->index);
+    return false;
+  }
+
+  if ((rc = Loop_AddIo(shard->event, &shard->command_source, shard->command_fd, EPOLLIN,
+                       OnShardCommands, shard, "input-shard-commands")) < 0) {
+    LogErrno(-rc, "Failed to monitor eventfd of input shard %zu", shard->index);
+    return false;
+  }
+
+  // The shard must leave the signals handled through the main loop's signalfd blocked,
+  // apart from SIGPROF, which its stall watcher samples backtraces with.
+  sigset_t all_signals, old_mask;
+  sigfillset(&all_signals);
+  sigdelset(&all_signals, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+  rc = pthread_create(&shard->thread, NULL, RunShard, shard);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  if (rc != 0) {
+    LogErrno(rc, "Failed to start input shard %zu", shard->index);
+    return false;
+  }
+
+  shard->running = true;
+  return true;
+}
+
+void InputShards_Free(InputShards *shards) {
+  for (size_t i = 0; i < shards->shard_count; i++) {
+    InputShard_Stop(&shards->shards[i]);
+  }
+
+  sd_event_source_disable_unref(STEAL_POINTER(&shards->events_source));
+
+  // Events that weren't delivered yet are dropped.
+  InputShardEvent *event = atomic_exchange(&shards->events, NULL);
+  while (event != NULL) {
+    InputShardEvent *next = event->next;
+    InputShardEvent_Free(event);
+    event = next;
+  }
+
+  if (shards->events_fd != -1) {
+    close(shards->events_fd);
+  }
+
+  free(shards->shards);
+  free(shards);
+}
+
+CLEANUP_AUTOPTR_DEFINE(InputShards, InputShards_Free)
+
+InputShards *InputShards_New(InputMonitor *monitor, size_t shard_count) {
+  CLEANUP_AUTOPTR(InputShards) shards = Alloc(sizeof(InputShards));
+  shards->monitor = monitor;
+  shards->shards = Alloc(sizeof(InputShard) * shard_count);
+
+  shards->events_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (shards->events_fd == -1) {
+    LogErrno(errno, "Failed to create input shard eventfd");
+    return NULL;
+  }
+
+  int rc = 0;
+  if ((rc = Loop_AddIo(monitor->event, &shards->events_source, shards->events_fd,
+                       EPOLLIN, OnShardEvents, shards, "input-shard-events")) < 0 ||
+      (rc = sd_event_source_set_priority(shards->events_source, monitor->priority)) < 0) {
+    LogErrno(-rc, "Failed to monitor input shard eventfd");
+    return NULL;
+  }
+
+  for (size_t i = 0; i < shard_count; i++) {
+    InputShard *shard = &shards->shards[shards->shard_count++];
+    shard->shards = shards;
+    shard->index = i;
+    shard->command_fd = -1;
+    shard->commands_tail = &shard->commands_head;
+    pthread_mutex_init(&shard->lock, NULL);
+
+    if (!InputShard_Start(shard)) {
+      return NULL;
+    }
+  }
+
+  LogInfo("Reading input on %zu shards", shard_count);
+  return STEAL_POINTER(&shards);
+}
+
+// FNV-1a, so that a seat always lands on the same shard.
+static InputShard *GetShard(InputShards *shards, const char *seat_id) {
+  uint32_t hash = kFnvOffsetBasis;
+  for (const char *p = seat_id; *p != '\0'; p++) {
+    hash = (hash ^ (unsigned char)*p) * kFnvPrime;
+  }
+
+  return &shards->shards[hash % shards->shard_count];
+}
+
+void InputShards_Attach(InputShards *shards, const char *seat_id,
+                        struct libinput *libinput) {
+  InputShard *shard = GetShard(shards, seat_id);
+  LogInfo("Reading input of seat %s on shard %zu", seat_id, shard->index);
+  PostCommand(shard, kInputShardCommandAttach, seat_id, libinput);
+}
+
+void InputShards_Detach(InputShards *shards, const char *seat_id) {
+  PostCommand(GetShard(shards, seat_id), kInputShardCommandDetach, seat_id, NULL);
+}
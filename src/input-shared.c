@@ -0,0 +1,147 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// An input backend that serves every seat from a single libinput path context, with
+// devices attached to it while the seat named by their ID_SEAT property is monitored.
+
+#include "input-private.h"
+#include "input.h"
+#include "src/loop.h"
+#include "src/utils.h"
+
+#include <errno.h>
+#include <libinput.h>
+#include <sys/epoll.h>
+#include <systemd/sd-event.h>
+
+typedef struct InputMonitorShared InputMonitorShared;
+
+struct InputMonitorShared {
+  struct libinput *libinput;
+  sd_event_source *libinput_source;
+
+  InputDeviceTracker *tracker;
+};
+
+CLEANUP_AUTOPTR_DEFINE(libinput_event, libinput_event_destroy)
+
+static void *AttachDevice(InputMonitor *monitor, InputDevice *device) {
+  InputMonitorShared *shared = monitor->backend_data;
+
+  struct libinput_device *libinput_device =
+      libinput_path_add_device(shared->libinput, device->devnode);
+  if (libinput_device == NULL) {
+    LogError("Failed to add %s to seat %s", device->devnode, device->seat_id);
+    return NULL;
+  }
+
+  libinput_device_set_user_data(libinput_device, device);
+  return libinput_device_ref(libinput_device);
+}
+
+static void DetachDevice(InputMonitor *monitor, InputDevice *device) {
+  struct libinput_device *libinput_device = device->state;
+
+  // Events from the device may still be queued, so make sure they aren't routed to it.
+  libinput_device_set_user_data(libinput_device, NULL);
+  libinput_path_remove_device(libinput_device);
+  libinput_device_unref(libinput_device);
+}
+
+static const InputDeviceHooks kInputSharedDeviceHooks = {
+    .attach = AttachDevice,
+    .detach = DetachDevice,
+};
+
+static int OnLibInputEvents(sd_event_source *source, int fd, uint32_t revents,
+                            void *userdata) {
+  InputMonitor *monitor = userdata;
+  InputMonitorShared *shared = monitor->backend_data;
+
+  if (revents & (EPOLLHUP | EPOLLERR)) {
+    LogError("Hangup / error while monitoring input devices, disabling");
+    return -EINTR;
+  }
+
+  for (;;) {
+    int rc = 0;
+    if ((rc = libinput_dispatch(shared->libinput)) < 0) {
+      LogErrno(-rc, "Failed to dispatch input events");
+      return rc;
+    }
+
+    CLEANUP_AUTOPTR(libinput_event) event = libinput_get_event(shared->libinput);
+    if (event == NULL) {
+      break;
+    }
+
+    InputDevice *device = libinput_device_get_user_data(libinput_event_get_device(event));
+    if (device != NULL) {
+      InputMonitor_DeliverLibInputEvent(monitor, device->seat_id, event);
+    }
+  }
+
+  return 0;
+}
+
+static bool InputMonitorShared_Add(InputMonitor *monitor, const char *seat_id) {
+  InputMonitorShared *shared = monitor->backend_data;
+  return InputDeviceTracker_AddSeat(shared->tracker, seat_id);
+}
+
+static bool InputMonitorShared_Remove(InputMonitor *monitor, const char *seat_id) {
+  InputMonitorShared *shared = monitor->backend_data;
+  return InputDeviceTracker_RemoveSeat(shared->tracker, seat_id);
+}
+
+static void InputMonitorShared_Free(InputMonitor *monitor) {
+  InputMonitorShared *shared = monitor->backend_data;
+
+  // Detaching the devices needs the libinput context, so the tracker goes first.
+  if (shared->tracker != NULL) {
+    InputDeviceTracker_Free(STEAL_POINTER(&shared->tracker));
+  }
+
+  sd_event_source_disable_unref(STEAL_POINTER(&shared->libinput_source));
+
+  if (shared->libinput != NULL) {
+    libinput_unref(shared->libinput);
+  }
+
+  free(STEAL_POINTER(&monitor->backend_data));
+}
+
+static const InputMonitorBackend kInputMonitorSharedBackend = {
+    .add = InputMonitorShared_Add,
+    .remove = InputMonitorShared_Remove,
+    .free = InputMonitorShared_Free,
+};
+
+InputMonitor *InputMonitor_NewShared(sd_event *event, int priority) {
+  InputMonitorShared *shared = Alloc(sizeof(InputMonitorShared));
+  CLEANUP_AUTOPTR(InputMonitor)
+  monitor = InputMonitor_NewWithBackend(event, priority, &kInputMonitorSharedBackend,
+                                        shared);
+
+  shared->libinput = libinput_path_create_context(&kInputLibInputInterface, NULL);
+  if (shared->libinput == NULL) {
+    LogError("Failed to create libinput context");
+    return NULL;
+  }
+
+  int rc = 0;
+  if ((rc = Loop_AddIo(event, &shared->libinput_source, libinput_get_fd(shared->libinput),
+                       EPOLLIN, OnLibInputEvents, monitor, "libinput-input")) < 0 ||
+      (rc = sd_event_source_set_priority(shared->libinput_source, priority)) < 0) {
+    LogErrno(-rc, "Failed to monitor libinput context");
+    return NULL;
+  }
+
+  shared->tracker = InputDeviceTracker_New(monitor, &kInputSharedDeviceHooks);
+  if (shared->tracker == NULL) {
+    return NULL;
+  }
+
+  return STEAL_POINTER(&monitor);
+}
@@ -0,0 +1,293 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// The default input backend, which creates a libinput context for every seat. Creating
+// one enumerates every input device, so each seat's is created on a thread of its own,
+// letting seats be set up in parallel without blocking the event loop. Once set up, the
+// contexts are read either from the event loop or by the input shards.
+
+#include "input-private.h"
+#include "input.h"
+#include "src/loop.h"
+#include "src/realtime.h"
+#include "src/utils.h"
+
+#include <errno.h>
+#include <libinput.h>
+#include <libudev.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+#include <uthash.h>
+
+typedef struct InputMonitorSeat InputMonitorSeat;
+typedef struct InputMonitorUdev InputMonitorUdev;
+
+static const double kUsecPerMsec = 1000.0;
+
+struct InputMonitorSeat {
+  char *seat_id;
+
+  // Owned by the setup thread while it's running, and NULL if setup failed or the
+  // context was handed to a shard.
+  struct libinput *libinput;
+  sd_event_source *source;
+  bool sharded;
+
+  pthread_t setup_thread;
+  bool setting_up;
+  // Signaled by the setup thread once it is done.
+  int setup_fd;
+  sd_event_source *setup_source;
+  uint64_t setup_start_usec;
+
+  InputMonitor *monitor;
+
+  UT_hash_handle hh;
+};
+
+struct InputMonitorUdev {
+  InputMonitorSeat *seats;
+  // NULL if the seats are read from the monitor's event loop.
+  InputShards *shards;
+};
+
+static void InputMonitorSeat_Free(InputMonitorSeat *seat) {
+  sd_event_source_disable_unref(STEAL_POINTER(&seat->setup_source));
+
+  // Enumeration can't be interrupted, but seats rarely go away while it runs.
+  if (seat->setting_up) {
+    pthread_join(seat->setup_thread, NULL);
+  }
+
+  if (seat->setup_fd != -1) {
+    close(seat->setup_fd);
+  }
+
+  free(STEAL_POINTER(&seat->seat_id));
+
+  if (seat->libinput != NULL) {
+    libinput_unref(STEAL_POINTER(&seat->libinput));
+  }
+
+  sd_event_source_disable_unref(STEAL_POINTER(&seat->source));
+
+  free(seat);
+}
+
+CLEANUP_AUTOPTR_DEFINE(InputMonitorSeat, InputMonitorSeat_Free);
+CLEANUP_AUTOPTR_DEFINE(libinput, libinput_unref)
+CLEANUP_AUTOPTR_DEFINE(libinput_event, libinput_event_destroy)
+
+static int OnInputEvents(sd_event_source *source, int fd, uint32_t revents,
+                         void *userdata) {
+  InputMonitorSeat *seat = userdata;
+  InputMonitor *monitor = seat->monitor;
+
+  if (revents & (EPOLLHUP | EPOLLERR)) {
+    LogError("Hangup / error while monitoring %s, disabling", seat->seat_id);
+    return -EINTR;
+  }
+
+  for (;;) {
+    int rc = 0;
+    if ((rc = libinput_dispatch(seat->libinput)) < 0) {
+      LogErrno(-rc, "Failed to dispatch events for %s", seat->seat_id);
+      return rc;
+    }
+
+    CLEANUP_AUTOPTR(libinput_event) event = libinput_get_event(seat->libinput);
+    if (event == NULL) {
+      break;
+    }
+
+    InputMonitor_DeliverLibInputEvent(monitor, seat->seat_id, event);
+  }
+
+  return 0;
+}
+
+// Runs on the setup thread, so it uses a udev context of its own, since they can't be
+// shared between threads.
+static struct libinput *CreateSeatContext(const char *seat_id) {
+  struct udev *udev = udev_new();
+  if (udev == NULL) {
+    LogError("Failed to create udev instance");
+    return NULL;
+  }
+
+  CLEANUP_AUTOPTR(libinput)
+  libinput = libinput_udev_create_context(&kInputLibInputInterface, NULL, udev);
+  udev_unref(udev);
+  if (libinput == NULL) {
+    LogError("Failed to create libinput context");
+    return NULL;
+  }
+
+  if (libinput_udev_assign_seat(libinput, seat_id) == -1) {
+    LogError("Failed to assign libinput seat %s", seat_id);
+    return NULL;
+  }
+
+  return STEAL_POINTER(&libinput);
+}
+
+static void *SetUpSeatOnThread(void *data) {
+  InputMonitorSeat *seat = data;
+
+  // Enumerating devices is slow and would hold up input on other seats.
+  Realtime_ResetScheduler();
+  seat->libinput = CreateSeatContext(seat->seat_id);
+
+  if (eventfd_write(seat->setup_fd, 1) == -1) {
+    LogErrno(errno, "Failed to signal finished setup of seat %s", seat->seat_id);
+  }
+
+  return NULL;
+}
+
+static int OnSeatSetUp(sd_event_source *source, int fd, uint32_t revents,
+                       void *userdata) {
+  InputMonitorSeat *seat = userdata;
+  InputMonitor *monitor = seat->monitor;
+  InputMonitorUdev *udev_monitor = monitor->backend_data;
+
+  eventfd_t value = 0;
+  if (eventfd_read(fd, &value) == -1) {
+    if (errno != EAGAIN) {
+      LogErrno(errno, "Failed to read setup completion of seat %s", seat->seat_id);
+    }
+    return 0;
+  }
+
+  pthread_join(seat->setup_thread, NULL);
+  seat->setting_up = false;
+  sd_event_source_disable_unref(STEAL_POINTER(&seat->setup_source));
+
+  if (seat->libinput == NULL) {
+    LogError("Failed to set up input on seat %s", seat->seat_id);
+    return 0;
+  }
+
+  int rc = 0;
+  if (udev_monitor->shards != NULL) {
+    InputShards_Attach(udev_monitor->shards, seat->seat_id,
+                       STEAL_POINTER(&seat->libinput));
+    seat->sharded = true;
+  } else if ((rc = Loop_AddIo(monitor->event, &seat->source,
+                              libinput_get_fd(seat->libinput), EPOLLIN, OnInputEvents,
+                              seat, "libinput-input")) < 0 ||
+             (rc = sd_event_source_set_priority(seat->source, monitor->priority)) < 0) {
+    LogErrno(-rc, "Failed to monitor libinput seat %s", seat->seat_id);
+    return 0;
+  }
+
+  LogInfo("Input on seat %s ready in %.1fms", seat->seat_id,
+          (GetMonotonicUsec() - seat->setup_start_usec) / kUsecPerMsec);
+  return 0;
+}
+
+static bool InputMonitorUdev_Add(InputMonitor *monitor, const char *seat_id) {
+  InputMonitorUdev *udev_monitor = monitor->backend_data;
+
+  InputMonitorSeat *match = NULL;
+  HASH_FIND_STR(udev_monitor->seats, seat_id, match);
+  if (match != NULL) {
+    LogInfo("Ignoring duplicate input seat: %s", seat_id);
+    return false;
+  }
+
+  CLEANUP_AUTOPTR(InputMonitorSeat) seat = Alloc(sizeof(InputMonitorSeat));
+
+  seat->seat_id = StrDup(seat_id);
+  seat->monitor = monitor;
+  seat->setup_start_usec = GetMonotonicUsec();
+
+  seat->setup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (seat->setup_fd == -1) {
+    LogErrno(errno, "Failed to create setup eventfd for seat %s", seat_id);
+    return false;
+  }
+
+  int rc = 0;
+  if ((rc = Loop_AddIo(monitor->event, &seat->setup_source, seat->setup_fd, EPOLLIN,
+                       OnSeatSetUp, seat, "seat-setup")) < 0) {
+    LogErrno(-rc, "Failed to monitor setup of seat %s", seat_id);
+    return false;
+  }
+
+  if ((rc = pthread_create(&seat->setup_thread, NULL, SetUpSeatOnThread, seat)) != 0) {
+    LogErrno(rc, "Failed to start setup thread for seat %s", seat_id);
+    return false;
+  }
+
+  seat->setting_up = true;
+
+  // Can't use STEAL_POINTER, because HASH_ADD_STR may evaluate the value
+  // argument multiple times.
+  HASH_ADD_STR(udev_monitor->seats, seat_id, seat);
+  seat = NULL;
+
+  return true;
+}
+
+static bool InputMonitorUdev_Remove(InputMonitor *monitor, const char *seat_id) {
+  InputMonitorUdev *udev_monitor = monitor->backend_data;
+
+  InputMonitorSeat *match = NULL;
+  HASH_FIND_STR(udev_monitor->seats, seat_id, match);
+  if (match == NULL) {
+    LogInfo("Ignoring removal of missing input seat: %s", seat_id);
+    return false;
+  }
+
+  if (match->sharded) {
+    InputShards_Detach(udev_monitor->shards, match->seat_id);
+  }
+
+  HASH_DEL(udev_monitor->seats, match);
+  InputMonitorSeat_Free(match);
+  return true;
+}
+
+static void InputMonitorUdev_Free(InputMonitor *monitor) {
+  InputMonitorUdev *udev_monitor = STEAL_POINTER(&monitor->backend_data);
+
+  InputMonitorSeat *seat = NULL, *tmp = NULL;
+  HASH_ITER(hh, udev_monitor->seats, seat, tmp) {
+    HASH_DEL(udev_monitor->seats, seat);
+    InputMonitorSeat_Free(seat);
+  }
+
+  // Frees the contexts of the seats that were handed to the shards.
+  if (udev_monitor->shards != NULL) {
+    InputShards_Free(STEAL_POINTER(&udev_monitor->shards));
+  }
+
+  free(udev_monitor);
+}
+
+static const InputMonitorBackend kInputMonitorUdevBackend = {
+    .add = InputMonitorUdev_Add,
+    .remove = InputMonitorUdev_Remove,
+    .free = InputMonitorUdev_Free,
+};
+
+InputMonitor *InputMonitor_New(sd_event *event, int priority, size_t shard_count) {
+  InputMonitorUdev *udev_monitor = Alloc(sizeof(InputMonitorUdev));
+  CLEANUP_AUTOPTR(InputMonitor)
+  monitor = InputMonitor_NewWithBackend(event, priority, &kInputMonitorUdevBackend,
+                                        udev_monitor);
+
+  if (shard_count > 0) {
+    udev_monitor->shards = InputShards_New(monitor, shard_count);
+    if (udev_monitor->shards == NULL) {
+      return NULL;
+    }
+  }
+
+  return STEAL_POINTER(&monitor);
+}
@@ -4,68 +4,39 @@
 
 #include "input.h"
 
+#include "input-private.h"
 #include "src/utils.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libinput.h>
-#include <libudev.h>
-#include <sys/epoll.h>
+#include <stdio.h>
 #include <systemd/sd-event.h>
 #include <unistd.h>
-#include <uthash.h>
 
-typedef struct InputMonitorSeat InputMonitorSeat;
+const char kInputRecordingHeader[] = "# pucro-events 1";
 
-struct InputMonitorSeat {
-  char *seat_id;
-
-  struct libinput *libinput;
-  sd_event_source *source;
-
-  InputMonitor *monitor;
-
-  UT_hash_handle hh;
-};
-
-struct InputMonitor {
-  sd_event *event;
-  struct udev *udev;
-
-  InputMonitorSeat *seats;
-
-  InputMonitor_OnInputEvent on_input_event;
-
-  void *userdata;
-  InputMonitor_UserDataDestroy userdata_destroy;
-};
-
-static void InputMonitorSeat_Free(InputMonitorSeat *seat) {
-  free(STEAL_POINTER(&seat->seat_id));
-
-  if (seat->libinput != NULL) {
-    libinput_unref(STEAL_POINTER(&seat->libinput));
-  }
-
-  sd_event_source_disable_unref(STEAL_POINTER(&seat->source));
-
-  free(seat);
+static int LibInputRestrictedOpen(const char *path, int flags, void *userdata) {
+  int fd = open(path, flags);
+  return fd != -1 ? fd : -errno;
 }
 
-CLEANUP_AUTOPTR_DEFINE(InputMonitorSeat, InputMonitorSeat_Free);
-CLEANUP_AUTOPTR_DEFINE(libinput, libinput_unref)
-CLEANUP_AUTOPTR_DEFINE(libinput_event, libinput_event_destroy)
+static void LibInputRestrictedClose(int fd, void *userdata) { close(fd); }
 
-InputMonitor *InputMonitor_New(sd_event *event) {
-  struct udev *udev = udev_new();
-  if (udev == NULL) {
-    LogError("Failed to create udev instance");
-    return NULL;
-  }
+const struct libinput_interface kInputLibInputInterface = {
+    .open_restricted = LibInputRestrictedOpen,
+    .close_restricted = LibInputRestrictedClose,
+};
 
+InputMonitor *InputMonitor_NewWithBackend(sd_event *event, int priority,
+                                          const InputMonitorBackend *backend,
+                                          void *backend_data) {
   InputMonitor *monitor = Alloc(sizeof(InputMonitor));
   monitor->event = sd_event_ref(event);
-  monitor->udev = udev;
+  monitor->priority = priority;
+  monitor->backend = backend;
+  monitor->backend_data = backend_data;
   return monitor;
 }
 
@@ -74,120 +45,99 @@ void InputMonitor_SetInputEventCallback(InputMonitor *monitor,
   monitor->on_input_event = on_input_event;
 }
 
+void InputMonitor_SetReplayFinishedCallback(
+    InputMonitor *monitor, InputMonitor_OnReplayFinished on_replay_finished) {
+  monitor->on_replay_finished = on_replay_finished;
+}
+
 void InputMonitor_SetUserData(InputMonitor *monitor, void *userdata,
                               InputMonitor_UserDataDestroy userdata_destroy) {
   monitor->userdata = userdata;
   monitor->userdata_destroy = userdata_destroy;
 }
 
-static int LibInputRestrictedOpen(const char *path, int flags, void *userdata) {
-  int fd = open(path, flags);
-  return fd != -1 ? fd : -errno;
-}
-
-static void LibInputRestrictedClose(int fd, void *userdata) { close(fd); }
-
-static int OnInputEvents(sd_event_source *source, int fd, uint32_t revents,
-                         void *userdata) {
-  InputMonitorSeat *seat = userdata;
-  InputMonitor *monitor = seat->monitor;
-
-  if (revents & (EPOLLHUP | EPOLLERR)) {
-    LogError("Hangup / error while monitoring %s, disabling", seat->seat_id);
-    return -EINTR;
+bool InputMonitor_StartRecording(InputMonitor *monitor, const char *path) {
+  FILE *recording = fopen(path, "we");
+  if (recording == NULL) {
+    LogErrno(errno, "Failed to open %s for recording", path);
+    return false;
   }
 
-  for (;;) {
-    int rc = 0;
-    if ((rc = libinput_dispatch(seat->libinput)) < 0) {
-      LogErrno(-rc, "Failed to dispatch events for %s", seat->seat_id);
-      return rc;
-    }
-
-    CLEANUP_AUTOPTR(libinput_event) event = libinput_get_event(seat->libinput);
-    if (event == NULL) {
-      break;
-    }
+  // Write every event out as it comes, since the last ones before a crash are usually
+  // the ones needed to reproduce it.
+  setvbuf(recording, NULL, _IOLBF, 0);
+  fprintf(recording, "%s\n", kInputRecordingHeader);
 
-    if (monitor->on_input_event) {
-      monitor->on_input_event(monitor, seat->seat_id, event, monitor->userdata);
-    }
+  if (monitor->recording != NULL) {
+    fclose(monitor->recording);
   }
 
-  return 0;
+  monitor->recording = recording;
+  return true;
 }
 
-bool InputMonitor_Add(InputMonitor *monitor, const char *seat_id) {
-  LogDebug("InputMonitor: add seat %s", seat_id);
-
-  static struct libinput_interface libinput_interface = {
-      .open_restricted = LibInputRestrictedOpen,
-      .close_restricted = LibInputRestrictedClose,
-  };
-
-  InputMonitorSeat *match = NULL;
-  HASH_FIND_STR(monitor->seats, seat_id, match);
-  if (match != NULL) {
-    LogInfo("Ignoring duplicate input seat: %s", seat_id);
-    return false;
+void InputMonitor_Deliver(InputMonitor *monitor, const InputMonitorEvent *event) {
+  if (monitor->recording != NULL) {
+    fprintf(monitor->recording, "%" PRIu64 " %s %s %" PRIu32 " %d\n", event->time_usec,
+            event->seat_id, event->device, event->button, event->pressed);
   }
 
-  CLEANUP_AUTOPTR(libinput)
-  libinput = libinput_udev_create_context(&libinput_interface, NULL, monitor->udev);
-  if (libinput == NULL) {
-    LogError("Failed to create libinput context");
-    return NULL;
+  if (monitor->on_input_event) {
+    monitor->on_input_event(monitor, event, monitor->userdata);
   }
+}
 
-  if (libinput_udev_assign_seat(libinput, seat_id) == -1) {
-    LogError("Failed to assign libinput seat %s", seat_id);
-    return NULL;
+bool InputMonitor_DecodeLibInputEvent(const char *seat_id, struct libinput_event *event,
+                                      InputMonitorEvent *decoded) {
+  if (libinput_event_get_type(event) != LIBINPUT_EVENT_POINTER_BUTTON) {
+    return false;
   }
 
-  CLEANUP_AUTOPTR(InputMonitorSeat) seat = Alloc(sizeof(InputMonitorSeat));
+  struct libinput_event_pointer *pointer_event = libinput_event_get_pointer_event(event);
 
-  seat->seat_id = StrDup(seat_id);
-  seat->libinput = STEAL_POINTER(&libinput);
-  seat->monitor = monitor;
+  *decoded = (InputMonitorEvent){
+      .seat_id = seat_id,
+      .device = libinput_device_get_sysname(libinput_event_get_device(event)),
+      .button = libinput_event_pointer_get_button(pointer_event),
+      .pressed = libinput_event_pointer_get_button_state(pointer_event) ==
+                 LIBINPUT_BUTTON_STATE_PRESSED,
+      .time_usec = libinput_event_pointer_get_time_usec(pointer_event),
+  };
+  return true;
+}
 
-  int rc = 0;
-  CLEANUP(sd_event_source_unrefp) sd_event_source *source = NULL;
-  if ((rc = sd_event_add_io(monitor->event, &source, libinput_get_fd(seat->libinput),
-                            EPOLLIN, OnInputEvents, seat)) < 0) {
-    LogErrno(-rc, "Failed to monitor libinput seat %s", seat_id);
-    return NULL;
+void InputMonitor_DeliverLibInputEvent(InputMonitor *monitor, const char *seat_id,
+                                       struct libinput_event *event) {
+  InputMonitorEvent monitor_event;
+  if (InputMonitor_DecodeLibInputEvent(seat_id, event, &monitor_event)) {
+    InputMonitor_Deliver(monitor, &monitor_event);
   }
+}
 
-  seat->source = STEAL_POINTER(&source);
-
-  // Can't use STEAL_POINTER, because HASH_ADD_STR may evaluate the value
-  // argument multiple times.
-  HASH_ADD_STR(monitor->seats, seat_id, seat);
-  seat = NULL;
+bool InputMonitor_Add(InputMonitor *monitor, const char *seat_id) {
+  LogDebug("InputMonitor: add seat %s", seat_id);
+  return monitor->backend->add(monitor, seat_id);
+}
 
-  return true;
+void InputMonitor_SetButtons(InputMonitor *monitor, const unsigned int *codes,
+                             size_t count) {
+  if (monitor->backend->set_buttons != NULL) {
+    monitor->backend->set_buttons(monitor, codes, count);
+  }
 }
 
 bool InputMonitor_Remove(InputMonitor *monitor, const char *seat_id) {
   LogDebug("InputMonitor: remove seat %s", seat_id);
-
-  InputMonitorSeat *match = NULL;
-  HASH_FIND_STR(monitor->seats, seat_id, match);
-  if (match == NULL) {
-    LogInfo("Ignoring removal of missing input seat: %s", seat_id);
-    return false;
-  }
-
-  HASH_DEL(monitor->seats, match);
-  InputMonitorSeat_Free(match);
-  return true;
+  return monitor->backend->remove(monitor, seat_id);
 }
 
 void InputMonitor_Free(InputMonitor *monitor) {
-  InputMonitorSeat *seat = NULL, *tmp = NULL;
-  HASH_ITER(hh, monitor->seats, seat, tmp) {
-    HASH_DEL(monitor->seats, seat);
-    InputMonitorSeat_Free(seat);
+  monitor->backend->free(monitor);
+
+  if (monitor->recording != NULL) {
+    if (fclose(monitor->recording) != 0) {
+      LogErrno(errno, "Failed to finish recording");
+    }
   }
 
   if (monitor->userdata_destroy) {
@@ -195,6 +145,5 @@ void InputMonitor_Free(InputMonitor *monitor) {
   }
 
   sd_event_unref(monitor->event);
-  udev_unref(monitor->udev);
   free(monitor);
 }
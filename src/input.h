@@ -6,24 +6,69 @@
 
 #include "utils.h"
 
-#include <libinput.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <systemd/sd-event.h>
 
+typedef struct InputMonitorEvent InputMonitorEvent;
 typedef struct InputMonitor InputMonitor;
 
-typedef void (*InputMonitor_OnInputEvent)(InputMonitor *monitor, const char *seat_id,
-                                          struct libinput_event *event, void *userdata);
+struct InputMonitorEvent {
+  const char *seat_id;
+  // The kernel name of the device, e.g. event4.
+  const char *device;
+
+  // The evdev code of the button.
+  uint32_t button;
+  bool pressed;
+
+  // The CLOCK_MONOTONIC time at which the kernel received the event.
+  uint64_t time_usec;
+};
+
+typedef enum {
+  // Replay events with the same spacing they were recorded with.
+  kInputReplaySpeedRealtime,
+  // Replay events as fast as the pipeline can take them.
+  kInputReplaySpeedMax,
+} InputReplaySpeed;
+
+typedef void (*InputMonitor_OnInputEvent)(InputMonitor *monitor,
+                                          const InputMonitorEvent *event, void *userdata);
+typedef void (*InputMonitor_OnReplayFinished)(InputMonitor *monitor, void *userdata);
 typedef void (*InputMonitor_UserDataDestroy)(void *userdata);
 
-InputMonitor *InputMonitor_New(sd_event *event);
+// Monitors the button presses of each added seat via libinput. If shard_count is not 0,
+// the seats are spread over that many threads, each reading its share of them from an
+// event loop of its own, while their events are still delivered from event. The sources
+// reading input are given the sd-event priority, so they can be run ahead of others.
+InputMonitor *InputMonitor_New(sd_event *event, int priority, size_t shard_count);
+// Like InputMonitor_New, but serves all seats from a single libinput context.
+InputMonitor *InputMonitor_NewShared(sd_event *event, int priority);
+// Reads evdev devices directly, only opening those that can send one of the buttons
+// given to InputMonitor_SetButtons and having the kernel filter out all other events.
+InputMonitor *InputMonitor_NewEvdev(sd_event *event, int priority);
+// Replays the button presses recorded in path, once the first seat is added. Replayed
+// events aren't prioritized, since replaying at full speed would starve everything else.
+InputMonitor *InputMonitor_NewReplay(sd_event *event, const char *path,
+                                     InputReplaySpeed speed);
 
 void InputMonitor_Free(InputMonitor *monitor);
 
 void InputMonitor_SetInputEventCallback(InputMonitor *monitor,
                                         InputMonitor_OnInputEvent on_input_event);
+void InputMonitor_SetReplayFinishedCallback(
+    InputMonitor *monitor, InputMonitor_OnReplayFinished on_replay_finished);
 void InputMonitor_SetUserData(InputMonitor *monitor, void *userdata,
                               InputMonitor_UserDataDestroy userdata_destroy);
 
+// Writes every event from now on to path, in the format read by InputMonitor_NewReplay.
+bool InputMonitor_StartRecording(InputMonitor *monitor, const char *path);
+
+// Sets the button codes that rules use. Backends may ignore all other buttons.
+void InputMonitor_SetButtons(InputMonitor *monitor, const unsigned int *codes,
+                             size_t count);
+
 bool InputMonitor_Add(InputMonitor *monitor, const char *seat_id);
 bool InputMonitor_Remove(InputMonitor *monitor, const char *seat_id);
 
@@ -0,0 +1,441 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "loop.h"
+
+#include "stats.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+typedef struct LoopHandler LoopHandler;
+typedef struct LoopWatch LoopWatch;
+typedef struct LoopStats LoopStats;
+
+const char kLoopBusSource[] = "bus";
+
+// How often the watcher checks on the loop at most, no matter how small the budget.
+static const uint64_t kMinWatchIntervalUsec = 1000;
+// How often the watcher checks while stall detection is off.
+static const uint64_t kIdleWatchIntervalUsec = 100000;
+static const long kNsecPerUsec = 1000;
+
+enum { kLoopMaxFrames = 32 };
+
+// The callback and name of a source added through one of the wrappers, which is freed
+// along with its source.
+struct LoopHandler {
+  const char *name;
+  union {
+    sd_event_io_handler_t io;
+    sd_event_time_handler_t time;
+    sd_event_handler_t defer;
+    sd_event_signal_handler_t signal;
+    sd_event_child_handler_t child;
+    sd_event_inotify_handler_t inotify;
+  } callback;
+  void *userdata;
+};
+
+// What a thread running a loop is doing, shared with its watcher thread and the SIGPROF
+// handler sampling backtraces.
+struct LoopWatch {
+  pthread_t thread;
+  // When the current dispatch started, or 0 between dispatches.
+  _Atomic uint64_t dispatch_usec;
+  // Bumped for every dispatch, so that a stall is only sampled once.
+  _Atomic uint64_t dispatch_count;
+  _Atomic bool stop;
+
+  void *frames[kLoopMaxFrames];
+  // Set by the SIGPROF handler once frames is filled in.
+  _Atomic int frame_count;
+};
+
+struct LoopStats {
+  _Atomic uint64_t budget_usec;
+  bool backtraces;
+
+  pthread_mutex_t lock;
+  LoopOffender offenders[kLoopMaxOffenders];
+  size_t offender_count;
+};
+
+// The name of the source being dispatched on this thread.
+static _Thread_local const char *current_source;
+// The loop running on this thread, for the SIGPROF handler.
+static _Thread_local LoopWatch *current_watch;
+
+static LoopStats *GetStats() {
+  static LoopStats stats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+  return &stats;
+}
+
+void Loop_SetStallBudget(uint64_t budget_usec) {
+  atomic_store_explicit(&GetStats()->budget_usec, budget_usec, memory_order_relaxed);
+}
+
+static void SampleBacktrace(int sig) {
+  int saved_errno = errno;
+
+  LoopWatch *watch = current_watch;
+  if (watch != NULL && atomic_load(&watch->frame_count) == 0) {
+    atomic_store(&watch->frame_count, backtrace(watch->frames, kLoopMaxFrames));
+  }
+
+  errno = saved_errno;
+}
+
+bool Loop_EnableBacktraces() {
+  // backtrace() loads libgcc on its first call, which mustn't happen in a signal handler.
+  void *frame = NULL;
+  backtrace(&frame, 1);
+
+  struct sigaction sa = {.sa_handler = SampleBacktrace, .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) == -1) {
+    LogErrno(errno, "Failed to install SIGPROF handler");
+    return false;
+  }
+
+  GetStats()->backtraces = true;
+  return true;
+}
+
+static void *Watch(void *userdata) {
+  LoopWatch *watch = userdata;
+  uint64_t sampled_count = 0;
+
+  while (!atomic_load(&watch->stop)) {
+    uint64_t budget_usec =
+        atomic_load_explicit(&GetStats()->budget_usec, memory_order_relaxed);
+    uint64_t interval_usec = budget_usec == 0 ? kIdleWatchIntervalUsec : budget_usec / 2;
+    if (interval_usec < kMinWatchIntervalUsec) {
+      interval_usec = kMinWatchIntervalUsec;
+    }
+
+    struct timespec interval = {
+        .tv_sec = interval_usec / 1000000,
+        .tv_nsec = (interval_usec % 1000000) * kNsecPerUsec,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &interval, NULL);
+
+    uint64_t count = atomic_load(&watch->dispatch_count);
+    uint64_t start_usec = atomic_load(&watch->dispatch_usec);
+    if (budget_usec > 0 && start_usec != 0 && count != sampled_count &&
+        GetMonotonicUsec() - start_usec > budget_usec) {
+      sampled_count = count;
+      pthread_kill(watch->thread, SIGPROF);
+    }
+  }
+
+  return NULL;
+}
+
+static int CompareOffenders(const void *a, const void *b) {
+  const LoopOffender *offender_a = a, *offender_b = b;
+  return (offender_a->worst_usec < offender_b->worst_usec) -
+         (offender_a->worst_usec > offender_b->worst_usec);
+}
+
+static void LogBacktrace(LoopWatch *watch) {
+  int frame_count = atomic_load(&watch->frame_count);
+  if (frame_count <= 0) {
+    return;
+  }
+
+  CLEANUP_AUTOFREE char **symbols = backtrace_symbols(watch->frames, frame_count);
+  if (symbols == NULL) {
+    return;
+  }
+
+  // Skips the signal handler and its trampoline.
+  for (int i = 2; i < frame_count; i++) {
+    LogInfo("  #%d %s", i - 2, symbols[i]);
+  }
+}
+
+static void RecordStall(const char *name, uint64_t usec, LoopWatch *watch) {
+  LoopStats *stats = GetStats();
+  Stats_Increment(kStatsCounterLoopStalls);
+
+  pthread_mutex_lock(&stats->lock);
+
+  LoopOffender *offender = NULL;
+  for (size_t i = 0; i < stats->offender_count; i++) {
+    if (strcmp(stats->offenders[i].name, name) == 0) {
+      offender = &stats->offenders[i];
+      break;
+    }
+  }
+
+  if (offender == NULL && stats->offender_count < kLoopMaxOffenders) {
+    offender = &stats->offenders[stats->offender_count++];
+    offender->name = name;
+  }
+
+  if (offender != NULL) {
+    offender->stalls++;
+    offender->total_usec += usec;
+    if (usec > offender->worst_usec) {
+      offender->worst_usec = usec;
+    }
+  }
+
+  pthread_mutex_unlock(&stats->lock);
+
+  LogInfo("Handler %s stalled the event loop for %.1fms", name, usec / 1000.0);
+  LogBacktrace(watch);
+}
+
+static int RunOnce(sd_event *event, LoopWatch *watch) {
+  int rc = sd_event_prepare(event);
+  if (rc == 0) {
+    rc = sd_event_wait(event, UINT64_MAX);
+  }
+
+  if (rc <= 0) {
+    return rc;
+  }
+
+  // Only the wrappers name their sources.
+  current_source = kLoopBusSource;
+  atomic_store(&watch->frame_count, 0);
+  atomic_fetch_add(&watch->dispatch_count, 1);
+
+  uint64_t start_usec = GetMonotonicUsec();
+  atomic_store(&watch->dispatch_usec, start_usec);
+  rc = sd_event_dispatch(event);
+  uint64_t end_usec = GetMonotonicUsec();
+  atomic_store(&watch->dispatch_usec, 0);
+
+  uint64_t budget_usec =
+      atomic_load_explicit(&GetStats()->budget_usec, memory_order_relaxed);
+  if (budget_usec > 0 && end_usec - start_usec > budget_usec) {
+    RecordStall(current_source, end_usec - start_usec, watch);
+  }
+
+  return rc;
+}
+
+int Loop_Run(sd_event *event) {
+  LoopWatch watch = {.thread = pthread_self()};
+  pthread_t watcher;
+  bool watching = false;
+
+  if (GetStats()->backtraces) {
+    current_watch = &watch;
+
+    int rc = pthread_create(&watcher, NULL, Watch, &watch);
+    if (rc != 0) {
+      LogErrno(rc, "Failed to start stall watcher, continuing without backtraces");
+    } else {
+      watching = true;
+    }
+  }
+
+  int rc = 0;
+  while (sd_event_get_state(event) != SD_EVENT_FINISHED) {
+    if ((rc = RunOnce(event, &watch)) < 0) {
+      break;
+    }
+  }
+
+  if (watching) {
+    atomic_store(&watch.stop, true);
+    pthread_join(watcher, NULL);
+  }
+
+  current_watch = NULL;
+  if (rc < 0) {
+    return rc;
+  }
+
+  int code = 0;
+  return sd_event_get_exit_code(event, &code) < 0 ? 0 : code;
+}
+
+size_t Loop_GetOffenders(LoopOffender *offenders, size_t count) {
+  LoopStats *stats = GetStats();
+
+  pthread_mutex_lock(&stats->lock);
+  LoopOffender sorted[kLoopMaxOffenders];
+  size_t total = stats->offender_count;
+  memcpy(sorted, stats->offenders, sizeof(LoopOffender) * total);
+  pthread_mutex_unlock(&stats->lock);
+
+  qsort(sorted, total, sizeof(LoopOffender), CompareOffenders);
+  if (count > total) {
+    count = total;
+  }
+
+  memcpy(offenders, sorted, sizeof(LoopOffender) * count);
+  return count;
+}
+
+void Loop_LogOffenders() {
+  LoopOffender offenders[kLoopMaxOffenders];
+  size_t count = Loop_GetOffenders(offenders, kLoopMaxOffenders);
+  if (count == 0) {
+    return;
+  }
+
+  LogInfo("Event loop stalls by handler:");
+  for (size_t i = 0; i < count; i++) {
+    LogInfo("  %s: %" PRIu64 " stalls, worst %" PRIu64 "us, total %" PRIu64 "us",
+            offenders[i].name, offenders[i].stalls, offenders[i].worst_usec,
+            offenders[i].total_usec);
+  }
+}
+
+static LoopHandler *NewHandler(void *userdata, const char *name) {
+  LoopHandler *handler = Alloc(sizeof(LoopHandler));
+  handler->name = name;
+  handler->userdata = userdata;
+  return handler;
+}
+
+// Ties handler to source, and hands source to the caller or makes it floating if the
+// caller doesn't want it, like sd-event does.
+static int Attach(int rc, sd_event_source *source, sd_event_source **ret,
+                  LoopHandler *handler) {
+  if (rc < 0) {
+    free(handler);
+    return rc;
+  }
+
+  if ((rc = sd_event_source_set_destroy_callback(source, free)) < 0) {
+    free(handler);
+    sd_event_source_disable_unref(source);
+    return rc;
+  }
+
+  if (ret != NULL) {
+    *ret = source;
+  } else {
+    sd_event_source_set_floating(source, true);
+    sd_event_source_unref(source);
+  }
+
+  return rc;
+}
+
+static int OnIo(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+  LoopHandler *handler = userdata;
+  current_source = handler->name;
+  return handler->callback.io(source, fd, revents, handler->userdata);
+}
+
+static int OnTime(sd_event_source *source, uint64_t usec, void *userdata) {
+  LoopHandler *handler = userdata;
+  current_source = handler->name;
+  return handler->callback.time(source, usec, handler->userdata);
+}
+
+static int OnDefer(sd_event_source *source, void *userdata) {
+  LoopHandler *handler = userdata;
+  current_source = handler->name;
+  return handler->callback.defer(source, handler->userdata);
+}
+
+static int OnSignal(sd_event_source *source, const struct signalfd_siginfo *info,
+                    void *userdata) {
+  LoopHandler *handler = userdata;
+  current_source = handler->name;
+  return handler->callback.signal(source, info, handler->userdata);
+}
+
+static int OnChild(sd_event_source *source, const siginfo_t *info, void *userdata) {
+  LoopHandler *handler = userdata;
+  current_source = handler->name;
+  return handler->callback.child(source, info, handler->userdata);
+}
+
+static int OnInotify(sd_event_source *source, const struct inotify_event *event,
+                     void *userdata) {
+  LoopHandler *handler = userdata;
+  current_source = handler->name;
+  return handler->callback.inotify(source, event, handler->userdata);
+}
+
+int Loop_AddIo(sd_event *event, sd_event_source **ret, int fd, uint32_t events,
+               sd_event_io_handler_t callback, void *userdata, const char *name) {
+  LoopHandler *handler = NewHandler(userdata, name);
+  handler->callback.io = callback;
+
+  sd_event_source *source = NULL;
+  int rc = sd_event_add_io(event, &source, fd, events, OnIo, handler);
+  return Attach(rc, source, ret, handler);
+}
+
+int Loop_AddTime(sd_event *event, sd_event_source **ret, clockid_t clock, uint64_t usec,
+                 uint64_t accuracy, sd_event_time_handler_t callback, void *userdata,
+                 const char *name) {
+  LoopHandler *handler = NewHandler(userdata, name);
+  handler->callback.time = callback;
+
+  sd_event_source *source = NULL;
+  int rc = sd_event_add_time(event, &source, clock, usec, accuracy, OnTime, handler);
+  return Attach(rc, source, ret, handler);
+}
+
+int Loop_AddTimeRelative(sd_event *event, sd_event_source **ret, clockid_t clock,
+                         uint64_t usec, uint64_t accuracy,
+                         sd_event_time_handler_t callback, void *userdata,
+                         const char *name) {
+  LoopHandler *handler = NewHandler(userdata, name);
+  handler->callback.time = callback;
+
+  sd_event_source *source = NULL;
+  int rc = sd_event_add_time_relative(event, &source, clock, usec, accuracy, OnTime,
+                                      handler);
+  return Attach(rc, source, ret, handler);
+}
+
+int Loop_AddDefer(sd_event *event, sd_event_source **ret, sd_event_handler_t callback,
+                  void *userdata, const char *name) {
+  LoopHandler *handler = NewHandler(userdata, name);
+  handler->callback.defer = callback;
+
+  sd_event_source *source = NULL;
+  int rc = sd_event_add_defer(event, &source, OnDefer, handler);
+  return Attach(rc, source, ret, handler);
+}
+
+int Loop_AddSignal(sd_event *event, sd_event_source **ret, int sig,
+                   sd_event_signal_handler_t callback, void *userdata, const char *name) {
+  LoopHandler *handler = NewHandler(userdata, name);
+  handler->callback.signal = callback;
+
+  sd_event_source *source = NULL;
+  int rc = sd_event_add_signal(event, &source, sig, OnSignal, handler);
+  return Attach(rc, source, ret, handler);
+}
+
+int Loop_AddChild(sd_event *event, sd_event_source **ret, pid_t pid, int options,
+                  sd_event_child_handler_t callback, void *userdata, const char *name) {
+  LoopHandler *handler = NewHandler(userdata, name);
+  handler->callback.child = callback;
+
+  sd_event_source *source = NULL;
+  int rc = sd_event_add_child(event, &source, pid, options, OnChild, handler);
+  return Attach(rc, source, ret, handler);
+}
+
+int Loop_AddInotify(sd_event *event, sd_event_source **ret, const char *path,
+                    uint32_t mask, sd_event_inotify_handler_t callback, void *userdata,
+                    const char *name) {
+  LoopHandler *handler = NewHandler(userdata, name);
+  handler->callback.inotify = callback;
+
+  sd_event_source *source = NULL;
+  int rc = sd_event_add_inotify(event, &source, path, mask, OnInotify, handler);
+  return Attach(rc, source, ret, handler);
+}
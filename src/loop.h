@@ -0,0 +1,66 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// Runs sd-event loops while timing every callback, so that handlers blocking input
+// processing can be found. sd-event can't tell which source it just dispatched, so
+// sources added through the Loop_Add* wrappers below are attributed to the name they
+// were added with, and everything else, i.e. sd-bus connections, to kLoopBusSource.
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <systemd/sd-event.h>
+
+typedef struct LoopOffender LoopOffender;
+
+extern const char kLoopBusSource[];
+
+enum { kLoopMaxOffenders = 64 };
+
+// A handler that took longer than the stall budget at least once.
+struct LoopOffender {
+  const char *name;
+  uint64_t stalls;
+  uint64_t worst_usec;
+  uint64_t total_usec;
+};
+
+// Sets how long a single callback may run before it counts as a stall, or 0 to stop
+// checking, which is the default. Applies to every loop.
+void Loop_SetStallBudget(uint64_t budget_usec);
+
+// Has stalls log a backtrace of the stalled handler, sampled from a watcher thread
+// through SIGPROF while it is still running. Must be called before any loop runs.
+bool Loop_EnableBacktraces();
+
+// Like sd_event_loop, but times every dispatch.
+int Loop_Run(sd_event *event);
+
+// Copies up to count offenders into offenders, worst first, and returns how many.
+size_t Loop_GetOffenders(LoopOffender *offenders, size_t count);
+void Loop_LogOffenders();
+
+// Like their sd_event_add_* counterparts, but attribute the time spent in callback to
+// name, which must outlive the source.
+int Loop_AddIo(sd_event *event, sd_event_source **ret, int fd, uint32_t events,
+               sd_event_io_handler_t callback, void *userdata, const char *name);
+int Loop_AddTime(sd_event *event, sd_event_source **ret, clockid_t clock, uint64_t usec,
+                 uint64_t accuracy, sd_event_time_handler_t callback, void *userdata,
+                 const char *name);
+int Loop_AddTimeRelative(sd_event *event, sd_event_source **ret, clockid_t clock,
+                         uint64_t usec, uint64_t accuracy,
+                         sd_event_time_handler_t callback, void *userdata,
+                         const char *name);
+int Loop_AddDefer(sd_event *event, sd_event_source **ret, sd_event_handler_t callback,
+                  void *userdata, const char *name);
+int Loop_AddSignal(sd_event *event, sd_event_source **ret, int sig,
+                   sd_event_signal_handler_t callback, void *userdata, const char *name);
+int Loop_AddChild(sd_event *event, sd_event_source **ret, pid_t pid, int options,
+                  sd_event_child_handler_t callback, void *userdata, const char *name);
+int Loop_AddInotify(sd_event *event, sd_event_source **ret, const char *path,
+                    uint32_t mask, sd_event_inotify_handler_t callback, void *userdata,
+                    const char *name);
@@ -0,0 +1,337 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// A user service that pucrod hands actions to, which spawns them right away instead of
+// having the user's systemd instance load, schedule and start a transient unit for each.
+// pucrod falls back to transient units whenever the agent isn't running.
+
+#include "agent.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <systemd/sd-daemon.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+typedef struct Agent Agent;
+typedef struct AgentClient AgentClient;
+
+struct Agent {
+  sd_event *event;
+  char *socket_path;
+  int listen_fd;
+  sd_event_source *listen_source;
+
+  // Looked up once at startup, which is what keeps shell actions from needing NSS.
+  char *login_shell;
+
+  // Only a single request is handled at a time, so they can share the buffer.
+  char buffer[kAgentMaxMessageSize];
+};
+
+struct AgentClient {
+  Agent *agent;
+  int fd;
+  sd_event_source *source;
+};
+
+static void AgentClient_Free(AgentClient *client) {
+  sd_event_source_disable_unref(STEAL_POINTER(&client->source));
+  if (client->fd != -1) {
+    close(client->fd);
+  }
+
+  free(client);
+}
+
+CLEANUP_AUTOPTR_DEFINE(AgentClient, AgentClient_Free)
+
+static void Agent_Free(Agent *agent) {
+  sd_event_source_disable_unref(STEAL_POINTER(&agent->listen_source));
+  if (agent->listen_fd != -1) {
+    close(agent->listen_fd);
+    unlink(agent->socket_path);
+  }
+
+  free(agent->socket_path);
+  free(agent->login_shell);
+  sd_event_unref(agent->event);
+  free(agent);
+}
+
+CLEANUP_AUTOPTR_DEFINE(Agent, Agent_Free)
+
+static char *GetLoginShell() {
+  struct passwd pwd, *result = NULL;
+  char buffer[16384];
+
+  int rc = getpwuid_r(getuid(), &pwd, buffer, sizeof(buffer), &result);
+  if (result == NULL) {
+    LogErrno(rc != 0 ? rc : ENOENT, "Failed to look up the login shell");
+    return NULL;
+  }
+
+  return StrDup(pwd.pw_shell);
+}
+
+static int Spawn(Agent *agent, const AgentRequest *request, pid_t *pid) {
+  char *login_shell_argv[] = {agent->login_shell, "-c", NULL, NULL};
+  char **argv = request->argv;
+
+  if (request->flags & kAgentRequestLoginShell) {
+    if (request->argc != 1) {
+      return EINVAL;
+    }
+
+    login_shell_argv[2] = request->argv[0];
+    argv = login_shell_argv;
+  } else if (argv[0][0] != '/') {
+    return EINVAL;
+  }
+
+  posix_spawnattr_t attr;
+  int rc = 0;
+  if ((rc = posix_spawnattr_init(&attr)) != 0) {
+    return rc;
+  }
+
+  // The agent blocks the signals it handles via sd-event, and actions shouldn't be tied
+  // to its session either.
+  sigset_t empty_mask, all_signals;
+  sigemptyset(&empty_mask);
+  sigfillset(&all_signals);
+
+  if ((rc = posix_spawnattr_setsigmask(&attr, &empty_mask)) == 0 &&
+      (rc = posix_spawnattr_setsigdefault(&attr, &all_signals)) == 0 &&
+      (rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                                POSIX_SPAWN_SETSIGDEF |
+                                                POSIX_SPAWN_SETSID)) == 0) {
+    rc = posix_spawn(pid, argv[0], NULL, &attr, argv, environ);
+  }
+
+  posix_spawnattr_destroy(&attr);
+  return rc;
+}
+
+static bool HandleRequest(AgentClient *client, size_t size) {
+  Agent *agent = client->agent;
+
+  AgentRequest request = {0};
+  if (!AgentRequest_Decode(&request, agent->buffer, size)) {
+    LogError("Received a malformed request");
+    return false;
+  }
+
+  CLEANUP_AUTOFREE char **argv = request.argv;
+
+  AgentReply reply = {.id = request.id};
+  pid_t pid = 0;
+  reply.error = Spawn(agent, &request, &pid);
+  if (reply.error != 0) {
+    LogErrno(reply.error, "Failed to spawn %s", request.argv[0]);
+  } else {
+    LogDebug("Spawned %s as %d", request.argv[0], pid);
+    reply.pid = pid;
+  }
+
+  // The reply is tiny, so a full buffer means pucrod is stuck and can do without it.
+  if (send(client->fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+    int error = errno;
+    if (error != EAGAIN) {
+      LogErrno(error, "Failed to send reply");
+    }
+
+    return error == EAGAIN;
+  }
+
+  return true;
+}
+
+static int OnClientRequests(sd_event_source *source, int fd, uint32_t revents,
+                            void *userdata) {
+  AgentClient *client = userdata;
+
+  for (;;) {
+    ssize_t size =
+        recv(fd, client->agent->buffer, sizeof(client->agent->buffer), MSG_DONTWAIT);
+    if (size == -1 && errno == EAGAIN) {
+      return 0;
+    } else if (size == -1 && errno == EINTR) {
+      continue;
+    } else if (size == -1) {
+      LogErrno(errno, "Failed to receive request");
+      break;
+    } else if (size == 0) {
+      LogDebug("pucrod disconnected");
+      break;
+    }
+
+    if (!HandleRequest(client, size)) {
+      break;
+    }
+  }
+
+  AgentClient_Free(client);
+  return 0;
+}
+
+// Only pucrod, running as root, and the user themselves may run actions.
+static bool IsPeerAllowed(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+    LogErrno(errno, "Failed to get peer credentials");
+    return false;
+  }
+
+  if (cred.uid != 0 && cred.uid != getuid()) {
+    LogError("Rejecting connection from uid %u", (unsigned int)cred.uid);
+    return false;
+  }
+
+  return true;
+}
+
+static int OnConnection(sd_event_source *source, int fd, uint32_t revents,
+                        void *userdata) {
+  Agent *agent = userdata;
+
+  int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client_fd == -1) {
+    if (errno != EAGAIN && errno != EINTR) {
+      LogErrno(errno, "Failed to accept connection");
+    }
+
+    return 0;
+  }
+
+  CLEANUP_AUTOPTR(AgentClient) client = Alloc(sizeof(AgentClient));
+  client->agent = agent;
+  client->fd = client_fd;
+
+  if (!IsPeerAllowed(client_fd)) {
+    return 0;
+  }
+
+  int rc = 0;
+  if ((rc = sd_event_add_io(agent->event, &client->source, client_fd, EPOLLIN,
+                            OnClientRequests, client)) < 0) {
+    LogErrno(-rc, "Failed to monitor connection");
+    return 0;
+  }
+
+  LogDebug("pucrod connected");
+  // Owned by its event source from here on, and freed once the connection is closed.
+  STEAL_POINTER(&client);
+  return 0;
+}
+
+static bool Listen(Agent *agent) {
+  // Where pucrod looks for it.
+  agent->socket_path = Agent_GetSocketPath(getuid());
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(agent->socket_path) >= sizeof(addr.sun_path)) {
+    LogError("Socket path %s is too long", agent->socket_path);
+    return false;
+  }
+
+  strcpy(addr.sun_path, agent->socket_path);
+
+  // A previous instance that didn't exit cleanly may have left the socket behind.
+  if (unlink(agent->socket_path) == -1 && errno != ENOENT) {
+    LogErrno(errno, "Failed to remove stale socket %s", agent->socket_path);
+    return false;
+  }
+
+  agent->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (agent->listen_fd == -1) {
+    LogErrno(errno, "Failed to create socket");
+    return false;
+  }
+
+  if (bind(agent->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(agent->listen_fd, SOMAXCONN) == -1) {
+    LogErrno(errno, "Failed to listen on %s", agent->socket_path);
+    return false;
+  }
+
+  int rc = 0;
+  if ((rc = sd_event_add_io(agent->event, &agent->listen_source, agent->listen_fd,
+                            EPOLLIN, OnConnection, agent)) < 0) {
+    LogErrno(-rc, "Failed to monitor socket");
+    return false;
+  }
+
+  return true;
+}
+
+static bool Run() {
+  CLEANUP_AUTOPTR(Agent) agent = Alloc(sizeof(Agent));
+  agent->listen_fd = -1;
+
+  agent->login_shell = GetLoginShell();
+  if (agent->login_shell == NULL) {
+    return false;
+  }
+
+  int rc = 0;
+  if ((rc = sd_event_default(&agent->event)) < 0) {
+    LogErrno(-rc, "Failed to create sd-event");
+    return false;
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+    LogErrno(errno, "Failed to block signals");
+    return false;
+  }
+
+  if ((rc = sd_event_add_signal(agent->event, NULL, SIGINT, NULL, NULL)) < 0 ||
+      (rc = sd_event_add_signal(agent->event, NULL, SIGTERM, NULL, NULL)) < 0) {
+    LogErrno(-rc, "Failed to add termination signal handlers");
+    return false;
+  }
+
+  // Nobody waits for the actions, so have the kernel reap them.
+  struct sigaction sa = {.sa_handler = SIG_IGN, .sa_flags = SA_NOCLDWAIT};
+  if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+    LogErrno(errno, "Failed to ignore SIGCHLD");
+    return false;
+  }
+
+  if (!Listen(agent)) {
+    return false;
+  }
+
+  sd_notify(0, "READY=1");
+  LogInfo("Listening on %s", agent->socket_path);
+
+  if ((rc = sd_event_loop(agent->event)) < 0) {
+    LogErrno(-rc, "Failed to run event loop");
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  SetupLogLevels();
+
+  if (argc != 1) {
+    LogError("Usage: %s", argv[0]);
+    return 2;
+  }
+
+  return Run() ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// A small helper that pucrod spawns to start a transient unit on a user's bus, so the
+// bus work happens in a fresh process instead of a fork of the daemon.
+
+#include "transient.h"
+#include "utils.h"
+
+#include <getopt.h>
+#include <string.h>
+
+static const uint64_t kDefaultTimeoutUsec = 5 * 1000000ull;
+
+static void PrintUsage(const char *argv0) {
+  LogError("Usage: %s [--timeout=USEC] UNIT-NAME USER COMMAND [SHELL]\n"
+           "       %s [--timeout=USEC] UNIT-NAME USER -- PROGRAM [ARGUMENT...]",
+           argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+  SetupLogLevels();
+
+  static const struct option long_options[] = {
+      {"timeout", required_argument, NULL, 't'},
+      {NULL, 0, NULL, 0},
+  };
+
+  const char *argv0 = argv[0];
+  uint64_t timeout_usec = kDefaultTimeoutUsec;
+  int opt = 0;
+  // Stop at the first positional argument, so the command's own options are left alone.
+  while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+    char *end = NULL;
+    if (opt != 't' || (timeout_usec = strtoull(optarg, &end, 10)) == 0 || *end != '\0') {
+      PrintUsage(argv0);
+      return 2;
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  // With "--" in place of the command, the remaining arguments are run directly.
+  bool is_exec = argc >= 4 && strcmp(argv[2], "--") == 0;
+  if (!is_exec && argc != 3 && argc != 4) {
+    PrintUsage(argv0);
+    return 2;
+  }
+
+  const char *unit_name = argv[0], *user = argv[1];
+  TransientCommand command = {.command = argv[2]};
+  if (is_exec) {
+    command.command = argv[3];
+    command.argv = &argv[3];
+  } else if (argc == 4) {
+    // pucrod passes the shell along when it has it cached, saving an NSS lookup.
+    command.shell = argv[3];
+  }
+
+  TransientResult result =
+      TransientUnit_RunAsUser(unit_name, &command, user, timeout_usec);
+  if (result != kTransientResultStarted) {
+    LogError("Failed to complete dispatch of '%s' as '%s'", command.command, user);
+  }
+
+  return result;
+}
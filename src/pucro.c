@@ -2,48 +2,218 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
+#include "config-cache.h"
 #include "config.h"
+#include "control.h"
 #include "dispatch.h"
+#include "flight-recorder.h"
+#include "gesture.h"
 #include "input.h"
+#include "loop.h"
+#include "realtime.h"
+#include "reload.h"
 #include "seat.h"
+#include "stats.h"
+#include "users.h"
 #include "utils.h"
+#include "workers.h"
 
 #include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <libevdev/libevdev.h>
-#include <libinput.h>
+#include <stdio.h>
+#include <sys/resource.h>
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-event.h>
 
+typedef enum {
+  kInputModePerSeat,
+  kInputModeShared,
+  kInputModeEvdev,
+} InputMode;
+
+typedef struct Options Options;
 typedef struct EventHandlerData EventHandlerData;
+typedef struct RuleDispatch RuleDispatch;
+
+struct Options {
+  const char *config_path;
+  DispatcherMode dispatch_mode;
+  InputMode input_mode;
+  // How many threads the per-seat input mode reads seats on, or 0 for the main loop.
+  size_t input_shards;
+
+  const char *replay_path;
+  InputReplaySpeed replay_speed;
+  const char *record_path;
+
+  uint64_t stall_budget_usec;
+  bool stall_backtraces;
+
+  // Prioritizes input over other event sources and locks memory.
+  bool low_latency;
+  // The SCHED_FIFO priority of the threads reading input, or 0 to not use it.
+  int realtime_priority;
+};
 
 struct EventHandlerData {
+  sd_event *event;
   InputMonitor *input_monitor;
+  GestureEngine *gesture_engine;
+  ConfigReloader *reloader;
   SeatMonitor *seat_monitor;
+  UserCache *user_cache;
   Dispatcher *dispatcher;
+  WorkerPool *worker_pool;
+
+  // When to stop waiting for dispatches to finish after a replay.
+  uint64_t replay_drain_deadline_usec;
+
+  // When Run started, and when loading the config and creating everything finished.
+  uint64_t start_usec;
+  uint64_t config_loaded_usec;
+  uint64_t setup_done_usec;
 };
 
-const char kButtonNamePrefix[] = "BTN_";
+// Ties a dispatch to its rule until the action started, keeping its snapshot alive.
+struct RuleDispatch {
+  EventHandlerData *handler_data;
+  Config *config;
+  ConfigRule *rule;
+  // The sequence number of the flight recorder's record of the dispatch.
+  uint64_t dispatch_seq;
+};
+
+static const int kStatusUpdateIntervalSec = 10;
+static const int kReplayDrainTimeoutSec = 10;
+static const int kReplayDrainPollUsec = 10000;
+static const int kUsecPerSec = 1000000;
+static const double kUsecPerMsec = 1000.0;
+static const uint64_t kFlightRecorderDumpIntervalUsec = 60 * 1000000ull;
+static const uint64_t kDefaultStallBudgetUsec = 10000;
+// Jobs on the pool are mostly waiting on the network, so a few threads go a long way.
+static const size_t kWorkerThreadCount = 4;
+static const unsigned long kMaxInputShards = 64;
+static const long kMaxRealtimePriority = 99;
 
 CLEANUP_AUTOPTR_ALIAS(sd_event, sd_event_unrefp)
 
+// Lets the input monitor know which buttons the loaded rules use.
+static void UpdateInputButtons(InputMonitor *input_monitor) {
+  size_t count = 0;
+  CLEANUP_AUTOFREE unsigned int *codes =
+      Config_GetButtonCodes(Config_GetCurrent(), &count);
+  InputMonitor_SetButtons(input_monitor, codes, count);
+}
+
 static int ReloadConfigOnSigHup(sd_event_source *source,
                                 const struct signalfd_siginfo *info, void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
   sd_notify(0, "RELOADING=1");
+  ConfigReloader_Request(handler_data->reloader);
+  return 0;
+}
 
-  if (!Config_Load(Config_GetInstance())) {
-    LogError("Failed to reload config on request");
+static void OnConfigReloaded(ConfigReloader *reloader, bool success, void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
+  if (success) {
+    UpdateInputButtons(handler_data->input_monitor);
   }
 
+  // Harmless when the reload wasn't requested via SIGHUP.
   sd_notify(0, "READY=1");
+}
+
+static int LogStatsOnSigUsr1(sd_event_source *source, const struct signalfd_siginfo *info,
+                             void *userdata) {
+  LogInfo("Counters and latency by stage:");
+  Stats_Log();
+
+  LogInfo("Latency from input to dispatch by rule:");
+  Config *config = Config_GetCurrent();
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    if (LatencyHistogram_GetCount(&rule->latency) > 0) {
+      CLEANUP_AUTOFREE char *name = NULL;
+      if (asprintf(&name, "rule #%zu", rule->index + 1) == -1) {
+        abort();
+      }
+
+      LatencyHistogram_Log(&rule->latency, name);
+    }
+  }
+
+  LogInfo("Latency from dispatch to start by rule:");
+  for (ConfigRule *rule = config->rules; rule != NULL; rule = rule->next) {
+    if (LatencyHistogram_GetCount(&rule->start_latency) > 0 || rule->failed_starts > 0) {
+      CLEANUP_AUTOFREE char *name = NULL;
+      if (asprintf(&name, "rule #%zu (%" PRIu64 " failed)", rule->index + 1,
+                   rule->failed_starts) == -1) {
+        abort();
+      }
+
+      LatencyHistogram_Log(&rule->start_latency, name);
+    }
+  }
+
+  Loop_LogOffenders();
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    LogInfo("Page faults: %ld major, %ld minor", usage.ru_majflt, usage.ru_minflt);
+  }
+
+  return 0;
+}
+
+static void LogFlightRecorderDump(const char *path, void *userdata) {
+  if (path != NULL) {
+    LogInfo("Dumped flight recorder to %s", path);
+  }
+}
+
+static int DumpFlightRecorderOnSigUsr2(sd_event_source *source,
+                                       const struct signalfd_siginfo *info,
+                                       void *userdata) {
+  EventHandlerData *handler_data = userdata;
+  FlightRecorder_Dump(handler_data->worker_pool, "SIGUSR2", LogFlightRecorderDump, NULL);
   return 0;
 }
 
-static bool SetupSignalHandlers(sd_event *event) {
+static int UpdateStatus(sd_event_source *source, uint64_t usec, void *userdata) {
+  static uint64_t last_count = 0;
+
+  const LatencyHistogram *total = &Stats_GetInstance()->stages[kLatencyStageTotal];
+  uint64_t count = LatencyHistogram_GetCount(total);
+  if (count != last_count) {
+    sd_notifyf(0,
+               "STATUS=Click to start p50 <= %" PRIu64 "us, p99 <= %" PRIu64
+               "us over %" PRIu64 " dispatches",
+               LatencyHistogram_GetPercentile(total, 50),
+               LatencyHistogram_GetPercentile(total, 99), count);
+    last_count = count;
+  }
+
+  int rc = 0;
+  if ((rc = sd_event_source_set_time_relative(
+           source, kStatusUpdateIntervalSec * kUsecPerSec)) < 0 ||
+      (rc = sd_event_source_set_enabled(source, SD_EVENT_ONESHOT)) < 0) {
+    LogErrno(-rc, "Failed to re-arm status timer");
+  }
+
+  return 0;
+}
+
+static bool SetupSignalHandlers(sd_event *event, EventHandlerData *handler_data) {
   sigset_t mask;
   sigemptyset(&mask);
   sigaddset(&mask, SIGINT);
   sigaddset(&mask, SIGTERM);
   sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
   sigaddset(&mask, SIGCHLD);
 
   if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
@@ -58,69 +228,295 @@ static bool SetupSignalHandlers(sd_event *event) {
     return false;
   }
 
-  if ((rc = sd_event_add_signal(event, NULL, SIGHUP, ReloadConfigOnSigHup, NULL)) < 0) {
+  if ((rc = Loop_AddSignal(event, NULL, SIGHUP, ReloadConfigOnSigHup, handler_data,
+                           "sighup")) < 0) {
     LogErrno(-rc, "Failed to add config reload signal handler");
     return false;
   }
 
+  if ((rc = Loop_AddSignal(event, NULL, SIGUSR1, LogStatsOnSigUsr1, NULL, "sigusr1")) <
+      0) {
+    LogErrno(-rc, "Failed to add stats signal handler");
+    return false;
+  }
+
+  if ((rc = Loop_AddSignal(event, NULL, SIGUSR2, DumpFlightRecorderOnSigUsr2,
+                           handler_data, "sigusr2")) < 0) {
+    LogErrno(-rc, "Failed to add flight recorder signal handler");
+    return false;
+  }
+
   return true;
 }
 
-static void LookupRuleAndDispatch(EventHandlerData *handler_data, const char *seat_id,
-                                  const char *button_name) {
-  if (strncmp(button_name, kButtonNamePrefix, strlen(kButtonNamePrefix)) != 0) {
-    LogError("Unexpected button name %s", button_name);
+static void RuleDispatch_Free(RuleDispatch *rule_dispatch) {
+  Config_Unref(rule_dispatch->config);
+  free(rule_dispatch);
+}
+
+// Timeouts tend to come in bursts, and the first dump already covers what led up to them.
+static void DumpFlightRecorderOnTimeout(EventHandlerData *handler_data) {
+  static uint64_t last_dump_usec = 0;
+
+  uint64_t now = GetMonotonicUsec();
+  if (last_dump_usec != 0 && now < last_dump_usec + kFlightRecorderDumpIntervalUsec) {
     return;
   }
 
-  const char *button = button_name + strlen(kButtonNamePrefix);
+  last_dump_usec = now;
+  FlightRecorder_Dump(handler_data->worker_pool, "dispatch timeout",
+                      LogFlightRecorderDump, NULL);
+}
+
+static void OnDispatchDone(DispatcherResult result, uint64_t elapsed_usec,
+                           void *userdata) {
+  RuleDispatch *rule_dispatch = userdata;
+  ConfigRule *rule = rule_dispatch->rule;
+
+  FlightRecord record = {
+      .time_usec = GetMonotonicUsec(),
+      .dispatch_seq = rule_dispatch->dispatch_seq,
+      .kind = kFlightRecordDone,
+      .rule = rule->index + 1,
+      .stage_usec = {FlightRecord_ClampUsec(elapsed_usec)},
+  };
+
+  switch (result) {
+  case kDispatcherResultStarted:
+    record.outcome = kFlightOutcomeStarted;
+    LatencyHistogram_Record(&rule->start_latency, elapsed_usec);
+    break;
+  case kDispatcherResultFailed:
+    record.outcome = kFlightOutcomeFailed;
+    rule->failed_starts++;
+    break;
+  case kDispatcherResultTimedOut:
+    record.outcome = kFlightOutcomeTimedOut;
+    rule->failed_starts++;
+    break;
+  case kDispatcherResultAbandoned:
+    record.outcome = kFlightOutcomeAbandoned;
+    break;
+  }
+
+  FlightRecorder_Record(&record);
+  if (result == kDispatcherResultTimedOut) {
+    DumpFlightRecorderOnTimeout(rule_dispatch->handler_data);
+  }
+
+  RuleDispatch_Free(rule_dispatch);
+}
 
+// Fills in record's rule and stage timings along the way, and returns its outcome. If the
+// action was dispatched, rule_dispatch is set to its state.
+static FlightOutcome TryDispatch(EventHandlerData *handler_data, const char *seat_id,
+                                 const ConfigTrigger *trigger, uint64_t event_usec,
+                                 uint64_t gesture_usec, FlightRecord *record,
+                                 RuleDispatch **rule_dispatch_out) {
   const SeatMonitorSeat *seat = SeatMonitor_FindSeat(handler_data->seat_monitor, seat_id);
   if (seat == NULL) {
     LogError("Failed to find seat with id %s", seat_id);
-    return;
+    return kFlightOutcomeNoSeat;
   }
 
-  CLEANUP_AUTOFREE char *user = SeatMonitor_GetUser(handler_data->seat_monitor, seat);
+  const char *user = SeatMonitor_GetUser(handler_data->seat_monitor, seat);
   if (user == NULL) {
-    LogError("Failed to get user for seat %s", seat_id);
-    return;
+    LogDebug("Seat %s has no active user", seat_id);
+    return kFlightOutcomeNoUser;
   }
 
-  LogDebug("Find rule for %s pressing %s", user, button);
+  uint64_t user_usec = GetMonotonicUsec();
+  Stats_RecordStage(kLatencyStageUser, gesture_usec, user_usec);
+  record->stage_usec[kFlightStageUser] = FlightRecord_ClampUsec(user_usec - gesture_usec);
 
-  Config *config = Config_GetInstance();
-  ConfigRule *rule = Config_FindMatchingRule(config, user, button);
-  if (rule != NULL) {
-    LogInfo("Dispatch '%s' as '%s'", rule->action, user);
+  // Looking up the button's name would cost every press even with debug logging off.
+  if (IsDebugLogEnabled()) {
+    LogDebug("Find rule for %s's %s of %s", user, Config_GetGestureName(trigger->gesture),
+             libevdev_event_code_get_name(EV_KEY, trigger->codes[0]));
+  }
 
-    if (!Dispatcher_RunAsUser(handler_data->dispatcher, rule->action, user)) {
-      LogError("Failed to dispatch '%s' as '%s'", rule->action, user);
-    }
+  // Never blocks on NSS. Until the user's info is in, only rules naming them match.
+  const UserInfo *info = UserCache_Lookup(handler_data->user_cache, user);
+
+  // Hold on to the rules even if a reload publishes new ones before we are done.
+  CLEANUP_AUTOPTR(Config) config = Config_Ref(Config_GetCurrent());
+  ConfigRule *rule =
+      Config_FindMatchingRule(config, user, info != NULL ? info->groups : NULL, trigger);
+
+  uint64_t match_usec = GetMonotonicUsec();
+  Stats_RecordStage(kLatencyStageMatch, user_usec, match_usec);
+  record->stage_usec[kFlightStageMatch] = FlightRecord_ClampUsec(match_usec - user_usec);
+
+  if (rule == NULL) {
+    return kFlightOutcomeNoRule;
+  }
+
+  Stats_Increment(kStatsCounterMatches);
+  record->rule = rule->index + 1;
+
+  switch (RateLimiter_Check(&rule->limiter, user, event_usec)) {
+  case kRateLimitAllowed:
+    break;
+  case kRateLimitDebounced:
+    Stats_Increment(kStatsCounterDebounced);
+    LogDebug("Coalesced press of '%s' as '%s' into the previous one", rule->action,
+             user);
+    return kFlightOutcomeDebounced;
+  case kRateLimitExceeded:
+    Stats_Increment(kStatsCounterRateLimited);
+    LogDebug("Dropping '%s' as '%s' over its rate limit", rule->action, user);
+    return kFlightOutcomeRateLimited;
+  }
+
+  LogInfo("Dispatch '%s' as '%s'", rule->action, user);
+
+  RuleDispatch *rule_dispatch = Alloc(sizeof(RuleDispatch));
+  rule_dispatch->handler_data = handler_data;
+  rule_dispatch->config = Config_Ref(config);
+  rule_dispatch->rule = rule;
+
+  DispatcherRequest request = {
+      .command =
+          {
+              .command = rule->action,
+              .shell = info != NULL ? info->shell : NULL,
+              .argv = rule->exec,
+          },
+      .user = user,
+      .uid = info != NULL ? info->uid : kDispatcherUnknownUid,
+      .event_usec = event_usec,
+      .timeout_usec = rule->timeout_usec,
+      .done = OnDispatchDone,
+      .userdata = rule_dispatch,
+  };
+  if (!Dispatcher_RunAsUser(handler_data->dispatcher, &request)) {
+    LogError("Failed to dispatch '%s' as '%s'", rule->action, user);
+    rule->failed_starts++;
+    RuleDispatch_Free(rule_dispatch);
+    return kFlightOutcomeDispatchFailed;
+  }
+
+  uint64_t dispatch_usec = GetMonotonicUsec();
+  Stats_RecordStage(kLatencyStageDispatch, match_usec, dispatch_usec);
+  record->stage_usec[kFlightStageDispatch] =
+      FlightRecord_ClampUsec(dispatch_usec - match_usec);
+
+  LatencyHistogram_Record(&rule->latency,
+                          dispatch_usec > event_usec ? dispatch_usec - event_usec : 0);
+
+  *rule_dispatch_out = rule_dispatch;
+  return kFlightOutcomeDispatched;
+}
+
+// event_usec is when the kernel saw the event completing the gesture, and gesture_usec
+// when we recognized it.
+static void LookupRuleAndDispatch(EventHandlerData *handler_data, const char *seat_id,
+                                  const ConfigTrigger *trigger, uint64_t event_usec,
+                                  uint64_t gesture_usec) {
+  FlightRecord record = {
+      .time_usec = event_usec,
+      .kind = kFlightRecordDispatch,
+      .gesture = trigger->gesture,
+      .code = trigger->codes[0],
+  };
+  FlightRecord_SetSeat(&record, seat_id);
+
+  RuleDispatch *rule_dispatch = NULL;
+  record.outcome = TryDispatch(handler_data, seat_id, trigger, event_usec, gesture_usec,
+                               &record, &rule_dispatch);
+
+  uint64_t seq = FlightRecorder_Record(&record);
+  // Dispatches never finish before returning, so the done record can still refer to it.
+  if (rule_dispatch != NULL) {
+    rule_dispatch->dispatch_seq = seq;
   }
 }
 
-static void OnInputEvent(InputMonitor *input_monitor, const char *seat_id,
-                         struct libinput_event *event, void *userdata) {
+static void OnInputEvent(InputMonitor *input_monitor, const InputMonitorEvent *event,
+                         void *userdata) {
   EventHandlerData *handler_data = userdata;
+  uint64_t received_usec = GetMonotonicUsec();
 
-  if (libinput_event_get_type(event) != LIBINPUT_EVENT_POINTER_BUTTON) {
-    return;
+  if (IsDebugLogEnabled()) {
+    LogDebug("Pointer button %s in state %s",
+             libevdev_event_code_get_name(EV_KEY, event->button),
+             event->pressed ? "pressed" : "released");
   }
 
-  struct libinput_event_pointer *pointer_event = libinput_event_get_pointer_event(event);
+  if (event->pressed) {
+    Stats_Increment(kStatsCounterEvents);
+    Stats_RecordStage(kLatencyStageInput, event->time_usec, received_usec);
+  }
 
-  uint32_t button = libinput_event_pointer_get_button(pointer_event);
-  const char *button_name = libevdev_event_code_get_name(EV_KEY, button);
-  enum libinput_button_state state =
-      libinput_event_pointer_get_button_state(pointer_event);
-  bool pressed = state == LIBINPUT_BUTTON_STATE_PRESSED;
+  FlightRecord record = {
+      .time_usec = event->time_usec,
+      .kind = kFlightRecordInput,
+      .pressed = event->pressed,
+      .code = event->button,
+  };
+  FlightRecord_SetSeat(&record, event->seat_id);
+  FlightRecorder_Record(&record);
 
-  LogDebug("Pointer button %s in state %s", button_name,
-           pressed ? "pressed" : "released");
+  GestureEngine_Feed(handler_data->gesture_engine, event);
+}
 
-  if (pressed) {
-    LookupRuleAndDispatch(handler_data, seat_id, button_name);
+static bool HasRuleForTrigger(GestureEngine *gesture_engine, const char *seat_id,
+                              const ConfigTrigger *trigger, void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
+  const SeatMonitorSeat *seat = SeatMonitor_FindSeat(handler_data->seat_monitor, seat_id);
+  const char *user =
+      seat != NULL ? SeatMonitor_GetUser(handler_data->seat_monitor, seat) : NULL;
+  if (user == NULL) {
+    return false;
+  }
+
+  const UserInfo *info = UserCache_Lookup(handler_data->user_cache, user);
+  return Config_FindMatchingRule(Config_GetCurrent(), user,
+                                 info != NULL ? info->groups : NULL, trigger) != NULL;
+}
+
+static void OnGesture(GestureEngine *gesture_engine, const char *seat_id,
+                      const ConfigTrigger *trigger, uint64_t event_usec, void *userdata) {
+  EventHandlerData *handler_data = userdata;
+  LookupRuleAndDispatch(handler_data, seat_id, trigger, event_usec, GetMonotonicUsec());
+}
+
+static int ExitOnceDrained(sd_event_source *source, uint64_t usec, void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
+  unsigned int in_flight = Dispatcher_CountInFlight(handler_data->dispatcher, NULL);
+  if (in_flight > 0) {
+    if (GetMonotonicUsec() < handler_data->replay_drain_deadline_usec) {
+      int rc = 0;
+      if ((rc = sd_event_source_set_time_relative(source, kReplayDrainPollUsec)) < 0 ||
+          (rc = sd_event_source_set_enabled(source, SD_EVENT_ONESHOT)) < 0) {
+        LogErrno(-rc, "Failed to re-arm replay drain timer");
+      } else {
+        return 0;
+      }
+    } else {
+      LogError("Gave up waiting for %u dispatches after replay", in_flight);
+    }
+  }
+
+  LogInfo("Replay finished, statistics:");
+  Stats_Log();
+
+  return sd_event_exit(handler_data->event, 0);
+}
+
+static void OnReplayFinished(InputMonitor *input_monitor, void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
+  handler_data->replay_drain_deadline_usec =
+      GetMonotonicUsec() + kReplayDrainTimeoutSec * kUsecPerSec;
+
+  int rc = 0;
+  if ((rc = Loop_AddTimeRelative(handler_data->event, NULL, CLOCK_MONOTONIC, 0, 0,
+                                 ExitOnceDrained, handler_data, "replay-drain")) < 0) {
+    LogErrno(-rc, "Failed to wait for dispatches after replay");
+    sd_event_exit(handler_data->event, 1);
   }
 }
 
@@ -132,22 +528,83 @@ static void OnAddedSeat(SeatMonitor *seat_monitor, SeatMonitorSeat *seat,
   }
 }
 
+static void OnSeatUserChanged(SeatMonitor *seat_monitor, SeatMonitorSeat *seat,
+                              void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
+  // Have the user's info ready by the time they press a button.
+  if (seat->user != NULL) {
+    UserCache_Prefetch(handler_data->user_cache, seat->user);
+  }
+}
+
 static void OnRemovedSeat(SeatMonitor *seat_monitor, SeatMonitorSeat *seat,
                           void *userdata) {
   EventHandlerData *handler_data = userdata;
   if (!InputMonitor_Remove(handler_data->input_monitor, seat->id)) {
     LogError("Failed to stop monitoring removed seat %s", seat->id);
   }
+
+  GestureEngine_RemoveSeat(handler_data->gesture_engine, seat->id);
+}
+
+static int NotifyReady(sd_event_source *source, void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
+  // Seats and their input are still being set up, and will be logged once they are.
+  sd_notify(0, "READY=1");
+  LogInfo("Ready in %.1fms: config %.1fms, setup %.1fms, entering loop %.1fms",
+          (GetMonotonicUsec() - handler_data->start_usec) / kUsecPerMsec,
+          (handler_data->config_loaded_usec - handler_data->start_usec) / kUsecPerMsec,
+          (handler_data->setup_done_usec - handler_data->config_loaded_usec) /
+              kUsecPerMsec,
+          (GetMonotonicUsec() - handler_data->setup_done_usec) / kUsecPerMsec);
+
+  return 0;
+}
+
+static void OnSeatMonitorStarted(SeatMonitor *seat_monitor, bool success,
+                                 void *userdata) {
+  EventHandlerData *handler_data = userdata;
+
+  if (!success) {
+    LogError("Failed to find the current seats");
+    sd_event_exit(handler_data->event, 1);
+    return;
+  }
+
+  unsigned int seat_count = 0;
+  for (const SeatMonitorSeat *seat = SeatMonitor_GetSeats(seat_monitor); seat != NULL;
+       seat = seat->hh.next) {
+    seat_count++;
+  }
+
+  LogInfo("Found %u seats %.1fms after start", seat_count,
+          (GetMonotonicUsec() - handler_data->start_usec) / kUsecPerMsec);
 }
 
-static bool Run() {
+static bool Run(const Options *options) {
   SetupLogLevels();
 
-  if (!Config_Load(Config_GetInstance())) {
+  uint64_t start_usec = GetMonotonicUsec();
+
+  // Before any thread is started, so that none of them get an arena of their own.
+  if (options->low_latency && !Realtime_PrepareHeap()) {
+    LogError("Failed to prepare the heap for locking, continuing without");
+  }
+
+  // Freed after the reloader, which loads through it from then on.
+  CLEANUP_AUTOPTR(ConfigCache) config_cache = ConfigCache_New();
+
+  Config *config = ConfigCache_Load(config_cache, options->config_path);
+  if (config == NULL) {
     LogError("Failed to load config file to initialize");
     return false;
   }
 
+  Config_SetCurrent(config);
+  uint64_t config_loaded_usec = GetMonotonicUsec();
+
   int rc = 0;
 
   CLEANUP_AUTOPTR(sd_event) event = NULL;
@@ -161,17 +618,63 @@ static bool Run() {
     return false;
   }
 
-  if (!SetupSignalHandlers(event)) {
-    LogError("Failed to set up signal handlers");
+  // Before starting any threads, so that the input shards inherit it. The threads doing
+  // blocking work opt out again.
+  if (options->realtime_priority > 0 &&
+      !Realtime_SetScheduler(options->realtime_priority)) {
+    LogError("Failed to enable realtime scheduling");
     return false;
   }
 
-  CLEANUP_AUTOPTR(InputMonitor) input_monitor = InputMonitor_New(event);
+  // Before the input shards start their loops, so that they are watched too.
+  Loop_SetStallBudget(options->stall_budget_usec);
+  if (options->stall_backtraces && !Loop_EnableBacktraces()) {
+    LogError("Failed to enable stall backtraces");
+    return false;
+  }
+
+  // Freed after everything queuing jobs on it.
+  CLEANUP_AUTOPTR(WorkerPool) worker_pool = WorkerPool_New(event, kWorkerThreadCount);
+  if (worker_pool == NULL) {
+    LogError("Failed to create worker pool");
+    return false;
+  }
+
+  // Ahead of bus connections, child processes and timers, so a burst of them can't
+  // delay reading the next button press.
+  int input_priority =
+      options->low_latency ? SD_EVENT_PRIORITY_IMPORTANT : SD_EVENT_PRIORITY_NORMAL;
+
+  CLEANUP_AUTOPTR(InputMonitor) input_monitor = NULL;
+  if (options->replay_path != NULL) {
+    input_monitor =
+        InputMonitor_NewReplay(event, options->replay_path, options->replay_speed);
+  } else if (options->input_mode == kInputModeShared) {
+    input_monitor = InputMonitor_NewShared(event, input_priority);
+  } else if (options->input_mode == kInputModeEvdev) {
+    input_monitor = InputMonitor_NewEvdev(event, input_priority);
+  } else {
+    input_monitor = InputMonitor_New(event, input_priority, options->input_shards);
+  }
+
   if (input_monitor == NULL) {
     LogError("Failed to create input monitor");
     return false;
   }
 
+  CLEANUP_AUTOPTR(GestureEngine) gesture_engine = GestureEngine_New(event);
+  if (gesture_engine == NULL) {
+    LogError("Failed to create gesture engine");
+    return false;
+  }
+
+  CLEANUP_AUTOPTR(ConfigReloader)
+  reloader = ConfigReloader_New(event, config_cache, options->config_path);
+  if (reloader == NULL) {
+    LogError("Failed to create config reloader");
+    return false;
+  }
+
   CLEANUP_AUTOPTR(SeatMonitor)
   seat_monitor = SeatMonitor_New(event, SD_EVENT_PRIORITY_NORMAL);
   if (seat_monitor == NULL) {
@@ -179,43 +682,338 @@ static bool Run() {
     return false;
   }
 
-  CLEANUP_AUTOPTR(Dispatcher) dispatcher = Dispatcher_New(event);
+  CLEANUP_AUTOPTR(Dispatcher)
+  dispatcher = Dispatcher_New(event, worker_pool, options->dispatch_mode);
   if (dispatcher == NULL) {
     LogError("Failed to create dispatcher");
     return false;
   }
 
+  CLEANUP_AUTOPTR(UserCache) user_cache = UserCache_New(event, worker_pool);
+  if (user_cache == NULL) {
+    LogError("Failed to create user cache");
+    return false;
+  }
+
+  CLEANUP_AUTOPTR(Control)
+  control = Control_New(seat_monitor, dispatcher, user_cache, worker_pool);
+  if (control == NULL) {
+    LogError("Failed to create control interface");
+    return false;
+  }
+
   EventHandlerData handler_data = {
+      .event = event,
       .input_monitor = input_monitor,
+      .gesture_engine = gesture_engine,
+      .reloader = reloader,
       .seat_monitor = seat_monitor,
+      .user_cache = user_cache,
       .dispatcher = dispatcher,
+      .worker_pool = worker_pool,
+      .start_usec = start_usec,
+      .config_loaded_usec = config_loaded_usec,
   };
 
+  if (!SetupSignalHandlers(event, &handler_data)) {
+    LogError("Failed to set up signal handlers");
+    return false;
+  }
+
   SeatMonitor_SetSeatAddedCallback(seat_monitor, OnAddedSeat);
   SeatMonitor_SetSeatRemovedCallback(seat_monitor, OnRemovedSeat);
+  SeatMonitor_SetUserChangedCallback(seat_monitor, OnSeatUserChanged);
+  SeatMonitor_SetStartedCallback(seat_monitor, OnSeatMonitorStarted);
   SeatMonitor_SetUserData(seat_monitor, &handler_data, NULL);
 
+  ConfigReloader_SetReloadedCallback(reloader, OnConfigReloaded);
+  ConfigReloader_SetUserData(reloader, &handler_data);
+
+  GestureEngine_SetRuleCheck(gesture_engine, HasRuleForTrigger);
+  GestureEngine_SetGestureCallback(gesture_engine, OnGesture);
+  GestureEngine_SetUserData(gesture_engine, &handler_data);
+
   InputMonitor_SetInputEventCallback(input_monitor, OnInputEvent);
+  InputMonitor_SetReplayFinishedCallback(input_monitor, OnReplayFinished);
   InputMonitor_SetUserData(input_monitor, &handler_data, NULL);
+  UpdateInputButtons(input_monitor);
+
+  if (options->record_path != NULL &&
+      !InputMonitor_StartRecording(input_monitor, options->record_path)) {
+    LogError("Failed to start recording input events");
+    return false;
+  }
+
+  if ((rc = Loop_AddTimeRelative(event, NULL, CLOCK_MONOTONIC,
+                                 kStatusUpdateIntervalSec * kUsecPerSec, 0, UpdateStatus,
+                                 NULL, "status-update")) < 0) {
+    LogErrno(-rc, "Failed to add status update timer");
+    return false;
+  }
 
   if (!SeatMonitor_Start(seat_monitor)) {
     LogError("Failed to start seat monitor");
     return false;
   }
 
-  sd_notify(0, "READY=1");
+  // Signal readiness from the first loop iteration, while the seats are still being
+  // listed, since events are accepted from then on.
+  if ((rc = Loop_AddDefer(event, NULL, NotifyReady, &handler_data, "notify-ready")) <
+      0) {
+    LogErrno(-rc, "Failed to schedule readiness notification");
+    return false;
+  }
+
+  handler_data.setup_done_usec = GetMonotonicUsec();
+
+  // Last, so that everything set up so far is locked too.
+  if (options->low_latency && !Realtime_LockMemory()) {
+    LogError("Failed to lock memory, continuing without");
+  }
 
-  if ((rc = sd_event_loop(event) < 0)) {
+  if ((rc = Loop_Run(event)) < 0) {
     LogErrno(-rc, "Failed to run event loop");
     return false;
   }
 
-  Config_Clear(Config_GetInstance());
+  if (rc != 0) {
+    return false;
+  }
+
+  Config_SetCurrent(NULL);
   return true;
 }
 
-int main() {
-  if (!Run()) {
+static void PrintUsage(FILE *stream, const char *argv0) {
+  fprintf(stream,
+          "Usage: %s [OPTIONS]\n"
+          "\n"
+          "Options:\n"
+          "  -h, --help                 Show this help and exit\n"
+          "  --config=PATH              Load rules from PATH instead of\n"
+          "                             " CONFIG_FILE "\n"
+          "  --dispatch-mode=MODE       How to start actions: spawn (default) or bus\n"
+          "  --input-mode=MODE          Give every seat its own libinput context\n"
+          "                             (per-seat, default), serve all seats from one\n"
+          "                             (shared), or read only the buttons in use\n"
+          "                             straight from evdev (evdev)\n"
+          "  --input-shards=N           Read the seats on N threads of their own in\n"
+          "                             per-seat mode (0, the default, reads them on\n"
+          "                             the main thread)\n"
+          "  --record=PATH              Record all button events to PATH\n"
+          "  --replay=PATH              Replay recorded button events from PATH instead\n"
+          "                             of monitoring input devices, then exit\n"
+          "  --replay-speed=SPEED       Replay at the recorded speed (real, default) or\n"
+          "                             as fast as possible (max)\n"
+          "  --stall-budget=MSEC        Log event loop callbacks that run longer than\n"
+          "                             MSEC (10 by default, 0 to disable)\n"
+          "  --stall-backtraces         Log a backtrace of every stalled callback\n"
+          "  --low-latency              Handle input ahead of everything else and lock\n"
+          "                             all memory\n"
+          "  --realtime-priority=N      Read input under SCHED_FIFO at priority N\n"
+          "                             (1 to 99)\n",
+          argv0);
+}
+
+static bool ParseDispatchMode(const char *value, DispatcherMode *mode) {
+  // fork used to start the transient unit from a forked child, which isn't safe anymore
+  // now that worker threads may hold locks, and is kept as another name for spawn.
+  if (strcmp(value, "spawn") == 0 || strcmp(value, "fork") == 0) {
+    *mode = kDispatcherModeSpawn;
+  } else if (strcmp(value, "bus") == 0) {
+    *mode = kDispatcherModeBus;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static bool ParseInputMode(const char *value, InputMode *mode) {
+  if (strcmp(value, "per-seat") == 0) {
+    *mode = kInputModePerSeat;
+  } else if (strcmp(value, "shared") == 0) {
+    *mode = kInputModeShared;
+  } else if (strcmp(value, "evdev") == 0) {
+    *mode = kInputModeEvdev;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static bool ParseReplaySpeed(const char *value, InputReplaySpeed *speed) {
+  if (strcmp(value, "real") == 0) {
+    *speed = kInputReplaySpeedRealtime;
+  } else if (strcmp(value, "max") == 0) {
+    *speed = kInputReplaySpeedMax;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static bool ParseMsec(const char *value, uint64_t *usec) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long msec = strtoull(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || msec > UINT64_MAX / 1000) {
+    return false;
+  }
+
+  *usec = msec * 1000;
+  return true;
+}
+
+static bool ParseShardCount(const char *value, size_t *count) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long parsed = strtoul(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || value[0] == '-' ||
+      parsed > kMaxInputShards) {
+    return false;
+  }
+
+  *count = parsed;
+  return true;
+}
+
+static bool ParseRealtimePriority(const char *value, int *priority) {
+  char *end = NULL;
+  errno = 0;
+  long parsed = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || parsed < 1 ||
+      parsed > kMaxRealtimePriority) {
+    return false;
+  }
+
+  *priority = parsed;
+  return true;
+}
+
+static bool ParseOptions(int argc, char **argv, Options *options) {
+  enum {
+    kOptionConfig = 0x100,
+    kOptionDispatchMode,
+    kOptionInputMode,
+    kOptionInputShards,
+    kOptionRecord,
+    kOptionReplay,
+    kOptionReplaySpeed,
+    kOptionStallBudget,
+    kOptionStallBacktraces,
+    kOptionLowLatency,
+    kOptionRealtimePriority,
+  };
+
+  static const struct option long_options[] = {
+      {"help", no_argument, NULL, 'h'},
+      {"config", required_argument, NULL, kOptionConfig},
+      {"dispatch-mode", required_argument, NULL, kOptionDispatchMode},
+      {"input-mode", required_argument, NULL, kOptionInputMode},
+      {"input-shards", required_argument, NULL, kOptionInputShards},
+      {"record", required_argument, NULL, kOptionRecord},
+      {"replay", required_argument, NULL, kOptionReplay},
+      {"replay-speed", required_argument, NULL, kOptionReplaySpeed},
+      {"stall-budget", required_argument, NULL, kOptionStallBudget},
+      {"stall-backtraces", no_argument, NULL, kOptionStallBacktraces},
+      {"low-latency", no_argument, NULL, kOptionLowLatency},
+      {"realtime-priority", required_argument, NULL, kOptionRealtimePriority},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt = 0;
+  while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      PrintUsage(stdout, argv[0]);
+      exit(0);
+    case kOptionConfig:
+      options->config_path = optarg;
+      break;
+    case kOptionDispatchMode:
+      if (!ParseDispatchMode(optarg, &options->dispatch_mode)) {
+        LogError("Invalid dispatch mode: %s", optarg);
+        return false;
+      }
+      break;
+    case kOptionInputMode:
+      if (!ParseInputMode(optarg, &options->input_mode)) {
+        LogError("Invalid input mode: %s", optarg);
+        return false;
+      }
+      break;
+    case kOptionInputShards:
+      if (!ParseShardCount(optarg, &options->input_shards)) {
+        LogError("Invalid input shard count (at most %lu): %s", kMaxInputShards, optarg);
+        return false;
+      }
+      break;
+    case kOptionRecord:
+      options->record_path = optarg;
+      break;
+    case kOptionReplay:
+      options->replay_path = optarg;
+      break;
+    case kOptionReplaySpeed:
+      if (!ParseReplaySpeed(optarg, &options->replay_speed)) {
+        LogError("Invalid replay speed: %s", optarg);
+        return false;
+      }
+      break;
+    case kOptionStallBudget:
+      if (!ParseMsec(optarg, &options->stall_budget_usec)) {
+        LogError("Invalid stall budget: %s", optarg);
+        return false;
+      }
+      break;
+    case kOptionStallBacktraces:
+      options->stall_backtraces = true;
+      break;
+    case kOptionLowLatency:
+      options->low_latency = true;
+      break;
+    case kOptionRealtimePriority:
+      if (!ParseRealtimePriority(optarg, &options->realtime_priority)) {
+        LogError("Invalid realtime priority (1 to %ld): %s", kMaxRealtimePriority,
+                 optarg);
+        return false;
+      }
+      break;
+    default:
+      PrintUsage(stderr, argv[0]);
+      return false;
+    }
+  }
+
+  if (optind < argc) {
+    LogError("Unexpected argument: %s", argv[optind]);
+    return false;
+  }
+
+  if (options->input_shards > 0 && options->input_mode != kInputModePerSeat) {
+    LogError("--input-shards only works with --input-mode=per-seat");
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  Options options = {
+      .config_path = CONFIG_FILE,
+      .dispatch_mode = kDispatcherModeSpawn,
+      .replay_speed = kInputReplaySpeedRealtime,
+      .stall_budget_usec = kDefaultStallBudgetUsec,
+  };
+
+  if (!ParseOptions(argc, argv, &options)) {
+    return 1;
+  }
+
+  if (!Run(&options)) {
     return 1;
   }
 
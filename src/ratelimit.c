@@ -0,0 +1,76 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "ratelimit.h"
+
+#include "utils.h"
+
+#include <uthash.h>
+
+struct RateLimiterBucket {
+  char *key;
+
+  // The bucket is tracked as the time it would next be full (the "theoretical arrival
+  // time" of GCRA), which needs no refill bookkeeping.
+  uint64_t full_usec;
+  // When the last press was allowed, or 0 if none was yet.
+  uint64_t last_allowed_usec;
+
+  UT_hash_handle hh;
+};
+
+bool RateLimiter_IsEnabled(const RateLimiter *limiter) {
+  return limiter->burst > 0 || limiter->debounce_usec > 0;
+}
+
+static RateLimiterBucket *GetBucket(RateLimiter *limiter, const char *key) {
+  RateLimiterBucket *bucket = NULL;
+  HASH_FIND_STR(limiter->buckets, key, bucket);
+  if (bucket == NULL) {
+    bucket = Alloc(sizeof(RateLimiterBucket));
+    bucket->key = StrDup(key);
+    HASH_ADD_STR(limiter->buckets, key, bucket);
+  }
+
+  return bucket;
+}
+
+RateLimitVerdict RateLimiter_Check(RateLimiter *limiter, const char *key,
+                                   uint64_t now_usec) {
+  if (!RateLimiter_IsEnabled(limiter)) {
+    return kRateLimitAllowed;
+  }
+
+  RateLimiterBucket *bucket = GetBucket(limiter, key);
+
+  if (limiter->debounce_usec > 0 && bucket->last_allowed_usec != 0 &&
+      now_usec < bucket->last_allowed_usec + limiter->debounce_usec) {
+    return kRateLimitDebounced;
+  }
+
+  if (limiter->burst > 0) {
+    uint64_t token_usec = limiter->interval_usec / limiter->burst;
+    uint64_t full_usec = bucket->full_usec > now_usec ? bucket->full_usec : now_usec;
+
+    // Taking a token pushes the full time out by token_usec, which may not go further
+    // than a whole interval ahead of now.
+    if (full_usec + token_usec > now_usec + limiter->interval_usec) {
+      return kRateLimitExceeded;
+    }
+
+    bucket->full_usec = full_usec + token_usec;
+  }
+
+  bucket->last_allowed_usec = now_usec;
+  return kRateLimitAllowed;
+}
+
+void RateLimiter_Clear(RateLimiter *limiter) {
+  RateLimiterBucket *bucket = NULL, *tmp = NULL;
+  HASH_ITER(hh, limiter->buckets, bucket, tmp) {
+    HASH_DEL(limiter->buckets, bucket);
+    free(bucket->key);
+    free(bucket);
+  }
+}
@@ -0,0 +1,41 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "utils.h"
+
+#include <stdint.h>
+
+typedef struct RateLimiter RateLimiter;
+typedef struct RateLimiterBucket RateLimiterBucket;
+
+typedef enum {
+  kRateLimitAllowed,
+  // Came within the debounce window of the last allowed press.
+  kRateLimitDebounced,
+  // The key's token bucket is empty.
+  kRateLimitExceeded,
+} RateLimitVerdict;
+
+// Token buckets with an optional debounce window, tracked separately for every key.
+struct RateLimiter {
+  // Allows bursts of up to burst presses, refilled at burst per interval_usec. A burst of
+  // 0 disables the bucket.
+  unsigned int burst;
+  uint64_t interval_usec;
+  // Presses within this long of the last allowed one are coalesced into it.
+  uint64_t debounce_usec;
+
+  RateLimiterBucket *buckets;
+};
+
+// Returns true if the limiter would ever drop anything.
+bool RateLimiter_IsEnabled(const RateLimiter *limiter);
+
+// Decides whether a press for key at now_usec may go ahead, and if so takes a token.
+RateLimitVerdict RateLimiter_Check(RateLimiter *limiter, const char *key,
+                                   uint64_t now_usec);
+
+void RateLimiter_Clear(RateLimiter *limiter);
@@ -0,0 +1,104 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "realtime.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+enum {
+  // Enough for the deepest call chains of the event loop's thread.
+  kPrefaultStackSize = 256 * 1024,
+  // Enough for the allocations of a few thousand events and dispatches in flight.
+  kPrefaultHeapSize = 4 * 1024 * 1024,
+};
+
+static void PrefaultStack() {
+  volatile char stack[kPrefaultStackSize];
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < sizeof(stack); i += page_size) {
+    stack[i] = 0;
+  }
+}
+
+static void PrefaultHeap() {
+  volatile char *heap = Alloc(kPrefaultHeapSize);
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < kPrefaultHeapSize; i += page_size) {
+    heap[i] = 1;
+  }
+
+  // Stays part of the heap, since it's not allowed to shrink anymore.
+  free((char *)heap);
+}
+
+// Without CAP_IPC_LOCK, locking more than RLIMIT_MEMLOCK makes later allocations fail.
+static bool CanLockEverything() {
+  if (geteuid() == 0) {
+    return true;
+  }
+
+  struct rlimit limit;
+  return getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY;
+}
+
+bool Realtime_PrepareHeap() {
+  if (mallopt(M_ARENA_MAX, 1) == 0 || mallopt(M_TRIM_THRESHOLD, -1) == 0 ||
+      mallopt(M_MMAP_MAX, 0) == 0) {
+    LogError("Failed to configure malloc for locked memory");
+    return false;
+  }
+
+  return true;
+}
+
+bool Realtime_LockMemory() {
+  if (!CanLockEverything()) {
+    LogError("Can't lock memory without root or an unlimited RLIMIT_MEMLOCK");
+    return false;
+  }
+
+  // The main heap is shared by every thread, so growing it once here covers them all.
+  PrefaultStack();
+  PrefaultHeap();
+
+  if (mlockall(MCL_CURRENT) == -1) {
+    LogErrno(errno, "Failed to lock memory");
+    return false;
+  }
+
+  // Later mappings, like the stacks of threads, are only locked as they are touched, so
+  // that their unused parts don't take up memory.
+  if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == -1) {
+    LogErrno(errno, "Failed to lock future memory");
+    return false;
+  }
+
+  return true;
+}
+
+bool Realtime_SetScheduler(int priority) {
+  struct sched_param param = {.sched_priority = priority};
+  if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == -1) {
+    LogErrno(errno, "Failed to run under SCHED_FIFO at priority %d", priority);
+    return false;
+  }
+
+  return true;
+}
+
+void Realtime_ResetScheduler() {
+  struct sched_param param = {.sched_priority = 0};
+  int rc = 0;
+  if ((rc = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param)) != 0) {
+    LogErrno(rc, "Failed to reset scheduling policy");
+  }
+}
@@ -0,0 +1,28 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// Opt-in tuning for the low-latency mode, which trades memory and fairness towards the
+// rest of the system for more predictable worst-case latency.
+
+#include "utils.h"
+
+// Has every thread allocate from the main heap, which never shrinks and also serves
+// large allocations, so that Realtime_LockMemory covers the memory of all threads. Must
+// be called before any thread is started, since threads keep the arenas they have.
+bool Realtime_PrepareHeap();
+
+// Faults in and locks all of the daemon's memory, including pages it touches later on,
+// so that the first press after hours of idling doesn't wait on major faults. Must be
+// called after Realtime_PrepareHeap, once setup is done.
+bool Realtime_LockMemory();
+
+// Runs the calling thread, and the threads it starts from now on, under SCHED_FIFO at the
+// given priority. Child processes start out with the default policy again.
+bool Realtime_SetScheduler(int priority);
+
+// Puts the calling thread back under the default policy, for threads doing blocking work
+// that mustn't compete with input handling.
+void Realtime_ResetScheduler();
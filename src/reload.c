@@ -0,0 +1,276 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "reload.h"
+
+#include "config-cache.h"
+#include "src/loop.h"
+#include "src/realtime.h"
+#include "src/utils.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+// Editors tend to write a file several times in a row, so wait for things to settle.
+static const uint64_t kReloadDebounceUsec = 200000;
+
+struct ConfigReloader {
+  sd_event *event;
+  ConfigCache *cache;
+  char *path;
+  char *basename;
+  char *dropin_dir;
+  char *dropin_basename;
+
+  sd_event_source *inotify_source;
+  // NULL while the drop-in directory doesn't exist.
+  sd_event_source *dropin_source;
+  sd_event_source *debounce_source;
+
+  // Signaled by the worker once it is done parsing.
+  int done_fd;
+  sd_event_source *done_source;
+
+  pthread_t worker;
+  bool worker_running;
+  // Whether another request came in while the worker was running.
+  bool pending;
+  // Written by the worker before it signals done_fd.
+  Config *result;
+
+  ConfigReloader_OnReloaded on_reloaded;
+  void *userdata;
+};
+
+static void *ParseOnWorker(void *data) {
+  ConfigReloader *reloader = data;
+
+  Realtime_ResetScheduler();
+  reloader->result = ConfigCache_Load(reloader->cache, reloader->path);
+
+  if (eventfd_write(reloader->done_fd, 1) == -1) {
+    LogErrno(errno, "Failed to signal finished config reload");
+  }
+
+  return NULL;
+}
+
+static void StartWorker(ConfigReloader *reloader) {
+  LogInfo("Reloading config file %s and drop-ins in %s", reloader->path,
+          reloader->dropin_dir);
+
+  int rc = 0;
+  if ((rc = pthread_create(&reloader->worker, NULL, ParseOnWorker, reloader)) != 0) {
+    LogErrno(rc, "Failed to start config reload thread");
+    if (reloader->on_reloaded != NULL) {
+      reloader->on_reloaded(reloader, false, reloader->userdata);
+    }
+    return;
+  }
+
+  reloader->worker_running = true;
+}
+
+static int OnWorkerDone(sd_event_source *source, int fd, uint32_t revents,
+                        void *userdata) {
+  ConfigReloader *reloader = userdata;
+
+  eventfd_t value = 0;
+  if (eventfd_read(fd, &value) == -1) {
+    if (errno != EAGAIN) {
+      LogErrno(errno, "Failed to read config reload completion");
+    }
+    return 0;
+  }
+
+  pthread_join(reloader->worker, NULL);
+  reloader->worker_running = false;
+
+  Config *config = STEAL_POINTER(&reloader->result);
+  if (config != NULL) {
+    Config_SetCurrent(config);
+    LogInfo("Loaded %zu rules", config->rule_count);
+  } else {
+    LogError("Failed to reload config, keeping the old rules");
+  }
+
+  if (reloader->on_reloaded != NULL) {
+    reloader->on_reloaded(reloader, config != NULL, reloader->userdata);
+  }
+
+  // The file may have changed again after the worker already read it.
+  if (reloader->pending) {
+    reloader->pending = false;
+    StartWorker(reloader);
+  }
+
+  return 0;
+}
+
+static int OnDebounceExpired(sd_event_source *source, uint64_t usec, void *userdata) {
+  ConfigReloader *reloader = userdata;
+
+  if (reloader->worker_running) {
+    reloader->pending = true;
+  } else {
+    StartWorker(reloader);
+  }
+
+  return 0;
+}
+
+static int OnDropInDirChanged(sd_event_source *source, const struct inotify_event *event,
+                              void *userdata) {
+  ConfigReloader *reloader = userdata;
+
+  if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+    LogDebug("Config drop-in directory %s went away", reloader->dropin_dir);
+    sd_event_source_disable_unref(STEAL_POINTER(&reloader->dropin_source));
+    ConfigReloader_Request(reloader);
+  } else if (event->mask & IN_Q_OVERFLOW) {
+    ConfigReloader_Request(reloader);
+  } else if (event->len > 0 && Config_IsDropInName(event->name)) {
+    LogDebug("Config drop-in %s/%s changed", reloader->dropin_dir, event->name);
+    ConfigReloader_Request(reloader);
+  }
+
+  return 0;
+}
+
+// Fails quietly if the directory doesn't exist, since drop-ins are optional.
+static bool WatchDropInDir(ConfigReloader *reloader) {
+  int rc = 0;
+  if ((rc = Loop_AddInotify(reloader->event, &reloader->dropin_source,
+                            reloader->dropin_dir,
+                            IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+                                IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR,
+                            OnDropInDirChanged, reloader, "config-dropin-changed")) < 0) {
+    if (rc != -ENOENT && rc != -ENOTDIR) {
+      LogErrno(-rc, "Failed to watch %s for config changes", reloader->dropin_dir);
+    }
+    return false;
+  }
+
+  return true;
+}
+
+static int OnConfigDirChanged(sd_event_source *source, const struct inotify_event *event,
+                              void *userdata) {
+  ConfigReloader *reloader = userdata;
+
+  if (event->mask & IN_Q_OVERFLOW) {
+    ConfigReloader_Request(reloader);
+  } else if (event->len > 0 && strcmp(event->name, reloader->basename) == 0) {
+    LogDebug("Config file %s changed", reloader->path);
+    ConfigReloader_Request(reloader);
+  } else if (event->len > 0 && strcmp(event->name, reloader->dropin_basename) == 0 &&
+             reloader->dropin_source == NULL && WatchDropInDir(reloader)) {
+    LogDebug("Config drop-in directory %s appeared", reloader->dropin_dir);
+    ConfigReloader_Request(reloader);
+  }
+
+  return 0;
+}
+
+void ConfigReloader_Free(ConfigReloader *reloader) {
+  sd_event_source_disable_unref(STEAL_POINTER(&reloader->inotify_source));
+  sd_event_source_disable_unref(STEAL_POINTER(&reloader->dropin_source));
+  sd_event_source_disable_unref(STEAL_POINTER(&reloader->debounce_source));
+  sd_event_source_disable_unref(STEAL_POINTER(&reloader->done_source));
+
+  if (reloader->worker_running) {
+    pthread_join(reloader->worker, NULL);
+  }
+
+  if (reloader->result != NULL) {
+    Config_Unref(STEAL_POINTER(&reloader->result));
+  }
+
+  if (reloader->done_fd != -1) {
+    close(reloader->done_fd);
+  }
+
+  free(reloader->path);
+  free(reloader->basename);
+  free(reloader->dropin_dir);
+  free(reloader->dropin_basename);
+  free(reloader);
+}
+
+ConfigReloader *ConfigReloader_New(sd_event *event, ConfigCache *cache,
+                                   const char *path) {
+  CLEANUP_AUTOPTR(ConfigReloader) reloader = Alloc(sizeof(ConfigReloader));
+  reloader->event = event;
+  reloader->cache = cache;
+  reloader->path = StrDup(path);
+  reloader->dropin_dir = Config_GetDropInDir(path);
+  reloader->done_fd = -1;
+
+  CLEANUP_AUTOFREE char *path_for_dirname = StrDup(path);
+  CLEANUP_AUTOFREE char *path_for_basename = StrDup(path);
+  CLEANUP_AUTOFREE char *dropin_dir_for_basename = StrDup(reloader->dropin_dir);
+  const char *dir = dirname(path_for_dirname);
+  reloader->basename = StrDup(basename(path_for_basename));
+  reloader->dropin_basename = StrDup(basename(dropin_dir_for_basename));
+
+  int rc = 0;
+
+  // Watch the directory rather than the file, so that files replaced by renaming them
+  // over the old one, like most editors and configuration tools do, are noticed too, as
+  // well as the drop-in directory being created.
+  if ((rc = Loop_AddInotify(event, &reloader->inotify_source, dir,
+                            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR,
+                            OnConfigDirChanged, reloader, "config-changed")) < 0) {
+    LogErrno(-rc, "Failed to watch %s for config changes", dir);
+    return NULL;
+  }
+
+  WatchDropInDir(reloader);
+
+  if ((rc = Loop_AddTime(event, &reloader->debounce_source, CLOCK_MONOTONIC, 0, 0,
+                         OnDebounceExpired, reloader, "config-reload")) < 0 ||
+      (rc = sd_event_source_set_enabled(reloader->debounce_source, SD_EVENT_OFF)) < 0) {
+    LogErrno(-rc, "Failed to add config reload timer");
+    return NULL;
+  }
+
+  reloader->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (reloader->done_fd == -1) {
+    LogErrno(errno, "Failed to create config reload eventfd");
+    return NULL;
+  }
+
+  if ((rc = Loop_AddIo(event, &reloader->done_source, reloader->done_fd, EPOLLIN,
+                       OnWorkerDone, reloader, "config-reloaded")) < 0) {
+    LogErrno(-rc, "Failed to monitor config reload eventfd");
+    return NULL;
+  }
+
+  return STEAL_POINTER(&reloader);
+}
+
+void ConfigReloader_SetReloadedCallback(ConfigReloader *reloader,
+                                        ConfigReloader_OnReloaded on_reloaded) {
+  reloader->on_reloaded = on_reloaded;
+}
+
+void ConfigReloader_SetUserData(ConfigReloader *reloader, void *userdata) {
+  reloader->userdata = userdata;
+}
+
+void ConfigReloader_Request(ConfigReloader *reloader) {
+  sd_event_source *source = reloader->debounce_source;
+
+  int rc = 0;
+  if ((rc = sd_event_source_set_time_relative(source, kReloadDebounceUsec)) < 0 ||
+      (rc = sd_event_source_set_enabled(source, SD_EVENT_ONESHOT)) < 0) {
+    LogErrno(-rc, "Failed to schedule config reload");
+  }
+}
@@ -0,0 +1,34 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "config-cache.h"
+#include "config.h"
+#include "utils.h"
+
+#include <systemd/sd-event.h>
+
+typedef struct ConfigReloader ConfigReloader;
+
+// Called on the main thread after a new snapshot was published, or after a reload failed
+// and the old one was kept.
+typedef void (*ConfigReloader_OnReloaded)(ConfigReloader *reloader, bool success,
+                                          void *userdata);
+
+// Reloads the config file and its drop-ins through cache on request or whenever one of
+// them is written to, parsing them on a worker thread so that input keeps being handled
+// meanwhile. The cache must outlive the reloader.
+ConfigReloader *ConfigReloader_New(sd_event *event, ConfigCache *cache,
+                                   const char *path);
+void ConfigReloader_Free(ConfigReloader *reloader);
+
+void ConfigReloader_SetReloadedCallback(ConfigReloader *reloader,
+                                        ConfigReloader_OnReloaded on_reloaded);
+void ConfigReloader_SetUserData(ConfigReloader *reloader, void *userdata);
+
+// Schedules a reload. Requests that come in quick succession are coalesced into one.
+void ConfigReloader_Request(ConfigReloader *reloader);
+
+CLEANUP_AUTOPTR_DEFINE(ConfigReloader, ConfigReloader_Free)
@@ -21,19 +21,29 @@ const char kLogindSeatInterface[] = "org.freedesktop.login1.Seat";
 const char kLogindSeatActiveSession[] = "ActiveSession";
 const char kLogindSessionInterface[] = "org.freedesktop.login1.Session";
 const char kLogindSessionName[] = "Name";
+const char kDBusPropertiesInterface[] = "org.freedesktop.DBus.Properties";
+const char kDBusPropertiesGet[] = "Get";
+const char kDBusPropertiesChanged[] = "PropertiesChanged";
 
 struct SeatMonitor {
   sd_bus *bus;
   SeatMonitorSeat *seats;
+  sd_bus_slot *list_seats_slot;
 
   SeatMonitor_OnSeatAdded on_seat_added;
   SeatMonitor_OnSeatRemoved on_seat_removed;
+  SeatMonitor_OnUserChanged on_user_changed;
+  SeatMonitor_OnStarted on_started;
 
   void *userdata;
   SeatMonitor_UserDataDestroy userdata_destroy;
 };
 
 static void SeatMonitorSeat_Free(SeatMonitorSeat *seat) {
+  sd_bus_slot_unref(STEAL_POINTER(&seat->pending_call_slot));
+  sd_bus_slot_unref(STEAL_POINTER(&seat->properties_changed_slot));
+
+  free(STEAL_POINTER(&seat->user));
   free(STEAL_POINTER(&seat->object));
   free(STEAL_POINTER(&seat->id));
   free(seat);
@@ -63,6 +73,165 @@ SeatMonitor *SeatMonitor_New(sd_event *event, int priority) {
   return monitor;
 }
 
+static void SetSeatUser(SeatMonitorSeat *seat, const char *user) {
+  if (seat->user == NULL && user == NULL) {
+    return;
+  } else if (seat->user != NULL && user != NULL && strcmp(seat->user, user) == 0) {
+    return;
+  }
+
+  LogDebug("SeatMonitor: seat %s now belongs to %s", seat->id,
+           user != NULL ? user : "(nobody)");
+
+  free(seat->user);
+  seat->user = user != NULL ? StrDup(user) : NULL;
+
+  SeatMonitor *monitor = seat->monitor;
+  if (monitor->on_user_changed) {
+    monitor->on_user_changed(monitor, seat, monitor->userdata);
+  }
+}
+
+static int OnSessionNameReply(sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+  SeatMonitorSeat *seat = userdata;
+  int rc = 0;
+
+  const sd_bus_error *reply_error = sd_bus_message_get_error(reply);
+  if (reply_error != NULL) {
+    LogError("Failed to get user for the active session of seat %s: %s: %s", seat->id,
+             reply_error->name, reply_error->message);
+    SetSeatUser(seat, NULL);
+    return 0;
+  }
+
+  const char *session_name = NULL;
+  if ((rc = sd_bus_message_read(reply, "v", "s", &session_name)) < 0) {
+    LogErrno(-rc, "Failed to parse user name for the active session of seat %s",
+             seat->id);
+    SetSeatUser(seat, NULL);
+    return 0;
+  }
+
+  SetSeatUser(seat, session_name);
+  return 0;
+}
+
+static int OnActiveSessionReply(sd_bus_message *reply, void *userdata,
+                                sd_bus_error *error) {
+  SeatMonitorSeat *seat = userdata;
+  SeatMonitor *monitor = seat->monitor;
+  int rc = 0;
+
+  const sd_bus_error *reply_error = sd_bus_message_get_error(reply);
+  if (reply_error != NULL) {
+    LogError("Failed to get session for seat %s: %s: %s", seat->id, reply_error->name,
+             reply_error->message);
+    SetSeatUser(seat, NULL);
+    return 0;
+  }
+
+  const char *session_id = NULL, *session_object = NULL;
+  if ((rc = sd_bus_message_read(reply, "v", "(so)", &session_id, &session_object)) < 0) {
+    LogErrno(-rc, "Failed to parse session for seat %s", seat->id);
+    SetSeatUser(seat, NULL);
+    return 0;
+  }
+
+  if (*session_id == '\0') {
+    SetSeatUser(seat, NULL);
+    return 0;
+  }
+
+  // The slot of the currently running callback is kept alive by sd-bus until we return.
+  sd_bus_slot_unref(STEAL_POINTER(&seat->pending_call_slot));
+  if ((rc = sd_bus_call_method_async(monitor->bus, &seat->pending_call_slot,
+                                     kLogindService, session_object,
+                                     kDBusPropertiesInterface, kDBusPropertiesGet,
+                                     OnSessionNameReply, seat, "ss",
+                                     kLogindSessionInterface, kLogindSessionName)) < 0) {
+    LogErrno(-rc, "Failed to request user for session %s", session_id);
+    SetSeatUser(seat, NULL);
+  }
+
+  return 0;
+}
+
+static void RefreshSeatUser(SeatMonitorSeat *seat) {
+  SeatMonitor *monitor = seat->monitor;
+  int rc = 0;
+
+  // Drop any lookup that's still in flight, so an older answer can't overwrite a newer
+  // one.
+  sd_bus_slot_unref(STEAL_POINTER(&seat->pending_call_slot));
+  if ((rc = sd_bus_call_method_async(monitor->bus, &seat->pending_call_slot,
+                                     kLogindService, seat->object,
+                                     kDBusPropertiesInterface, kDBusPropertiesGet,
+                                     OnActiveSessionReply, seat, "ss",
+                                     kLogindSeatInterface, kLogindSeatActiveSession)) < 0) {
+    LogErrno(-rc, "Failed to request session for seat %s", seat->id);
+    SetSeatUser(seat, NULL);
+  }
+}
+
+static int OnSeatPropertiesChanged(sd_bus_message *message, void *userdata,
+                                   sd_bus_error *error) {
+  SeatMonitorSeat *seat = userdata;
+  int rc = 0;
+
+  const char *interface = NULL;
+  if ((rc = sd_bus_message_read(message, "s", &interface)) < 0) {
+    LogErrno(-rc, "Failed to parse properties change for seat %s", seat->id);
+    return 0;
+  }
+
+  if (strcmp(interface, kLogindSeatInterface) != 0) {
+    return 0;
+  }
+
+  bool active_session_changed = false;
+
+  if ((rc = sd_bus_message_enter_container(message, 'a', "{sv}")) < 0) {
+    LogErrno(-rc, "Failed to enter changed properties of seat %s", seat->id);
+    return 0;
+  }
+
+  while ((rc = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
+    const char *property = NULL;
+    if ((rc = sd_bus_message_read(message, "s", &property)) < 0 ||
+        (rc = sd_bus_message_skip(message, "v")) < 0 ||
+        (rc = sd_bus_message_exit_container(message)) < 0) {
+      break;
+    }
+
+    if (strcmp(property, kLogindSeatActiveSession) == 0) {
+      active_session_changed = true;
+    }
+  }
+
+  if (rc < 0 || (rc = sd_bus_message_exit_container(message)) < 0) {
+    LogErrno(-rc, "Failed to read changed properties of seat %s", seat->id);
+    return 0;
+  }
+
+  CLEANUP_STRV char **invalidated = NULL;
+  if ((rc = sd_bus_message_read_strv(message, &invalidated)) < 0) {
+    LogErrno(-rc, "Failed to read invalidated properties of seat %s", seat->id);
+    return 0;
+  }
+
+  for (char **p = invalidated; *p != NULL; p++) {
+    if (strcmp(*p, kLogindSeatActiveSession) == 0) {
+      active_session_changed = true;
+    }
+  }
+
+  if (active_session_changed) {
+    RefreshSeatUser(seat);
+  }
+
+  return 0;
+}
+
 static void AddSeat(SeatMonitor *monitor, const char *seat_id, const char *seat_object) {
   LogDebug("SeatMonitor: add seat %s", seat_id);
 
@@ -77,8 +246,19 @@ static void AddSeat(SeatMonitor *monitor, const char *seat_id, const char *seat_
   SeatMonitorSeat *seat = Alloc(sizeof(SeatMonitorSeat));
   seat->id = StrDup(seat_id);
   seat->object = StrDup(seat_object);
+  seat->monitor = monitor;
   HASH_ADD_STR(monitor->seats, id, seat);
 
+  int rc = 0;
+  if ((rc = sd_bus_match_signal_async(monitor->bus, &seat->properties_changed_slot,
+                                      kLogindService, seat->object,
+                                      kDBusPropertiesInterface, kDBusPropertiesChanged,
+                                      OnSeatPropertiesChanged, NULL, seat)) < 0) {
+    LogErrno(-rc, "Failed to watch seat %s for session changes", seat_id);
+  }
+
+  RefreshSeatUser(seat);
+
   if (monitor->on_seat_added) {
     monitor->on_seat_added(monitor, seat, monitor->userdata);
   }
@@ -127,32 +307,21 @@ static int OnNewOrRemovedSeat(sd_bus_message *message, void *userdata,
   return 1;
 }
 
-bool SeatMonitor_Start(SeatMonitor *monitor) {
-  int rc = 0;
-  if ((rc = sd_bus_match_signal(monitor->bus, NULL, kLogindService, kLogindObject,
-                                kLogindManagerInterface, kLogindManagerSeatNew,
-                                OnNewOrRemovedSeat, monitor)) < 0 ||
-      (rc = sd_bus_match_signal(monitor->bus, NULL, kLogindService, kLogindObject,
-                                kLogindManagerInterface, kLogindManagerSeatRemoved,
-                                OnNewOrRemovedSeat, monitor)) < 0) {
-    LogErrno(-rc, "Failed to watch logind signals");
-    return false;
-  }
-
-  CLEANUP(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
-  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
-  if (sd_bus_call_method(monitor->bus, kLogindService, kLogindObject,
-                         kLogindManagerInterface, kLogindManagerListSeats, &error, &reply,
-                         "") < 0) {
-    LogError("Failed to list current seats: %s: %s", error.name, error.message);
+static bool AddListedSeats(SeatMonitor *monitor, sd_bus_message *reply) {
+  const sd_bus_error *reply_error = sd_bus_message_get_error(reply);
+  if (reply_error != NULL) {
+    LogError("Failed to list current seats: %s: %s", reply_error->name,
+             reply_error->message);
     return false;
   }
 
+  int rc = 0;
   if ((rc = sd_bus_message_enter_container(reply, 'a', "(so)")) < 0) {
     LogErrno(-rc, "Failed to enter seats array");
     return false;
   }
 
+  // Seats announced by SeatNew in the meantime are skipped as duplicates.
   const char *seat_id = NULL, *seat_object = NULL;
   while ((rc = sd_bus_message_read(reply, "(so)", &seat_id, &seat_object)) > 0) {
     AddSeat(monitor, seat_id, seat_object);
@@ -171,6 +340,42 @@ bool SeatMonitor_Start(SeatMonitor *monitor) {
   return true;
 }
 
+static int OnListSeatsReply(sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+  SeatMonitor *monitor = userdata;
+
+  bool success = AddListedSeats(monitor, reply);
+  if (monitor->on_started) {
+    monitor->on_started(monitor, success, monitor->userdata);
+  }
+
+  return 0;
+}
+
+bool SeatMonitor_Start(SeatMonitor *monitor) {
+  // The matches are sent before ListSeats, so the bus delivers every seat change that
+  // happens after the listing.
+  int rc = 0;
+  if ((rc = sd_bus_match_signal_async(monitor->bus, NULL, kLogindService, kLogindObject,
+                                      kLogindManagerInterface, kLogindManagerSeatNew,
+                                      OnNewOrRemovedSeat, NULL, monitor)) < 0 ||
+      (rc = sd_bus_match_signal_async(monitor->bus, NULL, kLogindService, kLogindObject,
+                                      kLogindManagerInterface, kLogindManagerSeatRemoved,
+                                      OnNewOrRemovedSeat, NULL, monitor)) < 0) {
+    LogErrno(-rc, "Failed to watch logind signals");
+    return false;
+  }
+
+  if ((rc = sd_bus_call_method_async(monitor->bus, &monitor->list_seats_slot,
+                                     kLogindService, kLogindObject,
+                                     kLogindManagerInterface, kLogindManagerListSeats,
+                                     OnListSeatsReply, monitor, "")) < 0) {
+    LogErrno(-rc, "Failed to request current seats");
+    return false;
+  }
+
+  return true;
+}
+
 void SeatMonitor_SetSeatAddedCallback(SeatMonitor *monitor,
                                       SeatMonitor_OnSeatAdded on_seat_added) {
   monitor->on_seat_added = on_seat_added;
@@ -181,12 +386,24 @@ void SeatMonitor_SetSeatRemovedCallback(SeatMonitor *monitor,
   monitor->on_seat_removed = on_seat_removed;
 }
 
+void SeatMonitor_SetUserChangedCallback(SeatMonitor *monitor,
+                                        SeatMonitor_OnUserChanged on_user_changed) {
+  monitor->on_user_changed = on_user_changed;
+}
+
+void SeatMonitor_SetStartedCallback(SeatMonitor *monitor,
+                                    SeatMonitor_OnStarted on_started) {
+  monitor->on_started = on_started;
+}
+
 void SeatMonitor_SetUserData(SeatMonitor *monitor, void *userdata,
                              SeatMonitor_UserDataDestroy userdata_destroy) {
   monitor->userdata = userdata;
   monitor->userdata_destroy = userdata_destroy;
 }
 
+sd_bus *SeatMonitor_GetBus(SeatMonitor *monitor) { return monitor->bus; }
+
 const SeatMonitorSeat *SeatMonitor_GetSeats(SeatMonitor *monitor) {
   return monitor->seats;
 }
@@ -197,45 +414,13 @@ const SeatMonitorSeat *SeatMonitor_FindSeat(SeatMonitor *monitor, const char *se
   return match;
 }
 
-char *SeatMonitor_GetUser(SeatMonitor *monitor, const SeatMonitorSeat *seat) {
-  int rc = 0;
-  CLEANUP(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
-
-  CLEANUP(sd_bus_message_unrefp) sd_bus_message *seat_session_value = NULL;
-  if (sd_bus_get_property(monitor->bus, kLogindService, seat->object,
-                          kLogindSeatInterface, kLogindSeatActiveSession, &error,
-                          &seat_session_value, "(so)") < 0) {
-    LogError("Failed to get session for seat %s: %s: %s", seat->id, error.name,
-             error.message);
-    return NULL;
-  }
-
-  const char *session_id, *session_object = NULL;
-  if ((rc = sd_bus_message_read(seat_session_value, "(so)", &session_id,
-                                &session_object)) < 0) {
-    LogErrno(-rc, "Failed to parse session for seat %s", seat->id);
-    return NULL;
-  }
-
-  CLEANUP(sd_bus_message_unrefp) sd_bus_message *session_name_value = NULL;
-  if (sd_bus_get_property(monitor->bus, kLogindService, session_object,
-                          kLogindSessionInterface, kLogindSessionName, &error,
-                          &session_name_value, "s") < 0) {
-    LogError("Failed to get user for session %s: %s: %s", session_id, error.name,
-             error.message);
-    return NULL;
-  }
-
-  const char *session_name = NULL;
-  if ((rc = sd_bus_message_read(session_name_value, "s", &session_name)) < 0) {
-    LogErrno(-rc, "Failed to parse user name for session %s", session_id);
-    return NULL;
-  }
-
-  return StrDup(session_name);
+const char *SeatMonitor_GetUser(SeatMonitor *monitor, const SeatMonitorSeat *seat) {
+  return seat->user;
 }
 
 void SeatMonitor_Free(SeatMonitor *monitor) {
+  sd_bus_slot_unref(STEAL_POINTER(&monitor->list_seats_slot));
+
   SeatMonitorSeat *seat = NULL, *tmp = NULL;
   HASH_ITER(hh, monitor->seats, seat, tmp) {
     HASH_DEL(monitor->seats, seat);
@@ -6,6 +6,7 @@
 
 #include "utils.h"
 
+#include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
 #include <uthash.h>
 
@@ -17,30 +18,51 @@ typedef void (*SeatMonitor_OnSeatAdded)(SeatMonitor *monitor, SeatMonitorSeat *s
                                         void *userdata);
 typedef void (*SeatMonitor_OnSeatRemoved)(SeatMonitor *monitor, SeatMonitorSeat *seat,
                                           void *userdata);
+// Called when the user of a seat's active session changed, after seat->user is updated.
+typedef void (*SeatMonitor_OnUserChanged)(SeatMonitor *monitor, SeatMonitorSeat *seat,
+                                          void *userdata);
+// Called once the seats that existed when the monitor was started have all been added.
+typedef void (*SeatMonitor_OnStarted)(SeatMonitor *monitor, bool success, void *userdata);
 typedef void (*SeatMonitor_UserDataDestroy)(void *userdata);
 
 struct SeatMonitorSeat {
   char *id;
   char *object;
 
+  // The user owning the seat's active session, kept up to date from logind's
+  // PropertiesChanged signals. NULL if there is no active session, or if it has not been
+  // resolved yet.
+  char *user;
+
+  SeatMonitor *monitor;
+  sd_bus_slot *properties_changed_slot;
+  sd_bus_slot *pending_call_slot;
+
   UT_hash_handle hh;
 };
 
 SeatMonitor *SeatMonitor_New(sd_event *event, int priority);
 
+// Starts watching seats without blocking, with the current ones listed asynchronously.
 bool SeatMonitor_Start(SeatMonitor *monitor);
 
 void SeatMonitor_SetSeatAddedCallback(SeatMonitor *monitor,
                                       SeatMonitor_OnSeatAdded on_seat_added);
 void SeatMonitor_SetSeatRemovedCallback(SeatMonitor *monitor,
                                         SeatMonitor_OnSeatRemoved on_seat_removed);
+void SeatMonitor_SetUserChangedCallback(SeatMonitor *monitor,
+                                        SeatMonitor_OnUserChanged on_user_changed);
+void SeatMonitor_SetStartedCallback(SeatMonitor *monitor,
+                                    SeatMonitor_OnStarted on_started);
 void SeatMonitor_SetUserData(SeatMonitor *monitor, void *userdata,
                              SeatMonitor_UserDataDestroy userdata_destroy);
 
+sd_bus *SeatMonitor_GetBus(SeatMonitor *monitor);
+
 const SeatMonitorSeat *SeatMonitor_GetSeats(SeatMonitor *monitor);
 const SeatMonitorSeat *SeatMonitor_FindSeat(SeatMonitor *monitor, const char *seat_id);
 
-char *SeatMonitor_GetUser(SeatMonitor *monitor, const SeatMonitorSeat *seat);
+const char *SeatMonitor_GetUser(SeatMonitor *monitor, const SeatMonitorSeat *seat);
 
 void SeatMonitor_Free(SeatMonitor *monitor);
 
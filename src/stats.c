@@ -0,0 +1,159 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "stats.h"
+
+#include "utils.h"
+
+#include <inttypes.h>
+
+static const char *kStageNames[kLatencyStageCount] = {
+    [kLatencyStageInput] = "input",
+    [kLatencyStageUser] = "user",
+    [kLatencyStageMatch] = "match",
+    [kLatencyStageDispatch] = "dispatch",
+    [kLatencyStageSpawn] = "spawn",
+    [kLatencyStageStartUnit] = "start-unit",
+    [kLatencyStageTotal] = "total",
+};
+
+static const char *kCounterNames[kStatsCounterCount] = {
+    [kStatsCounterEvents] = "events",
+    [kStatsCounterMatches] = "matches",
+    [kStatsCounterDebounced] = "debounced",
+    [kStatsCounterRateLimited] = "rate-limited",
+    [kStatsCounterDispatchesStarted] = "dispatches-started",
+    [kStatsCounterDispatchesSucceeded] = "dispatches-succeeded",
+    [kStatsCounterDispatchesFailed] = "dispatches-failed",
+    [kStatsCounterDispatchesTimedOut] = "dispatches-timed-out",
+    [kStatsCounterDispatchesViaAgent] = "dispatches-via-agent",
+    [kStatsCounterLoopStalls] = "loop-stalls",
+};
+
+Stats *Stats_GetInstance() {
+  static Stats stats;
+  return &stats;
+}
+
+const char *Stats_GetStageName(LatencyStage stage) { return kStageNames[stage]; }
+
+const char *Stats_GetCounterName(StatsCounter counter) { return kCounterNames[counter]; }
+
+void Stats_Increment(StatsCounter counter) {
+  atomic_fetch_add_explicit(&Stats_GetInstance()->counters[counter], 1,
+                            memory_order_relaxed);
+}
+
+uint64_t Stats_GetCounter(StatsCounter counter) {
+  return atomic_load_explicit(&Stats_GetInstance()->counters[counter],
+                              memory_order_relaxed);
+}
+
+static size_t GetBucket(uint64_t usec) {
+  if (usec < kLatencyHistogramSubBuckets) {
+    return usec;
+  }
+
+  // Position of the highest set bit, at least 2 here.
+  int exponent = 63 - __builtin_clzll(usec);
+  size_t sub_bucket = (usec >> (exponent - 2)) & (kLatencyHistogramSubBuckets - 1);
+  size_t bucket = (exponent - 1) * kLatencyHistogramSubBuckets + sub_bucket;
+  return bucket < kLatencyHistogramBuckets ? bucket : kLatencyHistogramBuckets - 1;
+}
+
+static uint64_t GetBucketUpperBound(size_t bucket) {
+  if (bucket < kLatencyHistogramSubBuckets) {
+    return bucket;
+  }
+
+  int exponent = bucket / kLatencyHistogramSubBuckets + 1;
+  uint64_t sub_bucket = bucket % kLatencyHistogramSubBuckets;
+  uint64_t lower = (kLatencyHistogramSubBuckets + sub_bucket) << (exponent - 2);
+  return lower + (UINT64_C(1) << (exponent - 2)) - 1;
+}
+
+void LatencyHistogram_Record(LatencyHistogram *histogram, uint64_t usec) {
+  atomic_fetch_add_explicit(&histogram->buckets[GetBucket(usec)], 1,
+                            memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram_GetCount(const LatencyHistogram *histogram) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < kLatencyHistogramBuckets; i++) {
+    count += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+  }
+
+  return count;
+}
+
+uint64_t LatencyHistogram_GetPercentile(const LatencyHistogram *histogram,
+                                        double percentile) {
+  uint64_t counts[kLatencyHistogramBuckets];
+  uint64_t total = 0;
+  for (size_t i = 0; i < kLatencyHistogramBuckets; i++) {
+    counts[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    total += counts[i];
+  }
+
+  if (total == 0) {
+    return 0;
+  }
+
+  // The nearest rank, i.e. the rank of the sample we want rounded up, so that p100 is the
+  // last sample and no percentile is ever reported below its true value.
+  double exact_rank = total * percentile / 100.0;
+  uint64_t rank = (uint64_t)exact_rank;
+  if (rank < exact_rank) {
+    rank++;
+  }
+
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kLatencyHistogramBuckets; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return GetBucketUpperBound(i);
+    }
+  }
+
+  return GetBucketUpperBound(kLatencyHistogramBuckets - 1);
+}
+
+void LatencyHistogram_Log(const LatencyHistogram *histogram, const char *name) {
+  uint64_t count = LatencyHistogram_GetCount(histogram);
+  if (count == 0) {
+    LogInfo("%s: no samples", name);
+    return;
+  }
+
+  LogInfo("%s: %" PRIu64 " samples, p50 <= %" PRIu64 "us, p99 <= %" PRIu64
+          "us, max <= %" PRIu64 "us",
+          name, count, LatencyHistogram_GetPercentile(histogram, 50),
+          LatencyHistogram_GetPercentile(histogram, 99),
+          LatencyHistogram_GetPercentile(histogram, 100));
+}
+
+void Stats_RecordStage(LatencyStage stage, uint64_t start_usec, uint64_t end_usec) {
+  if (start_usec == 0) {
+    return;
+  }
+
+  // Timestamps from other sources may be slightly ahead of our own clock reads.
+  uint64_t usec = end_usec > start_usec ? end_usec - start_usec : 0;
+  LatencyHistogram_Record(&Stats_GetInstance()->stages[stage], usec);
+}
+
+void Stats_Log() {
+  Stats *stats = Stats_GetInstance();
+  for (StatsCounter counter = 0; counter < kStatsCounterCount; counter++) {
+    LogInfo("%s: %" PRIu64, kCounterNames[counter], Stats_GetCounter(counter));
+  }
+
+  for (LatencyStage stage = 0; stage < kLatencyStageCount; stage++) {
+    LatencyHistogram_Log(&stats->stages[stage], kStageNames[stage]);
+  }
+}
@@ -0,0 +1,91 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "utils.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef struct LatencyHistogram LatencyHistogram;
+typedef struct Stats Stats;
+
+typedef enum {
+  // From the kernel's event timestamp to the daemon receiving the event.
+  kLatencyStageInput,
+  // Finding the user of the seat the event came from.
+  kLatencyStageUser,
+  // Finding the rule matching the event.
+  kLatencyStageMatch,
+  // Handing the action to the dispatcher, i.e. spawning or sending the bus call.
+  kLatencyStageDispatch,
+  // The part of kLatencyStageDispatch spent spawning the helper in spawn mode, to compare
+  // with the bus mode that has none.
+  kLatencyStageSpawn,
+  // From the dispatch to StartTransientUnit completing.
+  kLatencyStageStartUnit,
+  // From the kernel's event timestamp to StartTransientUnit completing.
+  kLatencyStageTotal,
+
+  kLatencyStageCount,
+} LatencyStage;
+
+typedef enum {
+  // Button presses received.
+  kStatsCounterEvents,
+  // Button presses that matched a rule.
+  kStatsCounterMatches,
+  // Matching presses dropped by a rule's debounce window or token bucket.
+  kStatsCounterDebounced,
+  kStatsCounterRateLimited,
+  kStatsCounterDispatchesStarted,
+  kStatsCounterDispatchesSucceeded,
+  kStatsCounterDispatchesFailed,
+  kStatsCounterDispatchesTimedOut,
+  // Dispatches handed to a user's pucro-agent instead of a transient unit.
+  kStatsCounterDispatchesViaAgent,
+  // Event loop callbacks that ran over the stall budget.
+  kStatsCounterLoopStalls,
+
+  kStatsCounterCount,
+} StatsCounter;
+
+enum {
+  // Values below 4us get a bucket each, after that every power of two is split into 4
+  // buckets, which keeps the error under 25% up to ~71 minutes.
+  kLatencyHistogramSubBuckets = 4,
+  kLatencyHistogramBuckets = 31 * kLatencyHistogramSubBuckets,
+};
+
+// A fixed-size log-linear histogram of latencies in microseconds. Recording is lock-free
+// and safe from any thread.
+struct LatencyHistogram {
+  _Atomic uint64_t buckets[kLatencyHistogramBuckets];
+};
+
+struct Stats {
+  _Atomic uint64_t counters[kStatsCounterCount];
+  LatencyHistogram stages[kLatencyStageCount];
+};
+
+Stats *Stats_GetInstance();
+
+const char *Stats_GetStageName(LatencyStage stage);
+const char *Stats_GetCounterName(StatsCounter counter);
+
+void Stats_Increment(StatsCounter counter);
+uint64_t Stats_GetCounter(StatsCounter counter);
+
+void LatencyHistogram_Record(LatencyHistogram *histogram, uint64_t usec);
+uint64_t LatencyHistogram_GetCount(const LatencyHistogram *histogram);
+// Returns an upper bound on the given percentile (0-100), or 0 if nothing was recorded.
+uint64_t LatencyHistogram_GetPercentile(const LatencyHistogram *histogram,
+                                        double percentile);
+void LatencyHistogram_Log(const LatencyHistogram *histogram, const char *name);
+
+// Records usec for the given stage, if the stage's start time is known.
+void Stats_RecordStage(LatencyStage stage, uint64_t start_usec, uint64_t end_usec);
+
+void Stats_Log();
@@ -0,0 +1,184 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "timerwheel.h"
+
+#include "loop.h"
+#include "utils.h"
+
+#include <systemd/sd-event.h>
+
+// 256 slots of 5ms cover 1.28s, longer than any gesture timeout. Entries further out wait
+// in their slot for as many turns of the wheel as needed.
+static const uint64_t kTickUsec = 5000;
+enum { kTimerWheelSlots = 256 };
+
+struct TimerWheel {
+  sd_event_source *source;
+
+  // The last tick whose slot was processed.
+  uint64_t current_tick;
+  // The tick the timer is set for, or 0 if it is off.
+  uint64_t armed_tick;
+  size_t entry_count;
+
+  TimerWheelEntry *slots[kTimerWheelSlots];
+};
+
+static uint64_t GetTick(uint64_t usec) { return usec / kTickUsec; }
+
+static void Unlink(TimerWheel *wheel, TimerWheelEntry *entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    *entry->slot = entry->next;
+  }
+
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  }
+
+  entry->slot = NULL;
+  entry->prev = entry->next = NULL;
+  wheel->entry_count--;
+}
+
+// Returns the tick of the slot the entry went into.
+static uint64_t Link(TimerWheel *wheel, TimerWheelEntry *entry) {
+  // Round up, so entries never fire early, and never go into a slot already processed.
+  uint64_t tick = GetTick(entry->deadline_usec + kTickUsec - 1);
+  if (tick <= wheel->current_tick) {
+    tick = wheel->current_tick + 1;
+  }
+
+  entry->slot = &wheel->slots[tick % kTimerWheelSlots];
+  entry->prev = NULL;
+  entry->next = *entry->slot;
+  if (entry->next != NULL) {
+    entry->next->prev = entry;
+  }
+
+  *entry->slot = entry;
+  wheel->entry_count++;
+  return tick;
+}
+
+static void Arm(TimerWheel *wheel, uint64_t tick) {
+  int rc = 0;
+  if ((rc = sd_event_source_set_time(wheel->source, tick * kTickUsec)) < 0 ||
+      (rc = sd_event_source_set_enabled(wheel->source, SD_EVENT_ONESHOT)) < 0) {
+    LogErrno(-rc, "Failed to arm timer wheel");
+    return;
+  }
+
+  wheel->armed_tick = tick;
+}
+
+// Arms the timer for the next slot with anything in it.
+static void Rearm(TimerWheel *wheel) {
+  if (wheel->entry_count == 0) {
+    int rc = 0;
+    if ((rc = sd_event_source_set_enabled(wheel->source, SD_EVENT_OFF)) < 0) {
+      LogErrno(-rc, "Failed to disable timer wheel");
+    }
+
+    wheel->armed_tick = 0;
+    return;
+  }
+
+  uint64_t tick = wheel->current_tick + 1;
+  while (wheel->slots[tick % kTimerWheelSlots] == NULL) {
+    tick++;
+  }
+
+  Arm(wheel, tick);
+}
+
+static int OnTick(sd_event_source *source, uint64_t usec, void *userdata) {
+  TimerWheel *wheel = userdata;
+  uint64_t now_tick = GetTick(GetMonotonicUsec());
+
+  // After a long stall, every slot needs a look but only once.
+  uint64_t tick = wheel->current_tick + 1;
+  if (now_tick - wheel->current_tick > kTimerWheelSlots) {
+    tick = now_tick - kTimerWheelSlots + 1;
+  }
+
+  for (; tick <= now_tick; tick++) {
+    wheel->current_tick = tick;
+
+    TimerWheelEntry **slot = &wheel->slots[tick % kTimerWheelSlots];
+    for (TimerWheelEntry *entry = *slot; entry != NULL;) {
+      TimerWheelEntry *next = entry->next;
+
+      if (GetTick(entry->deadline_usec + kTickUsec - 1) <= tick) {
+        Unlink(wheel, entry);
+        // The callback may schedule or cancel any other entry, including next.
+        entry->callback(entry, entry->userdata);
+        next = *slot;
+      }
+
+      entry = next;
+    }
+  }
+
+  wheel->current_tick = now_tick;
+  wheel->armed_tick = 0;
+  Rearm(wheel);
+  return 0;
+}
+
+TimerWheel *TimerWheel_New(sd_event *event) {
+  CLEANUP_AUTOPTR(TimerWheel) wheel = Alloc(sizeof(TimerWheel));
+  wheel->current_tick = GetTick(GetMonotonicUsec());
+
+  // An accuracy of 1us, since the default lets sd-event delay the timer by up to 250ms.
+  int rc = 0;
+  if ((rc = Loop_AddTime(event, &wheel->source, CLOCK_MONOTONIC, 0, 1, OnTick, wheel,
+                         "timer-wheel")) < 0 ||
+      (rc = sd_event_source_set_enabled(wheel->source, SD_EVENT_OFF)) < 0) {
+    LogErrno(-rc, "Failed to add timer wheel source");
+    return NULL;
+  }
+
+  return STEAL_POINTER(&wheel);
+}
+
+void TimerWheel_Free(TimerWheel *wheel) {
+  for (size_t i = 0; i < kTimerWheelSlots; i++) {
+    while (wheel->slots[i] != NULL) {
+      Unlink(wheel, wheel->slots[i]);
+    }
+  }
+
+  sd_event_source_disable_unref(STEAL_POINTER(&wheel->source));
+  free(wheel);
+}
+
+void TimerWheel_Schedule(TimerWheel *wheel, TimerWheelEntry *entry,
+                         uint64_t deadline_usec, TimerWheel_Callback callback,
+                         void *userdata) {
+  if (TimerWheelEntry_IsScheduled(entry)) {
+    Unlink(wheel, entry);
+  } else if (wheel->entry_count == 0) {
+    // Nothing was pending, so skip straight past the idle ticks.
+    wheel->current_tick = GetTick(GetMonotonicUsec());
+  }
+
+  entry->deadline_usec = deadline_usec;
+  entry->callback = callback;
+  entry->userdata = userdata;
+
+  // Cancelled entries don't disarm the timer, so it only ever needs to be moved earlier.
+  uint64_t tick = Link(wheel, entry);
+  if (wheel->armed_tick == 0 || tick < wheel->armed_tick) {
+    Arm(wheel, tick);
+  }
+}
+
+void TimerWheel_Cancel(TimerWheel *wheel, TimerWheelEntry *entry) {
+  if (TimerWheelEntry_IsScheduled(entry)) {
+    Unlink(wheel, entry);
+  }
+}
@@ -0,0 +1,46 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <systemd/sd-event.h>
+
+typedef struct TimerWheel TimerWheel;
+typedef struct TimerWheelEntry TimerWheelEntry;
+
+typedef void (*TimerWheel_Callback)(TimerWheelEntry *entry, void *userdata);
+
+// A timeout in a TimerWheel, embedded in whatever it belongs to.
+struct TimerWheelEntry {
+  uint64_t deadline_usec;
+  TimerWheel_Callback callback;
+  void *userdata;
+
+  // Set while the entry is scheduled.
+  TimerWheelEntry **slot;
+  TimerWheelEntry *prev;
+  TimerWheelEntry *next;
+};
+
+// Many short timeouts driven by a single sd-event timer, with constant time scheduling
+// and cancellation. Timeouts fire up to one tick (5ms) late.
+TimerWheel *TimerWheel_New(sd_event *event);
+void TimerWheel_Free(TimerWheel *wheel);
+
+// Schedules entry to run callback at deadline_usec on CLOCK_MONOTONIC, replacing any
+// previous schedule of the same entry.
+void TimerWheel_Schedule(TimerWheel *wheel, TimerWheelEntry *entry,
+                         uint64_t deadline_usec, TimerWheel_Callback callback,
+                         void *userdata);
+void TimerWheel_Cancel(TimerWheel *wheel, TimerWheelEntry *entry);
+
+ATTR_NO_WARN_UNUSED static bool TimerWheelEntry_IsScheduled(
+    const TimerWheelEntry *entry) {
+  return entry->slot != NULL;
+}
+
+CLEANUP_AUTOPTR_DEFINE(TimerWheel, TimerWheel_Free)
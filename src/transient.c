@@ -0,0 +1,333 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "transient.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+const char kSystemdService[] = "org.freedesktop.systemd1";
+const char kSystemdObject[] = "/org/freedesktop/systemd1";
+const char kSystemdManagerInterface[] = "org.freedesktop.systemd1.Manager";
+const char kSystemdManagerStartTransientUnit[] = "StartTransientUnit";
+const char kSystemdJobInterface[] = "org.freedesktop.systemd1.Job";
+
+static const char kJobResultDone[] = "done";
+static const size_t kInitialPasswdBufferSize = 1024;
+
+#ifdef PUCRO_BENCH_HOOKS
+// If set, every user's bus is reached at this address instead, so benchmarks can run
+// against a private bus without any real user sessions.
+static const char kUserBusAddressEnv[] = "PUCRO_USER_BUS_ADDRESS";
+
+static sd_bus *ConnectToAddress(const char *address) {
+  CLEANUP(sd_bus_unrefp) sd_bus *bus = NULL;
+  int rc = 0;
+
+  if ((rc = sd_bus_new(&bus)) < 0) {
+    LogErrno(-rc, "Failed to create bus");
+    return NULL;
+  }
+
+  if ((rc = sd_bus_set_address(bus, address)) < 0 ||
+      (rc = sd_bus_set_bus_client(bus, true)) < 0) {
+    LogErrno(-rc, "Failed to set up bus for %s", address);
+    return NULL;
+  }
+
+  if ((rc = sd_bus_start(bus)) < 0) {
+    LogErrno(-rc, "Failed to connect to %s", address);
+    return NULL;
+  }
+
+  return STEAL_POINTER(&bus);
+}
+#endif
+
+sd_bus *TransientUnit_ConnectToUserBus(const char *user) {
+#ifdef PUCRO_BENCH_HOOKS
+  const char *address = getenv(kUserBusAddressEnv);
+  if (address != NULL) {
+    return ConnectToAddress(address);
+  }
+#endif
+
+  CLEANUP(sd_bus_unrefp) sd_bus *bus = NULL;
+  int rc = 0;
+
+  CLEANUP_AUTOFREE char *machine = NULL;
+  if (asprintf(&machine, "%s@", user) == -1) {
+    abort();
+  }
+
+  if ((rc = sd_bus_open_user_machine(&bus, machine)) < 0) {
+    LogErrno(-rc, "Failed to connect to %s bus", user);
+    return NULL;
+  }
+
+  return STEAL_POINTER(&bus);
+}
+
+char *TransientUnit_GetLoginShell(const char *user) {
+  struct passwd pwd, *result = NULL;
+  CLEANUP_AUTOFREE char *buffer = NULL;
+
+  // Reentrant, since the daemon looks up shells on several worker threads at once.
+  int rc = 0;
+  for (size_t size = kInitialPasswdBufferSize;; size *= 2) {
+    free(buffer);
+    buffer = Alloc(size);
+    if ((rc = getpwnam_r(user, &pwd, buffer, size, &result)) != ERANGE) {
+      break;
+    }
+  }
+
+  if (result == NULL) {
+    LogErrno(rc != 0 ? rc : ENOENT, "Failed to look up user %s", user);
+    return NULL;
+  }
+
+  return StrDup(pwd.pw_shell);
+}
+
+// Appends the ExecStart property, as an array with a single (path, argv, ignore failure)
+// entry.
+static int AppendExecStart(sd_bus_message *message, char *const *argv) {
+  int rc = 0;
+  if ((rc = sd_bus_message_open_container(message, 'r', "sv")) < 0 ||
+      (rc = sd_bus_message_append(message, "s", "ExecStart")) < 0 ||
+      (rc = sd_bus_message_open_container(message, 'v', "a(sasb)")) < 0 ||
+      (rc = sd_bus_message_open_container(message, 'a', "(sasb)")) < 0 ||
+      (rc = sd_bus_message_open_container(message, 'r', "sasb")) < 0 ||
+      (rc = sd_bus_message_append(message, "s", argv[0])) < 0 ||
+      (rc = sd_bus_message_append_strv(message, (char **)argv)) < 0 ||
+      (rc = sd_bus_message_append(message, "b", false)) < 0 ||
+      (rc = sd_bus_message_close_container(message)) < 0 ||
+      (rc = sd_bus_message_close_container(message)) < 0 ||
+      (rc = sd_bus_message_close_container(message)) < 0) {
+    return rc;
+  }
+
+  return sd_bus_message_close_container(message);
+}
+
+sd_bus_message *TransientUnit_NewStartMessage(sd_bus *bus, const char *unit_name,
+                                              const TransientCommand *command) {
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *message = NULL;
+  int rc = 0;
+
+  if ((rc = sd_bus_message_new_method_call(bus, &message, kSystemdService, kSystemdObject,
+                                           kSystemdManagerInterface,
+                                           kSystemdManagerStartTransientUnit)) < 0) {
+    LogErrno(-rc, "Failed to create StartTransientUnit call");
+    return NULL;
+  }
+
+  char *const shell_argv[] = {(char *)command->shell, "-c", (char *)command->command,
+                              NULL};
+  char *const *argv = command->argv != NULL ? command->argv : shell_argv;
+
+  if ((rc = sd_bus_message_append(message, "ss", unit_name, "replace")) < 0 ||
+      (rc = sd_bus_message_open_container(message, 'a', "(sv)")) < 0 ||
+      (rc = AppendExecStart(message, argv)) < 0 ||
+      (rc = sd_bus_message_close_container(message)) < 0 ||
+      // No auxiliary units.
+      (rc = sd_bus_message_append(message, "a(sa(sv))", 0)) < 0) {
+    LogErrno(-rc, "Failed to build StartTransientUnit call");
+    return NULL;
+  }
+
+  return STEAL_POINTER(&message);
+}
+
+bool TransientUnit_WatchJobs(sd_bus *bus, sd_bus_slot **slot,
+                             sd_bus_message_handler_t handler, void *userdata) {
+  int rc = 0;
+
+  // Both calls are queued ahead of any StartTransientUnit call, which the bus handles in
+  // order, so the match is in place before any job exists.
+  if ((rc = sd_bus_match_signal_async(bus, slot, kSystemdService, kSystemdObject,
+                                      kSystemdManagerInterface, "JobRemoved", handler,
+                                      NULL, userdata)) < 0) {
+    LogErrno(-rc, "Failed to watch for removed jobs");
+    return false;
+  }
+
+  if ((rc = sd_bus_call_method_async(bus, NULL, kSystemdService, kSystemdObject,
+                                     kSystemdManagerInterface, "Subscribe", NULL, NULL,
+                                     NULL)) < 0) {
+    LogErrno(-rc, "Failed to subscribe to systemd signals");
+    return false;
+  }
+
+  return true;
+}
+
+bool TransientUnit_ReadJobRemoved(sd_bus_message *message, const char **job_path,
+                                  const char **unit_name, const char **result) {
+  uint32_t id = 0;
+  int rc = 0;
+  if ((rc = sd_bus_message_read(message, "uoss", &id, job_path, unit_name, result)) < 0) {
+    LogErrno(-rc, "Failed to read JobRemoved signal");
+    return false;
+  }
+
+  return true;
+}
+
+bool TransientUnit_IsJobResultSuccess(const char *result) {
+  return strcmp(result, kJobResultDone) == 0;
+}
+
+void TransientUnit_CancelStart(sd_bus *bus, const char *unit_name, const char *job_path) {
+  int rc = 0;
+  if (job_path != NULL) {
+    rc = sd_bus_call_method_async(bus, NULL, kSystemdService, job_path,
+                                  kSystemdJobInterface, "Cancel", NULL, NULL, NULL);
+  } else {
+    // Without the job, which only the reply to StartTransientUnit has, stopping the unit
+    // cancels the start just the same.
+    rc = sd_bus_call_method_async(bus, NULL, kSystemdService, kSystemdObject,
+                                  kSystemdManagerInterface, "StopUnit", NULL, NULL, "ss",
+                                  unit_name, "replace");
+  }
+
+  if (rc < 0) {
+    LogErrno(-rc, "Failed to cancel start of %s", unit_name);
+  }
+}
+
+typedef struct TransientJobWait TransientJobWait;
+
+struct TransientJobWait {
+  const char *unit_name;
+  // Only known once StartTransientUnit replied.
+  char *job_path;
+  // Set once the job was removed.
+  char *result;
+};
+
+static void TransientJobWait_Clear(TransientJobWait *wait) {
+  free(STEAL_POINTER(&wait->job_path));
+  free(STEAL_POINTER(&wait->result));
+}
+
+static int OnJobRemoved(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+  TransientJobWait *wait = userdata;
+
+  const char *job_path = NULL, *unit_name = NULL, *result = NULL;
+  if (!TransientUnit_ReadJobRemoved(message, &job_path, &unit_name, &result) ||
+      strcmp(unit_name, wait->unit_name) != 0 ||
+      (wait->job_path != NULL && strcmp(job_path, wait->job_path) != 0)) {
+    return 0;
+  }
+
+  free(wait->result);
+  wait->result = StrDup(result);
+  return 0;
+}
+
+static TransientResult WaitForJob(sd_bus *bus, TransientJobWait *wait,
+                                  uint64_t deadline_usec) {
+  while (wait->result == NULL) {
+    int rc = 0;
+    if ((rc = sd_bus_process(bus, NULL)) < 0) {
+      LogErrno(-rc, "Failed to process bus messages");
+      return kTransientResultFailed;
+    } else if (rc > 0) {
+      continue;
+    }
+
+    uint64_t now = GetMonotonicUsec();
+    if (now >= deadline_usec) {
+      LogError("Unit %s did not start in time, canceling", wait->unit_name);
+      TransientUnit_CancelStart(bus, wait->unit_name, wait->job_path);
+      sd_bus_flush(bus);
+      return kTransientResultTimedOut;
+    }
+
+    if ((rc = sd_bus_wait(bus, deadline_usec - now)) < 0) {
+      LogErrno(-rc, "Failed to wait for bus messages");
+      return kTransientResultFailed;
+    }
+  }
+
+  if (!TransientUnit_IsJobResultSuccess(wait->result)) {
+    LogError("Unit %s failed to start: %s", wait->unit_name, wait->result);
+    return kTransientResultFailed;
+  }
+
+  return kTransientResultStarted;
+}
+
+static TransientResult RunCommandAsTransientUnit(sd_bus *bus, const char *unit_name,
+                                                 const TransientCommand *command,
+                                                 uint64_t timeout_usec) {
+  uint64_t deadline_usec = GetMonotonicUsec() + timeout_usec;
+
+  CLEANUP(sd_bus_slot_unrefp) sd_bus_slot *slot = NULL;
+  CLEANUP(TransientJobWait_Clear) TransientJobWait wait = {.unit_name = unit_name};
+  if (!TransientUnit_WatchJobs(bus, &slot, OnJobRemoved, &wait)) {
+    return kTransientResultFailed;
+  }
+
+  CLEANUP(sd_bus_message_unrefp)
+  sd_bus_message *message = TransientUnit_NewStartMessage(bus, unit_name, command);
+  if (message == NULL) {
+    return kTransientResultFailed;
+  }
+
+  CLEANUP(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+  CLEANUP(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+
+  if (sd_bus_call(bus, message, timeout_usec, &error, &reply) < 0) {
+    LogError("Failed to start transient unit %s: %s: %s", unit_name, error.name,
+             error.message);
+    return kTransientResultFailed;
+  }
+
+  const char *job_path = NULL;
+  int rc = 0;
+  if ((rc = sd_bus_message_read(reply, "o", &job_path)) < 0) {
+    LogErrno(-rc, "Failed to read job of %s", unit_name);
+    return kTransientResultFailed;
+  }
+
+  wait.job_path = StrDup(job_path);
+  return WaitForJob(bus, &wait, deadline_usec);
+}
+
+TransientResult TransientUnit_RunAsUser(const char *unit_name,
+                                        const TransientCommand *command,
+                                        const char *user, uint64_t timeout_usec) {
+  CLEANUP(sd_bus_unrefp) sd_bus *bus = TransientUnit_ConnectToUserBus(user);
+  if (bus == NULL) {
+    LogError("Failed to connect to user bus %s", user);
+    return kTransientResultFailed;
+  }
+
+  TransientCommand resolved = *command;
+  CLEANUP_AUTOFREE char *login_shell = NULL;
+  if (resolved.argv == NULL && resolved.shell == NULL) {
+    resolved.shell = login_shell = TransientUnit_GetLoginShell(user);
+    if (resolved.shell == NULL) {
+      LogError("Failed to get login shell");
+      return kTransientResultFailed;
+    }
+  }
+
+  TransientResult result =
+      RunCommandAsTransientUnit(bus, unit_name, &resolved, timeout_usec);
+  if (result != kTransientResultStarted) {
+    LogError("Failed to run transient unit for: %s", command->command);
+  }
+
+  return result;
+}
@@ -0,0 +1,56 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "utils.h"
+
+#include <systemd/sd-bus.h>
+
+typedef struct TransientCommand TransientCommand;
+
+// What a transient unit runs: argv as is if set, or else command with shell -c.
+struct TransientCommand {
+  // Always set, since it is also what gets logged.
+  const char *command;
+  // The shell to run command with, or NULL for the user's login shell.
+  const char *shell;
+  // An argv with an absolute argv[0], which skips the shell altogether.
+  char *const *argv;
+};
+
+typedef enum {
+  kTransientResultStarted = 0,
+  kTransientResultFailed = 1,
+  // The unit didn't start in time, and starting it was given up on. These double as the
+  // exit statuses of dispatch processes, which use 2 for usage errors.
+  kTransientResultTimedOut = 3,
+} TransientResult;
+
+sd_bus *TransientUnit_ConnectToUserBus(const char *user);
+char *TransientUnit_GetLoginShell(const char *user);
+
+// Builds the StartTransientUnit call for command, whose shell must be set unless it has
+// an argv.
+sd_bus_message *TransientUnit_NewStartMessage(sd_bus *bus, const char *unit_name,
+                                              const TransientCommand *command);
+
+// Has handler called for the JobRemoved signals of the user's systemd instance, which
+// are read with TransientUnit_ReadJobRemoved. Nothing is waited for, but the signals are
+// guaranteed to arrive for jobs of units started afterwards.
+bool TransientUnit_WatchJobs(sd_bus *bus, sd_bus_slot **slot,
+                             sd_bus_message_handler_t handler, void *userdata);
+bool TransientUnit_ReadJobRemoved(sd_bus_message *message, const char **job_path,
+                                  const char **unit_name, const char **result);
+bool TransientUnit_IsJobResultSuccess(const char *result);
+
+// Asks systemd to give up on starting unit_name, by canceling job_path if known or else
+// stopping the unit, without waiting for a reply.
+void TransientUnit_CancelStart(sd_bus *bus, const char *unit_name, const char *job_path);
+
+// Synchronously starts command as a transient unit named unit_name on user's bus, and
+// waits for up to timeout_usec for its start job to complete.
+TransientResult TransientUnit_RunAsUser(const char *unit_name,
+                                        const TransientCommand *command,
+                                        const char *user, uint64_t timeout_usec);
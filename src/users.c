@@ -0,0 +1,334 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "users.h"
+
+#include "src/loop.h"
+#include "src/utils.h"
+#include "src/workers.h"
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/inotify.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+#include <uthash.h>
+
+static const uint64_t kUserInfoTtlUsec = 10 * 60 * 1000000ull;
+// Far more users than log in on the seats of a single machine.
+static const unsigned int kMaxUsers = 256;
+static const size_t kDefaultNssBufferSize = 16384;
+
+static const char kNssFilesDir[] = "/etc";
+static const char *kNssFiles[] = {"passwd", "group"};
+
+typedef struct UserLookup UserLookup;
+
+// A lookup handed to the worker pool, which keeps it until its done callback ran.
+struct UserLookup {
+  // Cleared if the cache is freed while the lookup is still running.
+  UserCache *cache;
+  uint64_t generation;
+
+  char *user;
+  // Written by the worker.
+  UserInfo *result;
+};
+
+struct UserCache {
+  sd_event *event;
+  WorkerPool *pool;
+  UserInfo *users;
+
+  // Bumped whenever the NSS files change, so that lookups started before that are
+  // repeated.
+  uint64_t generation;
+
+  sd_event_source *inotify_source;
+
+  // The lookup being done by the pool, if any. Users are looked up one at a time.
+  UserLookup *lookup;
+};
+
+static void UserInfo_Clear(UserInfo *info) {
+  free(STEAL_POINTER(&info->shell));
+  StrvFree(STEAL_POINTER(&info->groups));
+  info->exists = false;
+}
+
+static void UserInfo_Free(UserInfo *info) {
+  UserInfo_Clear(info);
+  free(info->name);
+  free(info);
+}
+
+static void UserLookup_Free(UserLookup *lookup) {
+  UserInfo_Free(STEAL_POINTER(&lookup->result));
+  free(STEAL_POINTER(&lookup->user));
+  free(lookup);
+}
+
+CLEANUP_AUTOPTR_DEFINE(UserLookup, UserLookup_Free)
+
+static size_t GetInitialBufferSize(int name) {
+  long size = sysconf(name);
+  return size > 0 ? (size_t)size : kDefaultNssBufferSize;
+}
+
+// Returns the name of gid, or NULL if it doesn't exist or the lookup failed.
+static char *GetGroupName(gid_t gid) {
+  struct group grp, *result = NULL;
+  CLEANUP_AUTOFREE char *buffer = NULL;
+
+  int rc = 0;
+  for (size_t size = GetInitialBufferSize(_SC_GETGR_R_SIZE_MAX);; size *= 2) {
+    free(buffer);
+    buffer = Alloc(size);
+    if ((rc = getgrgid_r(gid, &grp, buffer, size, &result)) != ERANGE) {
+      break;
+    }
+  }
+
+  if (result == NULL) {
+    if (rc != 0) {
+      LogErrno(rc, "Failed to look up group %u", (unsigned int)gid);
+    }
+    return NULL;
+  }
+
+  return StrDup(grp.gr_name);
+}
+
+static char **GetGroupNames(const char *user, gid_t gid) {
+  int count = 16;
+  CLEANUP_AUTOFREE gid_t *gids = NULL;
+  for (;;) {
+    gids = realloc(gids, sizeof(gid_t) * count);
+    if (gids == NULL) {
+      abort();
+    }
+
+    // On failure, count is set to the number needed.
+    int previous_count = count;
+    if (getgrouplist(user, gid, gids, &count) != -1) {
+      break;
+    }
+
+    if (count <= previous_count) {
+      count = previous_count * 2;
+    }
+  }
+
+  char **names = Alloc(sizeof(char *) * (count + 1));
+  size_t found = 0;
+  for (int i = 0; i < count; i++) {
+    char *name = GetGroupName(gids[i]);
+    if (name != NULL) {
+      names[found++] = name;
+    }
+  }
+
+  return names;
+}
+
+// Runs on the worker, and so mustn't touch anything but info.
+static void ResolveUser(const char *user, UserInfo *info) {
+  struct passwd pwd, *result = NULL;
+  CLEANUP_AUTOFREE char *buffer = NULL;
+
+  int rc = 0;
+  for (size_t size = GetInitialBufferSize(_SC_GETPW_R_SIZE_MAX);; size *= 2) {
+    free(buffer);
+    buffer = Alloc(size);
+    if ((rc = getpwnam_r(user, &pwd, buffer, size, &result)) != ERANGE) {
+      break;
+    }
+  }
+
+  if (result == NULL) {
+    if (rc != 0) {
+      LogErrno(rc, "Failed to look up user %s", user);
+    } else {
+      LogInfo("User %s does not exist", user);
+    }
+    return;
+  }
+
+  info->exists = true;
+  info->uid = pwd.pw_uid;
+  info->gid = pwd.pw_gid;
+  info->shell = StrDup(pwd.pw_shell);
+  info->groups = GetGroupNames(user, pwd.pw_gid);
+}
+
+static void ResolveOnWorker(void *userdata) {
+  UserLookup *lookup = userdata;
+  ResolveUser(lookup->user, lookup->result);
+}
+
+static void OnLookupDone(void *userdata);
+
+static void StartNextLookup(UserCache *cache) {
+  if (cache->lookup != NULL) {
+    return;
+  }
+
+  UserInfo *info = cache->users;
+  while (info != NULL && !info->refreshing) {
+    info = info->hh.next;
+  }
+
+  if (info == NULL) {
+    return;
+  }
+
+  LogDebug("Looking up user %s", info->name);
+
+  UserLookup *lookup = Alloc(sizeof(UserLookup));
+  lookup->cache = cache;
+  lookup->generation = cache->generation;
+  lookup->user = StrDup(info->name);
+  lookup->result = Alloc(sizeof(UserInfo));
+
+  cache->lookup = lookup;
+  WorkerPool_Submit(cache->pool, ResolveOnWorker, OnLookupDone, lookup);
+}
+
+static void OnLookupDone(void *userdata) {
+  CLEANUP_AUTOPTR(UserLookup) lookup = userdata;
+  UserCache *cache = lookup->cache;
+  if (cache == NULL) {
+    return;
+  }
+
+  cache->lookup = NULL;
+  UserInfo *result = lookup->result;
+
+  UserInfo *info = NULL;
+  HASH_FIND_STR(cache->users, lookup->user, info);
+  if (info != NULL) {
+    UserInfo_Clear(info);
+    info->exists = result->exists;
+    info->uid = result->uid;
+    info->gid = result->gid;
+    info->shell = STEAL_POINTER(&result->shell);
+    info->groups = STEAL_POINTER(&result->groups);
+    info->resolved_usec = GetMonotonicUsec();
+    // The NSS files changed while the lookup ran, so it may be outdated already.
+    info->refreshing = lookup->generation != cache->generation;
+  }
+
+  StartNextLookup(cache);
+}
+
+static int OnNssFilesChanged(sd_event_source *source, const struct inotify_event *event,
+                             void *userdata) {
+  UserCache *cache = userdata;
+
+  bool changed = event->mask & IN_Q_OVERFLOW;
+  for (size_t i = 0; i < sizeof(kNssFiles) / sizeof(kNssFiles[0]) && !changed; i++) {
+    changed = event->len > 0 && strcmp(event->name, kNssFiles[i]) == 0;
+  }
+
+  if (!changed) {
+    return 0;
+  }
+
+  LogDebug("User or group database changed, refreshing %u users",
+           HASH_COUNT(cache->users));
+
+  cache->generation++;
+  for (UserInfo *info = cache->users; info != NULL; info = info->hh.next) {
+    info->refreshing = true;
+  }
+
+  StartNextLookup(cache);
+  return 0;
+}
+
+void UserCache_Free(UserCache *cache) {
+  sd_event_source_disable_unref(STEAL_POINTER(&cache->inotify_source));
+
+  // The pool frees the lookup once it is done.
+  if (cache->lookup != NULL) {
+    STEAL_POINTER(&cache->lookup)->cache = NULL;
+  }
+
+  UserInfo *info = NULL, *tmp = NULL;
+  HASH_ITER(hh, cache->users, info, tmp) {
+    HASH_DEL(cache->users, info);
+    UserInfo_Free(info);
+  }
+
+  free(cache);
+}
+
+UserCache *UserCache_New(sd_event *event, WorkerPool *pool) {
+  CLEANUP_AUTOPTR(UserCache) cache = Alloc(sizeof(UserCache));
+  cache->event = event;
+  cache->pool = pool;
+
+  int rc = 0;
+
+  // Tools like useradd and vipw replace the files by renaming a new one over them.
+  if ((rc = Loop_AddInotify(event, &cache->inotify_source, kNssFilesDir,
+                            IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR, OnNssFilesChanged,
+                            cache, "user-files-changed")) < 0) {
+    LogErrno(-rc, "Failed to watch %s for user database changes", kNssFilesDir);
+    return NULL;
+  }
+
+  return STEAL_POINTER(&cache);
+}
+
+static bool IsExpired(const UserInfo *info) {
+  return info->resolved_usec + kUserInfoTtlUsec < GetMonotonicUsec();
+}
+
+// Makes room for another user by dropping the one asked for least recently. A lookup
+// still running for them finds them gone once it's done, and is discarded.
+static void EvictLeastRecentlyUsed(UserCache *cache) {
+  UserInfo *oldest = cache->users;
+  for (UserInfo *info = cache->users; info != NULL; info = info->hh.next) {
+    if (info->used_usec < oldest->used_usec) {
+      oldest = info;
+    }
+  }
+
+  LogDebug("Evicting user %s from the cache", oldest->name);
+  HASH_DEL(cache->users, oldest);
+  UserInfo_Free(oldest);
+}
+
+static UserInfo *Prefetch(UserCache *cache, const char *user) {
+  UserInfo *info = NULL;
+  HASH_FIND_STR(cache->users, user, info);
+  if (info == NULL) {
+    if (HASH_COUNT(cache->users) >= kMaxUsers) {
+      EvictLeastRecentlyUsed(cache);
+    }
+
+    info = Alloc(sizeof(UserInfo));
+    info->name = StrDup(user);
+    info->refreshing = true;
+    HASH_ADD_STR(cache->users, name, info);
+  } else if (!info->refreshing && IsExpired(info)) {
+    info->refreshing = true;
+  }
+
+  info->used_usec = GetMonotonicUsec();
+  if (info->refreshing) {
+    StartNextLookup(cache);
+  }
+
+  return info;
+}
+
+void UserCache_Prefetch(UserCache *cache, const char *user) { Prefetch(cache, user); }
+
+const UserInfo *UserCache_Lookup(UserCache *cache, const char *user) {
+  const UserInfo *info = Prefetch(cache, user);
+  return info->resolved_usec != 0 && info->exists ? info : NULL;
+}
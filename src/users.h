@@ -0,0 +1,52 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "utils.h"
+#include "workers.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <systemd/sd-event.h>
+#include <uthash.h>
+
+typedef struct UserInfo UserInfo;
+typedef struct UserCache UserCache;
+
+struct UserInfo {
+  char *name;
+  // False if NSS didn't know the user, in which case only name is set.
+  bool exists;
+
+  uid_t uid;
+  gid_t gid;
+  char *shell;
+  // The names of the primary and supplementary groups.
+  char **groups;
+
+  // When the info was looked up, and whether it's being looked up again.
+  uint64_t resolved_usec;
+  bool refreshing;
+  // When the info was last asked for, so that the least recently used is evicted first.
+  uint64_t used_usec;
+
+  UT_hash_handle hh;
+};
+
+// Keeps the NSS info of the users seen on seats, looked up on the worker pool, since NSS
+// may be backed by the network. Entries are refreshed once they expire, and all of them
+// whenever /etc/passwd or /etc/group changes. Only the most recently used users are kept.
+UserCache *UserCache_New(sd_event *event, WorkerPool *pool);
+void UserCache_Free(UserCache *cache);
+
+// Starts looking up user if the cache has no fresh info on them.
+void UserCache_Prefetch(UserCache *cache, const char *user);
+
+// Returns the cached info of user without ever blocking, or NULL if it is not known yet
+// or the user doesn't exist. Expired info is still returned while it is refreshed. The
+// info may be evicted by the next call, so it must not be held on to.
+const UserInfo *UserCache_Lookup(UserCache *cache, const char *user);
+
+CLEANUP_AUTOPTR_DEFINE(UserCache, UserCache_Free)
@@ -6,11 +6,18 @@
 
 #include <stdio.h>
 #include <systemd/sd-daemon.h>
+#include <time.h>
 
 static const char kDebugEnv[] = "PUCRO_DEBUG";
 
 static bool g_debug_enabled = false;
 
+uint64_t GetMonotonicUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void SetupLogLevels() {
   const char *debug_env = getenv(kDebugEnv);
   if (debug_env != NULL && strcmp(debug_env, "1") == 0) {
@@ -18,13 +25,15 @@ void SetupLogLevels() {
   }
 }
 
+bool IsDebugLogEnabled() { return g_debug_enabled; }
+
 void LogV(const char *prefix, const char *fmt, va_list args) {
   fputs(prefix, stderr);
   vfprintf(stderr, fmt, args);
 }
 
 void LogDebug(const char *fmt, ...) {
-  if (!g_debug_enabled) {
+  if (!IsDebugLogEnabled()) {
     return;
   }
 
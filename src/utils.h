@@ -6,6 +6,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -57,7 +59,31 @@ ATTR_NO_WARN_UNUSED static char *StrDup(const char *str) {
   return buffer;
 }
 
+ATTR_NO_WARN_UNUSED static void StrvFree(char **strv) {
+  for (char **p = strv; p != NULL && *p != NULL; p++) {
+    free(*p);
+  }
+
+  free(strv);
+}
+
+ATTR_NO_WARN_UNUSED static void StrvFreeP(char ***strv) { StrvFree(STEAL_POINTER(strv)); }
+
+#define CLEANUP_STRV CLEANUP(StrvFreeP)
+
+ATTR_NO_WARN_UNUSED static void FCloseP(FILE **file) {
+  if (*file != NULL) {
+    fclose(STEAL_POINTER(file));
+  }
+}
+
+#define CLEANUP_FCLOSE CLEANUP(FCloseP)
+
+uint64_t GetMonotonicUsec();
+
 void SetupLogLevels();
+// For skipping the work of building debug messages that wouldn't be logged anyway.
+bool IsDebugLogEnabled();
 
 ATTR_FORMAT_PRINTF(1, 2) void LogDebug(const char *fmt, ...);
 ATTR_FORMAT_PRINTF(1, 2) void LogInfo(const char *fmt, ...);
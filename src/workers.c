@@ -0,0 +1,233 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "workers.h"
+
+#include "loop.h"
+#include "realtime.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+typedef struct WorkerJob WorkerJob;
+
+struct WorkerJob {
+  WorkerRunCallback run;
+  WorkerDoneCallback done;
+  void *userdata;
+
+  WorkerJob *next;
+};
+
+struct WorkerPool {
+  sd_event *event;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  // Jobs waiting for a worker, oldest first.
+  WorkerJob *queue_head;
+  WorkerJob **queue_tail;
+  bool stopping;
+
+  // Jobs that were run, newest first. Workers push onto it without taking the lock, and
+  // the loop takes all of them at once, so it needs neither a lock nor ABA protection.
+  _Atomic(WorkerJob *) finished;
+  // Signaled by a worker when it pushes onto an empty finished stack.
+  int done_fd;
+  sd_event_source *done_source;
+
+  pthread_t *threads;
+  size_t thread_count;
+};
+
+// Returns the oldest queued job, waiting for one unless the pool is stopping, in which
+// case NULL is returned once the queue is empty.
+static WorkerJob *TakeJob(WorkerPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+
+  while (pool->queue_head == NULL && !pool->stopping) {
+    pthread_cond_wait(&pool->wake, &pool->lock);
+  }
+
+  WorkerJob *job = pool->queue_head;
+  if (job != NULL) {
+    pool->queue_head = job->next;
+    if (pool->queue_head == NULL) {
+      pool->queue_tail = &pool->queue_head;
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return job;
+}
+
+static void PushFinished(WorkerPool *pool, WorkerJob *job) {
+  WorkerJob *head = atomic_load_explicit(&pool->finished, memory_order_relaxed);
+  do {
+    job->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&pool->finished, &head, job,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+
+  // Otherwise, the loop hasn't taken the jobs before this one yet and will get this one
+  // along with them.
+  if (head == NULL && eventfd_write(pool->done_fd, 1) == -1) {
+    LogErrno(errno, "Failed to signal finished job");
+  }
+}
+
+static void *RunWorker(void *data) {
+  WorkerPool *pool = data;
+
+  // Jobs block on the network and NSS, so they mustn't compete with reading input.
+  Realtime_ResetScheduler();
+
+  WorkerJob *job = NULL;
+  while ((job = TakeJob(pool)) != NULL) {
+    job->run(job->userdata);
+    PushFinished(pool, job);
+  }
+
+  return NULL;
+}
+
+static void RunDoneCallbacks(WorkerPool *pool) {
+  WorkerJob *job = atomic_exchange_explicit(&pool->finished, NULL, memory_order_acquire);
+
+  // Reverse the stack into the order the jobs finished in.
+  WorkerJob *ordered = NULL;
+  while (job != NULL) {
+    WorkerJob *next = job->next;
+    job->next = ordered;
+    ordered = job;
+    job = next;
+  }
+
+  while (ordered != NULL) {
+    WorkerJob *next = ordered->next;
+    ordered->done(ordered->userdata);
+    free(ordered);
+    ordered = next;
+  }
+}
+
+static int OnJobsDone(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+  WorkerPool *pool = userdata;
+
+  // Read before taking the jobs, so that a job pushed in between signals again.
+  eventfd_t value = 0;
+  if (eventfd_read(fd, &value) == -1 && errno != EAGAIN) {
+    LogErrno(errno, "Failed to read job completion");
+  }
+
+  RunDoneCallbacks(pool);
+  return 0;
+}
+
+void WorkerPool_Free(WorkerPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->thread_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  sd_event_source_disable_unref(STEAL_POINTER(&pool->done_source));
+
+  // Done callbacks may queue more jobs, which are run right here now that the workers
+  // are gone.
+  do {
+    RunDoneCallbacks(pool);
+
+    WorkerJob *job = NULL;
+    while ((job = TakeJob(pool)) != NULL) {
+      job->run(job->userdata);
+      PushFinished(pool, job);
+    }
+  } while (atomic_load(&pool->finished) != NULL);
+
+  if (pool->done_fd != -1) {
+    close(pool->done_fd);
+  }
+
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+static bool StartThreads(WorkerPool *pool, size_t thread_count) {
+  pool->threads = Alloc(sizeof(pthread_t) * thread_count);
+
+  // Workers inherit the signal mask, and must leave the signals handled through the
+  // loop's signalfd blocked.
+  sigset_t all_signals, old_mask;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+
+  int rc = 0;
+  while (pool->thread_count < thread_count) {
+    if ((rc = pthread_create(&pool->threads[pool->thread_count], NULL, RunWorker,
+                             pool)) != 0) {
+      LogErrno(rc, "Failed to start worker thread");
+      break;
+    }
+
+    pool->thread_count++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  // Fewer workers only make jobs wait longer.
+  return pool->thread_count > 0;
+}
+
+WorkerPool *WorkerPool_New(sd_event *event, size_t thread_count) {
+  CLEANUP_AUTOPTR(WorkerPool) pool = Alloc(sizeof(WorkerPool));
+  pool->event = event;
+  pool->queue_tail = &pool->queue_head;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+
+  pool->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pool->done_fd == -1) {
+    LogErrno(errno, "Failed to create worker eventfd");
+    return NULL;
+  }
+
+  int rc = 0;
+  if ((rc = Loop_AddIo(event, &pool->done_source, pool->done_fd, EPOLLIN, OnJobsDone,
+                       pool, "worker-done")) < 0) {
+    LogErrno(-rc, "Failed to monitor worker eventfd");
+    return NULL;
+  }
+
+  if (!StartThreads(pool, thread_count)) {
+    return NULL;
+  }
+
+  return STEAL_POINTER(&pool);
+}
+
+void WorkerPool_Submit(WorkerPool *pool, WorkerRunCallback run, WorkerDoneCallback done,
+                       void *userdata) {
+  WorkerJob *job = Alloc(sizeof(WorkerJob));
+  job->run = run;
+  job->done = done;
+  job->userdata = userdata;
+
+  pthread_mutex_lock(&pool->lock);
+  *pool->queue_tail = job;
+  pool->queue_tail = &job->next;
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,35 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// Runs blocking work, such as NSS lookups and connecting to user buses, on a small pool
+// of threads, so that it never holds up input handling on the loop. Jobs are queued from
+// the loop's thread, and their done callbacks are run back on the loop once they
+// finished, in the order they finished in.
+
+#include "utils.h"
+
+#include <stddef.h>
+#include <systemd/sd-event.h>
+
+typedef struct WorkerPool WorkerPool;
+
+// Runs on a worker thread, and so mustn't touch anything but what the job owns.
+typedef void (*WorkerRunCallback)(void *userdata);
+// Runs on the loop once the job's run callback returned.
+typedef void (*WorkerDoneCallback)(void *userdata);
+
+WorkerPool *WorkerPool_New(sd_event *event, size_t thread_count);
+
+// Waits for every queued job to run, and runs their done callbacks before returning. The
+// pool is meant to outlive the owners of its jobs, whose done callbacks therefore have to
+// cope with their owner being gone.
+void WorkerPool_Free(WorkerPool *pool);
+
+// Queues a job, which must be done from the loop's thread.
+void WorkerPool_Submit(WorkerPool *pool, WorkerRunCallback run, WorkerDoneCallback done,
+                       void *userdata);
+
+CLEANUP_AUTOPTR_DEFINE(WorkerPool, WorkerPool_Free)